@@ -0,0 +1,403 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#include <SantaBatch.hpp>
+#include <SantaWorkspace.hpp>
+#include "validation_functors.hpp"
+#include "stopwatch.hpp"
+
+#include <thrust/functional.h>
+#include <thrust/copy.h>
+#include <thrust/fill.h>
+#include <thrust/sequence.h>
+#include <thrust/transform.h>
+#include <thrust/sort.h>
+#include <thrust/binary_search.h>
+#include <thrust/reduce.h>
+#include <thrust/extrema.h>
+#include <thrust/gather.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+
+typedef SantaBatch::score_type score_type;
+typedef SantaBatch::stype      stype;
+typedef SantaBatch::dvector::const_iterator const_diter;
+
+// Packs (segment, z) into a key that sorts by segment and then by z
+struct segment_key_functor
+	: public thrust::binary_function<dtype, dtype, uint64_t> {
+	inline __host__ __device__
+	uint64_t operator()(dtype segment, dtype z) const {
+		// Note: Flipping the sign bit maps signed to unsigned order
+		return ((uint64_t)(uint32_t)segment << 32) |
+		       ((uint32_t)z ^ 0x80000000u);
+	}
+};
+
+// Checks the sleigh bounds of one present and, if its solution-local ID is
+//   within the problem, its dimensions
+struct batch_bounds_dims_functor
+	: public thrust::unary_function<void,validation_counts> {
+	bounds_functor bounds;
+	const stype*   widths;
+	const stype*   heights;
+	const stype*   depths;
+	dtype          nproblem;
+	batch_bounds_dims_functor(dtype        sleigh_size_,
+	                          const stype* widths_,
+	                          const stype* heights_,
+	                          const stype* depths_,
+	                          dtype        nproblem_)
+		: bounds(sleigh_size_),
+		  widths(widths_), heights(heights_), depths(depths_),
+		  nproblem(nproblem_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	validation_counts operator()(Tuple extrema_and_id) const {
+		validation_counts c = bounds(thrust::get<0>(extrema_and_id));
+		dtype id = thrust::get<1>(extrema_and_id);
+		if( id < nproblem ) {
+			c.dims = dim_mismatch_functor()(thrust::get<0>(extrema_and_id),
+			                                thrust::make_tuple(widths[id],
+			                                                   heights[id],
+			                                                   depths[id]));
+		}
+		return c;
+	}
+};
+
+// Packs (segment, zmax, id) into the fewest bits that sort by segment, then
+//   zmax descending, then ID ascending
+struct packed_score_key_functor
+	: public thrust::unary_function<void,uint64_t> {
+	dtype zmax_max;
+	int   zmax_bits;
+	int   id_bits;
+	packed_score_key_functor(dtype zmax_max_, int zmax_bits_, int id_bits_)
+		: zmax_max(zmax_max_), zmax_bits(zmax_bits_), id_bits(id_bits_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	uint64_t operator()(Tuple segment_zmax_id) const {
+		uint64_t segment = (uint32_t)thrust::get<0>(segment_zmax_id);
+		uint64_t z       = (uint32_t)(zmax_max - thrust::get<1>(segment_zmax_id));
+		uint64_t id      = (uint32_t)thrust::get<2>(segment_zmax_id);
+		return (((segment << zmax_bits) | z) << id_bits) | id;
+	}
+};
+// Returns abs(id - i) for a tuple of (score key, index), where id is in the
+//   low bits of the key
+struct key_abs_diff_tuple_functor
+	: public thrust::unary_function<void,score_type> {
+	uint64_t id_mask;
+	key_abs_diff_tuple_functor(uint64_t id_mask_) : id_mask(id_mask_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	score_type operator()(Tuple key_and_index) const {
+		score_type id = thrust::get<0>(key_and_index) & id_mask;
+		score_type i  = thrust::get<1>(key_and_index);
+		return id > i ? id - i : i - id;
+	}
+};
+
+// Returns the no. bits needed to represent values in [0, x]
+inline int bit_width(uint64_t x) {
+	int bits = 0;
+	while( x ) {
+		++bits;
+		x >>= 1;
+	}
+	return bits;
+}
+
+size_t SantaBatch::push_back(const SantaSolution& solution) {
+	size_t index = size();
+	size_t begin = present_count();
+	size_t n     = solution.size();
+	size_t end   = begin + n;
+	svector* xy_columns[4] = {&m_xminima, &m_xmaxima,
+	                          &m_yminima, &m_ymaxima};
+	SantaSolution::const_siter xy_sources[4] = {solution.xminima_begin(),
+	                                            solution.xmaxima_begin(),
+	                                            solution.yminima_begin(),
+	                                            solution.ymaxima_begin()};
+	for( int c=0; c<4; ++c ) {
+		xy_columns[c]->resize(end);
+		thrust::copy(xy_sources[c], xy_sources[c] + n,
+		             xy_columns[c]->begin() + begin);
+	}
+	m_zminima.resize(end);
+	m_zmaxima.resize(end);
+	thrust::copy(solution.zminima_begin(), solution.zminima_begin() + n,
+	             m_zminima.begin() + begin);
+	thrust::copy(solution.zmaxima_begin(), solution.zmaxima_begin() + n,
+	             m_zmaxima.begin() + begin);
+	m_segments.resize(end);
+	thrust::fill(m_segments.begin() + begin, m_segments.end(), dtype(index));
+	m_local_ids.resize(end);
+	thrust::sequence(m_local_ids.begin() + begin, m_local_ids.end());
+	m_offsets.push_back(end);
+	
+	m_tmp_ids.resize(end);
+	m_tmp_keys.resize(end);
+	return index;
+}
+
+// Sums the violation counts of each solution's presents
+void SantaBatch::count_violations(const SantaProblem&  problem,
+                                  std::vector<Result>& results) const {
+	PROFILE_SCOPE("bounds and dimensions");
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	using thrust::make_transform_iterator;
+	using thrust::raw_pointer_cast;
+	const stype* widths  = raw_pointer_cast(&problem.widths_begin()[0]);
+	const stype* heights = raw_pointer_cast(&problem.heights_begin()[0]);
+	const stype* depths  = raw_pointer_cast(&problem.depths_begin()[0]);
+	batch_bounds_dims_functor count_func(problem.sleigh_size(),
+	                                     widths, heights, depths,
+	                                     problem.size());
+	dvector                                segments(size());
+	thrust::device_vector<validation_counts> counts(size());
+	size_t nsegments =
+		thrust::reduce_by_key(m_segments.begin(), m_segments.end(),
+		                      make_transform_iterator(
+		                          make_zip_iterator(make_tuple(
+		                              make_zip_iterator(make_tuple(
+		                                  m_xminima.begin(),
+		                                  m_xmaxima.begin(),
+		                                  m_yminima.begin(),
+		                                  m_ymaxima.begin(),
+		                                  m_zminima.begin(),
+		                                  m_zmaxima.begin())),
+		                              m_local_ids.begin())),
+		                          count_func),
+		                      segments.begin(),
+		                      counts.begin(),
+		                      thrust::equal_to<dtype>(),
+		                      validation_counts_plus()).first
+		- segments.begin();
+	// Note: Solutions with no presents have no segment
+	std::vector<dtype>             h_segments(nsegments);
+	std::vector<validation_counts> h_counts(nsegments);
+	thrust::copy(segments.begin(), segments.begin() + nsegments,
+	             h_segments.begin());
+	thrust::copy(counts.begin(), counts.begin() + nsegments,
+	             h_counts.begin());
+	for( size_t s=0; s<nsegments; ++s ) {
+		const validation_counts& c = h_counts[s];
+		Result& r = results[h_segments[s]];
+		r.boundary_violations  = c.xmin + c.xmax + c.ymin + c.ymax + c.zmin;
+		r.dimension_mismatches = c.dims;
+	}
+}
+
+// Counts each solution's colliding pairs with one z-sweep over all of them
+// Note: Keying the sweep by (solution, z) keeps every z-overlap range within
+//         a single solution, and leaves each solution's rows in its own
+//         range of the sweep. The x/y extents are packed into sweep order
+//         and the pairs spread evenly over the workers, as in
+//         SantaSolution::count_collisions.
+void SantaBatch::count_collisions(std::vector<Result>& results) const {
+	PROFILE_SCOPE("count_collisions");
+	using thrust::make_permutation_iterator;
+	using thrust::raw_pointer_cast;
+	SantaWorkspacePool::Lease lease(0);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	size_t nrows = present_count();
+	dvector&                         ids        = workspace.m_ids;
+	dvector&                         range_ends = workspace.m_indices;
+	thrust::device_vector<uint64_t>& keys       = workspace.m_keys;
+	ids.resize(nrows);
+	range_ends.resize(nrows);
+	keys.resize(nrows);
+	TempBuffer<uint64_t> queries(allocator, nrows);
+	thrust::sequence(THRUST_PAR(allocator), ids.begin(), ids.end());
+	thrust::transform(THRUST_PAR(allocator),
+	                  m_segments.begin(), m_segments.end(),
+	                  m_zminima.begin(),
+	                  keys.begin(),
+	                  segment_key_functor());
+	thrust::sort_by_key(THRUST_PAR(allocator),
+	                    keys.begin(), keys.end(), ids.begin());
+	// Note: Each solution's rows stay in its own range, so the segment of
+	//         row i is just m_segments[i]
+	thrust::transform(THRUST_PAR(allocator),
+	                  m_segments.begin(), m_segments.end(),
+	                  make_permutation_iterator(m_zmaxima.begin(),
+	                                            ids.begin()),
+	                  queries.begin(),
+	                  segment_key_functor());
+	thrust::upper_bound(THRUST_PAR(allocator),
+	                    keys.begin(), keys.end(),
+	                    queries.begin(), queries.end(),
+	                    range_ends.begin());
+	PROFILE_SCOPE("sweep");
+	workspace.m_boxes.resize(4 * nrows);
+	const svector* columns[4] = {&m_xminima, &m_xmaxima,
+	                             &m_yminima, &m_ymaxima};
+	for( int c=0; c<4; ++c ) {
+		thrust::gather(THRUST_PAR(allocator),
+		               ids.begin(), ids.end(),
+		               columns[c]->begin(),
+		               workspace.m_boxes.begin() + c * nrows);
+	}
+	const stype* base = raw_pointer_cast(workspace.m_boxes.data());
+	packed_boxes<stype> boxes = {base, base + nrows,
+	                             base + 2*nrows, base + 3*nrows};
+	
+	std::vector<dtype> h_row_begins(m_offsets.begin(), m_offsets.end());
+	TempBuffer<dtype>     row_begins(allocator, size() + 1);
+	TempBuffer<dtype>     segments(allocator, size());
+	TempBuffer<long long> collisions(allocator, size());
+	thrust::copy(h_row_begins.begin(), h_row_begins.end(),
+	             row_begins.begin());
+	size_t nsegments =
+		reduce_pairs_balanced_by_segment(allocator,
+		                                 raw_pointer_cast(&range_ends[0]),
+		                                 nrows,
+		                                 row_begins.data(), size(),
+		                                 packed_collision_functor(boxes),
+		                                 segments.data(),
+		                                 collisions.data());
+	std::vector<dtype>     h_segments(size());
+	std::vector<long long> h_collisions(size());
+	thrust::copy(segments.begin(), segments.end(), h_segments.begin());
+	thrust::copy(collisions.begin(), collisions.end(), h_collisions.begin());
+	for( size_t s=0; s<nsegments; ++s ) {
+		results[h_segments[s]].collisions = int(h_collisions[s]);
+	}
+}
+
+// Scores every solution with one sort over all of them
+void SantaBatch::compute_scores(std::vector<Result>& results) const {
+	PROFILE_SCOPE("score");
+	// Produce each solution's IDs in score order, keeping the solutions in
+	//   their original places
+	using thrust::make_transform_iterator;
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	thrust::device_vector<uint64_t>& keys = m_tmp_keys;
+	thrust::pair<const_diter, const_diter> zmax_range =
+		thrust::minmax_element(m_zmaxima.begin(), m_zmaxima.end());
+	dtype zmax_min = *zmax_range.first;
+	dtype zmax_max = *zmax_range.second;
+	size_t max_size = 0;
+	for( size_t k=0; k<size(); ++k ) {
+		max_size = std::max(max_size, m_offsets[k+1] - m_offsets[k]);
+	}
+	int segment_bits = bit_width(size() - 1);
+	int zmax_bits    = bit_width((uint64_t)((long long)zmax_max - zmax_min));
+	int id_bits      = bit_width(max_size - 1);
+	uint64_t id_mask;
+	if( segment_bits + zmax_bits + id_bits <= 64 ) {
+		// Note: Typical batches need far fewer than 64 bits, so one sort
+		//         of packed keys is enough.
+		thrust::transform(make_zip_iterator(make_tuple(m_segments.begin(),
+		                                               m_zmaxima.begin(),
+		                                               m_local_ids.begin())),
+		                  make_zip_iterator(make_tuple(m_segments.end(),
+		                                               m_zmaxima.end(),
+		                                               m_local_ids.end())),
+		                  keys.begin(),
+		                  packed_score_key_functor(zmax_max, zmax_bits,
+		                                           id_bits));
+		thrust::sort(keys.begin(), keys.end());
+		id_mask = ((uint64_t)1 << id_bits) - 1;
+	}
+	else {
+		// Sort by (zmax, ID) and then stably by solution
+		dvector& segments = m_tmp_ids;
+		thrust::copy(m_segments.begin(), m_segments.end(), segments.begin());
+		thrust::transform(m_zmaxima.begin(), m_zmaxima.end(),
+		                  m_local_ids.begin(),
+		                  keys.begin(),
+		                  score_key_functor());
+		thrust::sort_by_key(keys.begin(), keys.end(), segments.begin());
+		thrust::stable_sort_by_key(segments.begin(), segments.end(),
+		                           keys.begin());
+		id_mask = 0xFFFFFFFFu;
+	}
+	// Note: Each solution now occupies its original range, so the index of
+	//         a key within its solution is just m_local_ids at its position.
+	dvector out_segments(size());
+	dvector zmaxima(size());
+	thrust::device_vector<score_type> sigmas(size());
+	size_t nsegments =
+		thrust::reduce_by_key(m_segments.begin(), m_segments.end(),
+		                      m_zmaxima.begin(),
+		                      out_segments.begin(),
+		                      zmaxima.begin(),
+		                      thrust::equal_to<dtype>(),
+		                      thrust::maximum<dtype>()).first
+		- out_segments.begin();
+	// sum(abs(IDs - index)) per solution
+	thrust::reduce_by_key(m_segments.begin(), m_segments.end(),
+	                      make_transform_iterator(
+	                          make_zip_iterator(make_tuple(keys.begin(),
+	                                                       m_local_ids.begin())),
+	                          key_abs_diff_tuple_functor(id_mask)),
+	                      out_segments.begin(),
+	                      sigmas.begin());
+	std::vector<dtype>      h_segments(nsegments);
+	std::vector<dtype>      h_zmaxima(nsegments);
+	std::vector<score_type> h_sigmas(nsegments);
+	thrust::copy(out_segments.begin(), out_segments.begin() + nsegments,
+	             h_segments.begin());
+	thrust::copy(zmaxima.begin(), zmaxima.begin() + nsegments,
+	             h_zmaxima.begin());
+	thrust::copy(sigmas.begin(), sigmas.begin() + nsegments,
+	             h_sigmas.begin());
+	for( size_t s=0; s<nsegments; ++s ) {
+		results[h_segments[s]].score = 2 * score_type(h_zmaxima[s]) +
+		                               h_sigmas[s];
+	}
+}
+
+size_t SantaBatch::evaluate(const SantaProblem&  problem,
+                            std::vector<Result>* results) const {
+	PROFILE_SCOPE("SantaBatch::evaluate");
+	Result zero = {false, 0, 0, 0, 0, 0};
+	std::vector<Result> r(size(), zero);
+	for( size_t k=0; k<size(); ++k ) {
+		size_t n = m_offsets[k+1] - m_offsets[k];
+		r[k].size_difference = int(n) - int(problem.size());
+	}
+	if( present_count() > 0 ) {
+		count_violations(problem, r);
+		count_collisions(r);
+		compute_scores(r);
+	}
+	size_t nvalid = 0;
+	for( size_t k=0; k<size(); ++k ) {
+		r[k].valid = (r[k].size_difference      == 0 &&
+		              r[k].boundary_violations  == 0 &&
+		              r[k].dimension_mismatches == 0 &&
+		              r[k].collisions           == 0);
+		nvalid += r[k].valid;
+	}
+	if( results ) {
+		results->swap(r);
+	}
+	return nvalid;
+}
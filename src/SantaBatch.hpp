@@ -0,0 +1,94 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+#include <vector>
+
+#include <thrust/device_vector.h>
+
+#include <stdint.h>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+
+// A batch of candidate solutions to the same problem, which are validated
+//   and scored together.
+// The solutions' extrema are concatenated, and each pass that validate and
+//   score would launch per solution is instead run once over the whole batch
+//   as a segmented operation (keyed by solution index).
+class SantaBatch {
+public:
+	typedef SantaSolution::dtype      dtype;
+	typedef SantaSolution::stype      stype;
+	typedef SantaSolution::dvector    dvector;
+	typedef SantaSolution::svector    svector;
+	typedef SantaSolution::score_type score_type;
+	// The counts that SantaSolution::validate returns, and the score
+	struct Result {
+		bool       valid;
+		int        size_difference;
+		int        boundary_violations;
+		int        dimension_mismatches;
+		int        collisions;
+		score_type score;
+	};
+private:
+	// Note: Each solution's presents are kept contiguous and in ID order
+	svector m_xminima, m_xmaxima;
+	svector m_yminima, m_ymaxima;
+	dvector m_zminima, m_zmaxima;
+	dvector m_segments;            // Solution index of each present
+	dvector m_local_ids;           // ID of each present in its solution
+	std::vector<size_t> m_offsets; // Start of each solution, plus the end
+	// Temporary spaces required for some of the algorithms
+	mutable dvector                         m_tmp_ids;
+	mutable thrust::device_vector<uint64_t> m_tmp_keys;
+	
+	void count_violations(const SantaProblem& problem,
+	                      std::vector<Result>& results) const;
+	void count_collisions(std::vector<Result>& results) const;
+	void compute_scores(std::vector<Result>& results) const;
+public:
+	inline SantaBatch();
+	// Appends a copy of solution to the batch and returns its index
+	size_t         push_back(const SantaSolution& solution);
+	inline void    clear();
+	// Returns the no. solutions in the batch
+	inline size_t  size() const;
+	// Returns the total no. presents in the batch
+	inline size_t  present_count() const;
+	// Validates and scores every solution in the batch
+	// Returns the no. valid solutions
+	size_t         evaluate(const SantaProblem&  problem_def,
+	                        std::vector<Result>* results) const;
+};
+SantaBatch::SantaBatch() : m_offsets(1, 0) {}
+void SantaBatch::clear() {
+	m_xminima.clear(); m_xmaxima.clear();
+	m_yminima.clear(); m_ymaxima.clear();
+	m_zminima.clear(); m_zmaxima.clear();
+	m_segments.clear();
+	m_local_ids.clear();
+	m_offsets.assign(1, 0);
+}
+size_t SantaBatch::size() const { return m_offsets.size() - 1; }
+size_t SantaBatch::present_count() const { return m_offsets.back(); }
@@ -0,0 +1,273 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#include <SantaGenerator.hpp>
+
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <limits>
+
+#include <thrust/transform.h>
+#include <thrust/iterator/counting_iterator.h>
+
+typedef SantaGenerator::dtype dtype;
+
+// Counter-based random numbers, so that any present can be generated
+//   independently of the others
+struct splitmix64 {
+	uint64_t state;
+	inline __host__ __device__
+	splitmix64(uint64_t seed, uint64_t stream)
+		: state(seed ^ (stream * 0x9E3779B97F4A7C15ull)) {}
+	inline __host__ __device__
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+	// Returns a uniform value in [0, 1)
+	inline __host__ __device__
+	double uniform() { return (next() >> 11) * (1. / 9007199254740992.); }
+};
+
+// Note: Separate streams for presents and cells
+enum { cell_stream_base = 0x40000000 };
+
+// Generates the dimensions and extrema of present i
+struct present_generator {
+	dtype    sleigh_size;
+	dtype    min_size;
+	dtype    max_size;
+	double   size_skew;
+	double   z_overlap;
+	dtype    cells_per_side;
+	dtype    cells_per_layer;
+	uint64_t count;
+	uint64_t seed;
+	uint64_t neligible;
+	uint64_t offset;
+	uint64_t inv_stride;
+	uint64_t collisions_end; // Injection k is a collision if k < this,
+	uint64_t boundary_end;   //   else a boundary violation if k < this,
+	uint64_t dimension_end;  //   else a dimension mismatch if k < this
+	
+	inline __host__ __device__
+	dtype side(splitmix64& rng) const {
+		double u = pow(rng.uniform(), size_skew);
+		dtype s = min_size + dtype(u * (max_size - min_size + 1));
+		return s < max_size ? s : max_size;
+	}
+	// Writes (xmin,xmax,ymin,ymax,zmin,zmax) to e and the problem's
+	//   (possibly reordered) dimensions to d
+	inline __host__ __device__
+	void operator()(dtype i, dtype* e, dtype* d) const {
+		splitmix64 rng(seed, i);
+		dtype w = side(rng);
+		dtype h = side(rng);
+		dtype l = side(rng);
+		unsigned rotation = rng.next() % 3;
+		dtype layer = i / cells_per_layer;
+		dtype cell  = i % cells_per_layer;
+		splitmix64 cell_rng(seed, cell_stream_base + (uint64_t)cell);
+		dtype phase = dtype(cell_rng.uniform() * z_overlap * max_size);
+		phase = phase < max_size ? phase : max_size - 1;
+		// Note: Cells are max_size apart in each dim, so presents in
+		//         different cells or layers never intersect.
+		long long x = (long long)(cell % cells_per_side) * max_size + 1;
+		long long y = (long long)(cell / cells_per_side) * max_size + 1;
+		long long z = (long long)layer * max_size + phase + 1;
+		e[0] = x; e[1] = x + w-1;
+		e[2] = y; e[3] = y + h-1;
+		e[4] = z; e[5] = z + l-1;
+		if( rotation == 0 )      { d[0] = w; d[1] = h; d[2] = l; }
+		else if( rotation == 1 ) { d[0] = h; d[1] = l; d[2] = w; }
+		else                     { d[0] = l; d[1] = w; d[2] = h; }
+		// Presents in even layers whose cell is also used in the next layer
+		//   are eligible for injections. Their neighbours in the next layer
+		//   never are, so injections cannot interact.
+		if( (layer % 2) != 0 || (uint64_t)i + cells_per_layer >= count ) {
+			return;
+		}
+		uint64_t eligible = (uint64_t)(layer / 2) * cells_per_layer + cell;
+		uint64_t k = (eligible + neligible - offset) % neligible
+		             * inv_stride % neligible;
+		if( k < collisions_end ) {
+			// Raise the present into the bottom of its neighbour above
+			dtype shift = max_size - l + 1;
+			e[4] += shift;
+			e[5] += shift;
+		}
+		else if( k < boundary_end ) {
+			// Translate the present (and its cell) out of the sleigh
+			e[0] += sleigh_size;
+			e[1] += sleigh_size;
+		}
+		else if( k < dimension_end ) {
+			d[0] += 1;
+		}
+	}
+};
+struct solution_generator_functor
+	: public thrust::unary_function<dtype, thrust::tuple<dtype,dtype,dtype,
+	                                                     dtype,dtype,dtype> > {
+	present_generator gen;
+	solution_generator_functor(present_generator gen_) : gen(gen_) {}
+	inline __host__ __device__
+	thrust::tuple<dtype,dtype,dtype,dtype,dtype,dtype>
+	operator()(dtype i) const {
+		dtype e[6], d[3];
+		gen(i, e, d);
+		return thrust::make_tuple(e[0], e[1], e[2], e[3], e[4], e[5]);
+	}
+};
+struct problem_generator_functor
+	: public thrust::unary_function<dtype, thrust::tuple<dtype,dtype,dtype> > {
+	present_generator gen;
+	problem_generator_functor(present_generator gen_) : gen(gen_) {}
+	inline __host__ __device__
+	thrust::tuple<dtype,dtype,dtype> operator()(dtype i) const {
+		dtype e[6], d[3];
+		gen(i, e, d);
+		return thrust::make_tuple(d[0], d[1], d[2]);
+	}
+};
+
+// Returns the inverse of a modulo m (where gcd(a, m) == 1)
+uint64_t mod_inverse(uint64_t a, uint64_t m) {
+	long long t = 0, new_t = 1;
+	long long r = m, new_r = a % m;
+	while( new_r != 0 ) {
+		long long q = r / new_r;
+		long long tmp = t - q*new_t; t = new_t; new_t = tmp;
+		tmp = r - q*new_r; r = new_r; new_r = tmp;
+	}
+	return t < 0 ? t + m : t;
+}
+uint64_t gcd(uint64_t a, uint64_t b) {
+	while( b ) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+SantaGenerator::SantaGenerator(const Params& params) : m_params(params) {
+	const Params& p = m_params;
+	if( p.min_size < 1 || p.max_size < p.min_size ||
+	    p.max_size > p.sleigh_size ) {
+		throw std::invalid_argument("Need 1 <= min_size <= max_size"
+		                            " <= sleigh_size");
+	}
+	// Note: Injected boundary violations lie up to 2*sleigh_size in x
+	if( 2 * (long long)p.sleigh_size >
+	    (long long)std::numeric_limits<SantaSolution::stype>::max() ) {
+		throw std::invalid_argument("sleigh_size is too large for the"
+		                            " coordinate storage type");
+	}
+	if( !(p.layer_fill > 0 && p.layer_fill <= 1) ||
+	    !(p.z_overlap >= 0 && p.z_overlap <= 1) || !(p.size_skew > 0) ) {
+		throw std::invalid_argument("Need 0 < layer_fill <= 1,"
+		                            " 0 <= z_overlap <= 1 and size_skew > 0");
+	}
+	m_cells_per_side  = p.sleigh_size / p.max_size;
+	m_cells_per_layer = std::max(dtype(1),
+	                             dtype(p.layer_fill * m_cells_per_side *
+	                                   m_cells_per_side));
+	double nlayers = std::ceil(double(p.count) / m_cells_per_layer);
+	if( (nlayers + 2) * p.max_size >= INT_MAX || p.count >= INT_MAX ) {
+		throw std::invalid_argument("Too many presents for 32-bit coords");
+	}
+	// Count the presents in even layers that have a neighbour above
+	m_neligible = 0;
+	for( size_t begin=0; begin<p.count; begin+=2*m_cells_per_layer ) {
+		if( begin + m_cells_per_layer < p.count ) {
+			m_neligible += std::min((size_t)m_cells_per_layer,
+			                        p.count - m_cells_per_layer - begin);
+		}
+	}
+	// Allocate the injections in turn, as far as the eligible presents go
+	uint64_t remaining = m_neligible;
+	double fractions[3] = {p.collision_fraction,
+	                       p.boundary_fraction,
+	                       p.dimension_fraction};
+	int counts[3];
+	for( int t=0; t<3; ++t ) {
+		uint64_t wanted = (uint64_t)std::floor(fractions[t] * p.count + 0.5);
+		counts[t] = (int)std::min(wanted, remaining);
+		remaining -= counts[t];
+	}
+	m_collisions           = counts[0];
+	m_boundary_violations  = counts[1];
+	m_dimension_mismatches = counts[2];
+	// Choose a pseudo-random permutation of the eligible presents
+	m_offset     = 0;
+	m_inv_stride = 1;
+	if( m_neligible > 0 ) {
+		splitmix64 rng(p.seed, (uint64_t)-1);
+		m_offset = rng.next() % m_neligible;
+		uint64_t stride = rng.next() % m_neligible;
+		while( gcd(stride, m_neligible) != 1 ) {
+			stride = (stride + 1) % m_neligible;
+		}
+		m_inv_stride = mod_inverse(stride, m_neligible);
+	}
+}
+
+void SantaGenerator::generate(SantaProblem*  problem,
+                              SantaSolution* solution) const {
+	const Params& p = m_params;
+	present_generator gen;
+	gen.sleigh_size     = p.sleigh_size;
+	gen.min_size        = p.min_size;
+	gen.max_size        = p.max_size;
+	gen.size_skew       = p.size_skew;
+	gen.z_overlap       = p.z_overlap;
+	gen.cells_per_side  = m_cells_per_side;
+	gen.cells_per_layer = m_cells_per_layer;
+	gen.count           = p.count;
+	gen.seed            = p.seed;
+	gen.neligible       = std::max(m_neligible, (uint64_t)1);
+	gen.offset          = m_offset;
+	gen.inv_stride      = m_inv_stride;
+	gen.collisions_end  = m_collisions;
+	gen.boundary_end    = gen.collisions_end + m_boundary_violations;
+	gen.dimension_end   = gen.boundary_end + m_dimension_mismatches;
+	using thrust::make_counting_iterator;
+	if( problem ) {
+		problem->set_sleigh_size(p.sleigh_size);
+		problem->resize(p.count);
+		thrust::transform(make_counting_iterator<dtype>(0),
+		                  make_counting_iterator<dtype>(p.count),
+		                  problem->begin(),
+		                  problem_generator_functor(gen));
+	}
+	if( solution ) {
+		solution->resize(p.count);
+		thrust::transform(make_counting_iterator<dtype>(0),
+		                  make_counting_iterator<dtype>(p.count),
+		                  solution->begin(),
+		                  solution_generator_functor(gen));
+	}
+}
@@ -0,0 +1,88 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+
+// Generates synthetic problems and packings of any size from a seed, for
+//   testing and benchmarking.
+// Presents are placed one per cell of a grid whose cells are max_size on a
+//   side, filling the grid layer by layer, so that the packing is valid by
+//   construction. Exact numbers of collisions, boundary violations and
+//   dimension mismatches are then injected into presents in even layers.
+// Note: Each present is generated independently from (seed, ID) on the
+//         device, so the output does not depend on the no. threads.
+class SantaGenerator {
+public:
+	typedef SantaSolution::dtype dtype;
+	struct Params {
+		size_t   count;              // No. presents
+		dtype    sleigh_size;
+		dtype    min_size;           // Range of present side lengths
+		dtype    max_size;
+		double   size_skew;          // Sides are min + (max-min)*u^skew, so
+		                             //   values > 1 favour small presents
+		double   layer_fill;         // Fraction of the grid's cells used in
+		                             //   each layer
+		double   z_overlap;          // Spread of the cells' z offsets, as a
+		                             //   fraction of the layer height
+		double   collision_fraction; // Injected invalidations, as fractions
+		double   boundary_fraction;  //   of count
+		double   dimension_fraction;
+		uint64_t seed;
+		Params()
+			: count(1000), sleigh_size(1000), min_size(2), max_size(250),
+			  size_skew(1), layer_fill(1), z_overlap(0),
+			  collision_fraction(0), boundary_fraction(0),
+			  dimension_fraction(0), seed(0) {}
+	};
+private:
+	Params   m_params;
+	dtype    m_cells_per_side;
+	dtype    m_cells_per_layer;
+	// Injections are spread over the eligible presents by the permutation
+	//   e = (offset + k*stride) % neligible
+	uint64_t m_neligible;
+	uint64_t m_offset;
+	uint64_t m_inv_stride;
+	int      m_collisions;
+	int      m_boundary_violations;
+	int      m_dimension_mismatches;
+public:
+	// Throws std::invalid_argument if the params are inconsistent
+	SantaGenerator(const Params& params);
+	inline const Params& params() const;
+	// Return the counts that SantaSolution::validate will report
+	inline int           collisions() const;
+	inline int           boundary_violations() const;
+	inline int           dimension_mismatches() const;
+	// Resizes and fills either or both of problem and solution
+	void                 generate(SantaProblem*  problem,
+	                              SantaSolution* solution) const;
+};
+const SantaGenerator::Params& SantaGenerator::params() const { return m_params; }
+int SantaGenerator::collisions()           const { return m_collisions; }
+int SantaGenerator::boundary_violations()  const { return m_boundary_violations; }
+int SantaGenerator::dimension_mismatches() const { return m_dimension_mismatches; }
@@ -20,50 +20,199 @@ benbarsdell@gmail.com
 */
 
 #include <SantaProblem.hpp>
+#include "file_io.hpp"
+#include "compressed_io.hpp"
+#include "stopwatch.hpp"
 
-#include <vector>
+#include <string>
 #include <fstream>
 #include <stdexcept>
-#include <string>
+#include <algorithm>
+#include <vector>
 
 #include <thrust/sort.h>
 
-size_t SantaProblem::load(std::string filename, size_t count) {
-	std::vector<dtype> ids, widths, heights, depths;
-	std::ifstream stream(filename.c_str());
-	if( !stream ) {
-		throw std::runtime_error("Failed to open " + filename);
+// Parses one problem row straight into the ID and dimension columns
+struct problem_row_parser {
+	typedef SantaProblem::dtype dtype;
+	dtype* ids;
+	dtype* widths;
+	dtype* heights;
+	dtype* depths;
+	inline void operator()(size_t i, const char* begin, const char* end) const {
+		csv::RowReader row(begin, end);
+		// Note: Converts 1-based to 0-based indexing
+		ids[i]     = row.next<dtype>() - 1;
+		widths[i]  = row.next<dtype>();
+		heights[i] = row.next<dtype>();
+		depths[i]  = row.next<dtype>();
 	}
-	std::string value;
-	// Read header line
-	std::getline(stream, value);
-	size_t i = 0;
-	for( ; i<count; ++i ) {
-		// First load the ID
-		std::getline(stream, value, ',');
-		if( !stream ) {
-			break;
+};
+
+// Parses the runs of whole rows handed over by compressed::for_each_line_block
+//   into growing host columns (IDs, then the three dimensions), stopping
+//   once count rows have been parsed
+struct problem_block_parser {
+	typedef SantaProblem::dtype dtype;
+	size_t             count;
+	std::vector<dtype> columns[4];
+	explicit problem_block_parser(size_t count_) : count(count_) {}
+	bool operator()(const char* begin, const char* end, bool first) {
+		csv::CsvChunks chunks(begin, end, first);
+		size_t offset = columns[0].size();
+		size_t n = std::min(chunks.rows(), count - offset);
+		if( n == 0 ) {
+			return offset < count;
 		}
-		// Note: Converts 1-based to 0-based indexing
-		dtype id = atoi(value.c_str()) - 1;
-		ids.push_back(id);
-		// Now load the x,y,z for each vertex
-		std::getline(stream, value, ',');  dtype dim1 = atoi(value.c_str());
-		std::getline(stream, value, ',');  dtype dim2 = atoi(value.c_str());
-		std::getline(stream, value, '\n'); dtype dim3 = atoi(value.c_str());
-		widths.push_back(dim1);
-		heights.push_back(dim2);
-		depths.push_back(dim3);
+		for( int c=0; c<4; ++c ) {
+			columns[c].resize(offset + n);
+		}
+		problem_row_parser parser = {&columns[0][offset], &columns[1][offset],
+		                             &columns[2][offset], &columns[3][offset]};
+		chunks.for_each_row(n, parser);
+		return offset + n < count;
+	}
+};
+
+size_t SantaProblem::load(std::string filename, size_t count) {
+	PROFILE_SCOPE("SantaProblem::load");
+	if( compressed::is_compressed(filename) ) {
+		return load_compressed(filename, count);
+	}
+	// Note: The file is memory-mapped and parsed in place, in parallel
+	//         over newline-aligned chunks
+	MappedFile file(filename);
+	csv::CsvChunks chunks(file.begin(), file.end());
+	size_t n = std::min(chunks.rows(), count);
+	dvector tmp_ids;
+	HostColumn<dvector> ids(tmp_ids, n);
+	HostColumn<svector, dtype> widths(m_widths, n);
+	HostColumn<svector, dtype> heights(m_heights, n);
+	HostColumn<svector, dtype> depths(m_depths, n);
+	problem_row_parser parser = {ids.data(), widths.data(),
+	                             heights.data(), depths.data()};
+	{
+		PROFILE_SCOPE("parse");
+		chunks.for_each_row(n, parser);
+	}
+	{
+		// Copy to the device (only needed for discrete devices)
+		PROFILE_SCOPE("copy to device");
+		ids.commit();
+		widths.commit();
+		heights.commit();
+		depths.commit();
 	}
-	// Copy to the device
-	m_widths  = widths;
-	m_heights = heights;
-	m_depths  = depths;
-	dvector tmp_ids = ids;
 	// Sort dimensions by ID
 	// Note: This defines a strict ordering by ID value and then by order
 	//         in file; technically the actual ID values don't matter.
-	thrust::stable_sort_by_key(tmp_ids.begin(), tmp_ids.end(),
+	PROFILE_SCOPE("sort by ID");
+	thrust::stable_sort_by_key(THRUST_PAR(m_allocator),
+	                           tmp_ids.begin(), tmp_ids.end(),
 	                           this->begin());
-	return i;
+	return n;
+}
+
+size_t SantaProblem::load_compressed(std::string filename, size_t count) {
+	// Note: Decoding runs on its own thread, a few blocks ahead of the
+	//         parser, so only those blocks (not the whole decompressed
+	//         file) are ever held in memory
+	problem_block_parser parser(count);
+	{
+		PROFILE_SCOPE("decompress and parse");
+		compressed::for_each_line_block(filename, parser);
+	}
+	size_t n = parser.columns[0].size();
+	this->resize(n);
+	if( n == 0 ) {
+		return 0;
+	}
+	const std::vector<dtype>* c = parser.columns;
+	svector* columns[3] = {&m_widths, &m_heights, &m_depths};
+	{
+		PROFILE_SCOPE("copy to device");
+		for( int d=0; d<3; ++d ) {
+			const dtype* src = &c[d+1][0];
+			check_range<stype>(src, src + n);
+			thrust::copy(src, src + n, columns[d]->begin());
+		}
+	}
+	dvector ids(c[0].begin(), c[0].end());
+	PROFILE_SCOPE("sort by ID");
+	thrust::stable_sort_by_key(THRUST_PAR(m_allocator),
+	                           ids.begin(), ids.end(),
+	                           this->begin());
+	return n;
+}
+
+// Formats row i (id,dim1,dim2,dim3) of ID-ordered dimension columns
+struct problem_row_formatter {
+	typedef SantaProblem::dtype dtype;
+	const dtype* widths;
+	const dtype* heights;
+	const dtype* depths;
+	inline char* operator()(char* p, size_t i) const {
+		// Note: 1-based indexing for IDs
+		p = csv::format_int(p, dtype(i+1));
+		*p++ = ','; p = csv::format_int(p, widths[i]);
+		*p++ = ','; p = csv::format_int(p, heights[i]);
+		*p++ = ','; p = csv::format_int(p, depths[i]);
+		*p++ = '\n';
+		return p;
+	}
+};
+
+void SantaProblem::save(std::string filename) const {
+	std::ofstream stream(filename.c_str(), std::ios::binary);
+	if( !stream ) {
+		throw std::runtime_error("Failed to open " + filename);
+	}
+	stream << "PresentId,Dimension1,Dimension2,Dimension3" << "\n";
+	HostCopy<svector, dtype> widths(m_widths);
+	HostCopy<svector, dtype> heights(m_heights);
+	HostCopy<svector, dtype> depths(m_depths);
+	const size_t max_row_chars = 4 * 12; // 4 signed ints + separators
+	problem_row_formatter formatter = {widths.data(), heights.data(),
+	                                   depths.data()};
+	csv::write_rows(stream, size(), max_row_chars, formatter);
+	if( !stream ) {
+		throw std::runtime_error("Failed to write " + filename);
+	}
+}
+
+static const char problem_magic[8] = {'S','A','N','T','A','P','R','B'};
+
+void SantaProblem::save_binary(std::string filename) const {
+	HostCopy<svector, dtype> widths(m_widths);
+	HostCopy<svector, dtype> heights(m_heights);
+	HostCopy<svector, dtype> depths(m_depths);
+	std::vector<const dtype*> columns;
+	columns.push_back(widths.data());
+	columns.push_back(heights.data());
+	columns.push_back(depths.data());
+	snapshot::write(filename, problem_magic, m_sleigh_size, size(), columns);
+}
+
+size_t SantaProblem::load_binary(std::string filename) {
+	PROFILE_SCOPE("SantaProblem::load_binary");
+	snapshot::Reader reader(filename, problem_magic, 3, sizeof(dtype));
+	size_t n = reader.count();
+	set_sleigh_size(reader.param());
+	// Note: Columns are already in ID order
+	const dtype* widths  = reader.column<dtype>(0);
+	const dtype* heights = reader.column<dtype>(1);
+	const dtype* depths  = reader.column<dtype>(2);
+	// Note: Snapshots always hold dtype values, whatever the storage type
+	check_range<stype>(widths,  widths  + n);
+	check_range<stype>(heights, heights + n);
+	check_range<stype>(depths,  depths  + n);
+	this->resize(n);
+	thrust::copy(widths,  widths  + n, m_widths.begin());
+	thrust::copy(heights, heights + n, m_heights.begin());
+	thrust::copy(depths,  depths  + n, m_depths.begin());
+	return n;
+}
+
+bool SantaProblem::is_binary(std::string filename) {
+	return snapshot::is_snapshot(filename, problem_magic);
 }
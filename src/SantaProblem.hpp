@@ -21,15 +21,31 @@ benbarsdell@gmail.com
 
 #pragma once
 
+#include <stdint.h>
+
 #include <thrust/device_vector.h>
 #include <thrust/iterator/zip_iterator.h>
 
+#include "caching_allocator.hpp"
+#include "numa_placement.hpp"
+
 class SantaProblem {
 public:
 	typedef int                              dtype;
-	typedef thrust::device_vector<dtype>     dvector;
-	typedef typename dvector::iterator       diter;
-	typedef typename dvector::const_iterator const_diter;
+	// Storage type of the present dimensions (and of solutions' x and y
+	//   extents)
+	// Note: Building with -DSANTA_COMPACT_STORAGE halves the bytes moved by
+	//         the bandwidth-bound passes; out-of-range values are then
+	//         rejected on load.
+#ifdef SANTA_COMPACT_STORAGE
+	typedef int16_t                          stype;
+#else
+	typedef dtype                            stype;
+#endif
+	typedef column_vector<dtype>::type       dvector;
+	typedef column_vector<stype>::type       svector;
+	typedef typename svector::iterator       diter;
+	typedef typename svector::const_iterator const_diter;
 	typedef thrust::zip_iterator<thrust::tuple<diter,
 	                                           diter,
 	                                           diter> > iterator;
@@ -39,8 +55,12 @@ public:
 	typedef typename iterator::reference       reference;
 	typedef typename const_iterator::reference const_reference;
 private:
-	dvector m_widths, m_heights, m_depths;
+	svector m_widths, m_heights, m_depths;
 	dtype   m_sleigh_size;
+	// Temporary storage for thrust algorithms
+	CachingAllocator m_allocator;
+	// Streams a gzip/zstd-compressed csv file through the parser
+	size_t load_compressed(std::string filename, size_t count);
 public:
 	inline SantaProblem();
 	inline SantaProblem(dtype  sleigh_size,
@@ -49,9 +69,18 @@ public:
 	inline SantaProblem(dtype       sleigh_size,
 	                    std::string filename);
 	// Loads problem-definition csv file with cols (id,dim1,dim2,dim3)
+	//   which may be gzip- or zstd-compressed (see compressed_io.hpp)
 	// Returns no. loaded
 	size_t                load(std::string filename,
 	                           size_t      count=size_t(-1));
+	// Saves problem-definition csv file with cols (id,dim1,dim2,dim3)
+	void                  save(std::string filename) const;
+	// Saves/loads a binary columnar snapshot of the ID-sorted dimensions
+	//   and the sleigh size. Returns no. loaded
+	void                  save_binary(std::string filename) const;
+	size_t                load_binary(std::string filename);
+	// Returns true if filename is a binary problem snapshot
+	static bool           is_binary(std::string filename);
 	inline dtype          sleigh_size() const;
 	inline void           set_sleigh_size(dtype size);
 	inline size_t         size() const;
@@ -65,6 +94,7 @@ public:
 	inline const_diter    widths_begin()  const;
 	inline const_diter    heights_begin() const;
 	inline const_diter    depths_begin()  const;
+	inline const CachingAllocator& allocator() const;
 };
 SantaProblem::SantaProblem() {}
 SantaProblem::SantaProblem(dtype sleigh_size, size_t size, dtype val) {
@@ -109,3 +139,4 @@ SantaProblem::const_reference SantaProblem::operator[](size_t i) const { return
 SantaProblem::const_diter SantaProblem::widths_begin()  const { return m_widths.begin(); }
 SantaProblem::const_diter SantaProblem::heights_begin() const { return m_heights.begin(); }
 SantaProblem::const_diter SantaProblem::depths_begin()  const { return m_depths.begin(); }
+const CachingAllocator& SantaProblem::allocator() const { return m_allocator; }
@@ -0,0 +1,204 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#include <SantaScoreContext.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <thrust/copy.h>
+
+typedef SantaScoreContext::dtype      dtype;
+typedef SantaScoreContext::score_type score_type;
+
+using std::min;
+using std::max;
+
+inline score_type abs_diff(score_type a, score_type b) {
+	return a > b ? a - b : b - a;
+}
+
+// Orders IDs by zmax descending, then by ID ascending
+struct score_order_less {
+	const dtype* zmaxima;
+	score_order_less(const dtype* zmaxima_) : zmaxima(zmaxima_) {}
+	inline bool operator()(dtype a, dtype b) const {
+		return zmaxima[a] > zmaxima[b] || (zmaxima[a] == zmaxima[b] && a < b);
+	}
+};
+
+SantaScoreContext::SantaScoreContext(const SantaSolution& solution)
+	: m_sigma(0) {
+	size_t n = solution.size();
+	m_zmaxima.resize(n);
+	thrust::copy(solution.zmaxima_begin(), solution.zmaxima_begin() + n,
+	             m_zmaxima.begin());
+	m_order.resize(n);
+	for( size_t i=0; i<n; ++i ) {
+		m_order[i] = i;
+	}
+	if( n ) {
+		std::sort(m_order.begin(), m_order.end(),
+		          score_order_less(&m_zmaxima[0]));
+	}
+	m_positions.resize(n);
+	for( size_t i=0; i<n; ++i ) {
+		m_positions[m_order[i]] = i;
+		m_sigma += abs_diff(m_order[i], i);
+	}
+	m_moved.resize(n, 0);
+}
+
+bool SantaScoreContext::comes_before(dtype za, dtype ida,
+                                     dtype zb, dtype idb) const {
+	return za > zb || (za == zb && ida < idb);
+}
+
+// Computes the change in score due to the move by re-ordering only the
+//   range of positions [lo, hi] that the moved presents leave or enter.
+// Note: All presents before lo precede every moved present's new key, and
+//         all presents after hi follow them, so nothing outside the range
+//         changes position.
+// The re-ordered range is left in m_merged, starting at position *lo.
+score_type SantaScoreContext::merge(size_t count, const dtype* ids,
+                                    const dtype* zmaxima,
+                                    size_t* merged_begin,
+                                    score_type* sigma_change) const {
+	*merged_begin = 0;
+	*sigma_change = 0;
+	m_merged.clear();
+	if( count == 0 ) {
+		return 0;
+	}
+	// Note: If an ID appears more than once, its last zmax wins
+	// Note: All IDs are checked before any are flagged as moved
+	for( size_t k=0; k<count; ++k ) {
+		if( ids[k] < 0 || size_t(ids[k]) >= size() ) {
+			throw std::out_of_range("Present ID out of range");
+		}
+	}
+	m_moves.clear();
+	for( size_t k=count; k-->0; ) {
+		if( !m_moved[ids[k]] ) {
+			m_moved[ids[k]] = 1;
+			m_moves.push_back(k);
+		}
+	}
+	// Sort the moves by their new keys and find the affected range
+	size_t lo = size();
+	size_t hi = 0;
+	for( size_t m=0; m<m_moves.size(); ++m ) {
+		size_t k   = m_moves[m];
+		dtype  id  = ids[k];
+		dtype  z   = zmaxima[k];
+		// Position of the new key within the current order
+		size_t first = 0;
+		size_t len   = size();
+		while( len > 0 ) {
+			size_t half = len / 2;
+			dtype  other = m_order[first + half];
+			if( comes_before(m_zmaxima[other], other, z, id) ) {
+				first += half + 1;
+				len   -= half + 1;
+			}
+			else {
+				len = half;
+			}
+		}
+		size_t pos = m_positions[id];
+		lo = min(lo, min(pos, first));
+		hi = max(hi, max(pos, first ? first-1 : 0));
+	}
+	hi = min(hi, size()-1);
+	for( size_t m=1; m<m_moves.size(); ++m ) {
+		// Note: Insertion sort; moves are expected to be few
+		size_t k = m_moves[m];
+		size_t j = m;
+		while( j > 0 &&
+		       comes_before(zmaxima[k], ids[k],
+		                    zmaxima[m_moves[j-1]], ids[m_moves[j-1]]) ) {
+			m_moves[j] = m_moves[j-1];
+			--j;
+		}
+		m_moves[j] = k;
+	}
+	// Merge the unmoved presents in the range with the sorted moves
+	m_merged.clear();
+	score_type old_sigma = 0;
+	size_t m = 0;
+	for( size_t pos=lo; pos<=hi; ++pos ) {
+		dtype id = m_order[pos];
+		old_sigma += abs_diff(id, pos);
+		if( m_moved[id] ) {
+			continue;
+		}
+		while( m < m_moves.size() &&
+		       comes_before(zmaxima[m_moves[m]], ids[m_moves[m]],
+		                    m_zmaxima[id], id) ) {
+			m_merged.push_back(ids[m_moves[m++]]);
+		}
+		m_merged.push_back(id);
+	}
+	while( m < m_moves.size() ) {
+		m_merged.push_back(ids[m_moves[m++]]);
+	}
+	score_type new_sigma = 0;
+	for( size_t i=0; i<m_merged.size(); ++i ) {
+		new_sigma += abs_diff(m_merged[i], lo + i);
+	}
+	// The max zmax is that of the first present in the order
+	score_type old_zmax = m_zmaxima[m_order[0]];
+	score_type new_zmax = old_zmax;
+	if( lo == 0 ) {
+		dtype first = m_merged[0];
+		new_zmax = m_moved[first] ? zmaxima[m_moves[0]] : m_zmaxima[first];
+	}
+	for( size_t k=0; k<count; ++k ) {
+		m_moved[ids[k]] = 0;
+	}
+	*merged_begin = lo;
+	*sigma_change = new_sigma - old_sigma;
+	return 2 * (new_zmax - old_zmax) + (new_sigma - old_sigma);
+}
+
+score_type SantaScoreContext::delta(size_t count, const dtype* ids,
+                                    const dtype* zmaxima) const {
+	size_t     merged_begin;
+	score_type sigma_change;
+	return merge(count, ids, zmaxima, &merged_begin, &sigma_change);
+}
+
+score_type SantaScoreContext::update(size_t count, const dtype* ids,
+                                     const dtype* zmaxima) {
+	size_t     merged_begin;
+	score_type sigma_change;
+	score_type change = merge(count, ids, zmaxima,
+	                          &merged_begin, &sigma_change);
+	for( size_t k=0; k<count; ++k ) {
+		m_zmaxima[ids[k]] = zmaxima[k];
+	}
+	for( size_t i=0; i<m_merged.size(); ++i ) {
+		m_order[merged_begin + i] = m_merged[i];
+		m_positions[m_merged[i]] = merged_begin + i;
+	}
+	m_sigma += sigma_change;
+	return change;
+}
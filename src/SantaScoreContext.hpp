@@ -0,0 +1,71 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+#include <vector>
+
+#include <SantaSolution.hpp>
+
+// Stateful, host-side scoring of a solution that is modified a few
+//   presents at a time (e.g., by a local-search optimiser).
+// Keeps the IDs ordered by (zmax descending, ID ascending) together with
+//   the running ordering metric sigma = sum(abs(ID - index)), so that the
+//   exact change in score = 2*zmax + sigma due to a move costs time
+//   proportional to the number of positions the move shifts.
+// Note: Only zmax affects the score, so moves are given as new zmaxima
+class SantaScoreContext {
+public:
+	typedef SantaSolution::dtype      dtype;
+	typedef SantaSolution::score_type score_type;
+private:
+	typedef std::vector<dtype> hvector;
+	hvector    m_zmaxima;   // In ID order
+	hvector    m_order;     // IDs in score order
+	hvector    m_positions; // Position of each ID in m_order
+	score_type m_sigma;
+	// Temporary spaces required for pricing moves
+	mutable std::vector<unsigned char> m_moved;
+	mutable std::vector<size_t>        m_moves; // Indices of unique moves
+	mutable hvector                    m_merged;
+
+	inline bool comes_before(dtype za, dtype ida, dtype zb, dtype idb) const;
+	score_type  merge(size_t count, const dtype* ids, const dtype* zmaxima,
+	                  size_t* merged_begin, score_type* sigma_change) const;
+public:
+	SantaScoreContext(const SantaSolution& solution);
+	inline size_t     size() const;
+	inline score_type score() const;
+	// Returns the change in score that setting the given presents' zmaxima
+	//   would cause, without applying it
+	score_type delta(size_t count, const dtype* ids,
+	                 const dtype* zmaxima) const;
+	// Sets the given presents' zmaxima and returns the change in score
+	score_type update(size_t count, const dtype* ids,
+	                  const dtype* zmaxima);
+};
+size_t SantaScoreContext::size() const { return m_order.size(); }
+SantaScoreContext::score_type SantaScoreContext::score() const {
+	if( m_order.empty() ) {
+		return 0;
+	}
+	return 2 * score_type(m_zmaxima[m_order[0]]) + m_sigma;
+}
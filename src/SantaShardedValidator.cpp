@@ -0,0 +1,458 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#include <SantaShardedValidator.hpp>
+#include "validation_functors.hpp"
+#include "stopwatch.hpp"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <thrust/copy.h>
+#include <thrust/tuple.h>
+
+extern char** environ;
+
+// The segment holds a shard_header, the nshards+1 slab bounds, nshards
+//   shard_results, and then the six extrema columns (npresents each) and
+//   the three dimension columns (nproblem each), all in ID order
+struct shard_header {
+	uint32_t magic;
+	int32_t  nshards;
+	int64_t  npresents;
+	int64_t  nproblem;
+	int32_t  sleigh_size;
+	int32_t  collision_method;
+};
+// Written by each worker into its own slot
+struct shard_result {
+	int32_t done;
+	int32_t boundary_violations;
+	int32_t dimension_mismatches;
+	int32_t collisions;
+	char    error[240];
+};
+static const uint32_t shard_magic = 0x31444853; // "SHD1"
+
+struct shard_layout {
+	size_t bounds;
+	size_t results;
+	size_t solution;
+	size_t problem;
+	size_t size;
+	shard_layout(int nshards, size_t npresents, size_t nproblem) {
+		bounds   = align(sizeof(shard_header));
+		results  = align(bounds   + (nshards+1)*sizeof(dtype));
+		solution = align(results  + nshards*sizeof(shard_result));
+		problem  = align(solution + 6*npresents*sizeof(dtype));
+		size     = align(problem  + 3*nproblem*sizeof(dtype));
+	}
+	// Note: Cache-line alignment keeps the workers' result slots apart
+	static size_t align(size_t offset) { return (offset + 63) / 64 * 64; }
+};
+
+// A named POSIX shared-memory segment, mapped read-write
+// Note: The creator removes the name again when it is destroyed
+class SharedSegment {
+	std::string m_name;
+	char*       m_data;
+	size_t      m_size;
+	bool        m_owner;
+	SharedSegment(const SharedSegment&);
+	SharedSegment& operator=(const SharedSegment&);
+	void map(int fd) {
+		void* data = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if( data == MAP_FAILED ) {
+			if( m_owner ) {
+				shm_unlink(m_name.c_str());
+			}
+			throw std::runtime_error("Failed to map shared memory " + m_name);
+		}
+		m_data = (char*)data;
+	}
+public:
+	// Creates a new segment
+	SharedSegment(std::string name, size_t size)
+		: m_name(name), m_data(0), m_size(size), m_owner(true) {
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if( fd < 0 ) {
+			throw std::runtime_error("Failed to create shared memory " + name);
+		}
+		if( ftruncate(fd, size) != 0 ) {
+			close(fd);
+			shm_unlink(name.c_str());
+			throw std::runtime_error("Failed to size shared memory " + name);
+		}
+		map(fd);
+	}
+	// Attaches to an existing segment
+	explicit SharedSegment(std::string name)
+		: m_name(name), m_data(0), m_size(0), m_owner(false) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		struct stat info;
+		if( fd < 0 || fstat(fd, &info) != 0 ) {
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			throw std::runtime_error("Failed to open shared memory " + name);
+		}
+		m_size = info.st_size;
+		map(fd);
+	}
+	~SharedSegment() {
+		munmap(m_data, m_size);
+		if( m_owner ) {
+			shm_unlink(m_name.c_str());
+		}
+	}
+	char*  data() const { return m_data; }
+	size_t size() const { return m_size; }
+};
+
+// Builds a solution from the presents at the given indices of the shared
+//   extrema columns
+static void gather_solution(const dtype* const         columns[6],
+                            const std::vector<dtype>&  indices,
+                            SantaSolution&             solution) {
+	std::vector<dtype> gathered[6];
+	for( int c=0; c<6; ++c ) {
+		gathered[c].resize(indices.size());
+		for( size_t k=0; k<indices.size(); ++k ) {
+			gathered[c][k] = columns[c][indices[k]];
+		}
+	}
+	if( indices.empty() ) {
+		solution.resize(0);
+		return;
+	}
+	solution.assign(indices.size(),
+	                &gathered[0][0], &gathered[1][0], &gathered[2][0],
+	                &gathered[3][0], &gathered[4][0], &gathered[5][0]);
+}
+
+// Checks one slab of the solution in a segment, writing to its result slot
+static void run_shard(SharedSegment& segment, int shard) {
+	const shard_header& header = *(const shard_header*)segment.data();
+	if( header.magic != shard_magic ||
+	    shard < 0 || shard >= header.nshards ) {
+		throw std::runtime_error("Not a shard segment, or no such shard");
+	}
+	size_t n = header.npresents;
+	size_t nproblem = header.nproblem;
+	shard_layout layout(header.nshards, n, nproblem);
+	if( segment.size() < layout.size ) {
+		throw std::runtime_error("Truncated shard segment");
+	}
+	const dtype* bounds = (const dtype*)(segment.data() + layout.bounds);
+	shard_result& result = ((shard_result*)(segment.data() + layout.results))[shard];
+	const dtype* columns[6];
+	for( int c=0; c<6; ++c ) {
+		columns[c] = (const dtype*)(segment.data() + layout.solution) + c*n;
+	}
+	const dtype* dims[3];
+	for( int d=0; d<3; ++d ) {
+		dims[d] = (const dtype*)(segment.data() + layout.problem) + d*nproblem;
+	}
+	
+	// Owned presents start in the slab; the halo starts below it but
+	//   reaches into it
+	// Note: The last slab is open-ended
+	dtype lo = bounds[shard];
+	dtype hi = bounds[shard+1];
+	bool  last = shard == header.nshards-1;
+	std::vector<dtype> owned, halo;
+	const dtype* zminima = columns[4];
+	const dtype* zmaxima = columns[5];
+	for( size_t i=0; i<n; ++i ) {
+		if( zminima[i] >= lo && (last || zminima[i] < hi) ) {
+			owned.push_back(i);
+		}
+		else if( zminima[i] < lo && zmaxima[i] >= lo ) {
+			halo.push_back(i);
+		}
+	}
+	
+	bounds_functor       check_bounds(header.sleigh_size);
+	dim_mismatch_functor mismatch;
+	int boundary_violations  = 0;
+	int dimension_mismatches = 0;
+	for( size_t k=0; k<owned.size(); ++k ) {
+		size_t i = owned[k];
+		thrust::tuple<dtype,dtype,dtype,dtype,dtype,dtype> extrema =
+			thrust::make_tuple(columns[0][i], columns[1][i],
+			                   columns[2][i], columns[3][i],
+			                   columns[4][i], columns[5][i]);
+		validation_counts c = check_bounds(extrema);
+		boundary_violations += c.xmin + c.xmax + c.ymin + c.ymax + c.zmin;
+		// Note: Presents beyond the end of the problem have no dimensions
+		if( i < nproblem ) {
+			dimension_mismatches +=
+				mismatch(extrema, thrust::make_tuple(dims[0][i], dims[1][i],
+				                                     dims[2][i]));
+		}
+	}
+	
+	SantaSolution::CollisionMethod method =
+		(SantaSolution::CollisionMethod)header.collision_method;
+	SantaSolution halo_solution;
+	gather_solution(columns, halo, halo_solution);
+	owned.insert(owned.end(), halo.begin(), halo.end());
+	SantaSolution slab_solution;
+	gather_solution(columns, owned, slab_solution);
+	int collisions = slab_solution.count_collisions(method);
+	if( !halo.empty() ) {
+		collisions -= halo_solution.count_collisions(method);
+	}
+	
+	result.boundary_violations  = boundary_violations;
+	result.dimension_mismatches = dimension_mismatches;
+	result.collisions           = collisions;
+	result.done                 = 1;
+}
+
+SantaShardedValidator::SantaShardedValidator(int         nworkers,
+                                             std::string executable)
+	: m_nworkers(std::max(nworkers, 1)), m_executable(executable) {
+	if( m_executable.empty() ) {
+		std::vector<char> path(4096);
+		ssize_t len = readlink("/proc/self/exe", &path[0], path.size()-1);
+		if( len <= 0 ) {
+			throw std::runtime_error("Failed to find the current executable");
+		}
+		m_executable.assign(&path[0], len);
+	}
+}
+
+int SantaShardedValidator::validate(const SantaProblem&  problem,
+                                    const SantaSolution& solution,
+                                    int*                 _size_difference,
+                                    int*                 _boundary_violations,
+                                    int*                 _dimension_mismatches,
+                                    int*                 _collisions) const {
+	PROFILE_SCOPE("SantaShardedValidator::validate");
+	size_t n        = solution.size();
+	size_t nproblem = problem.size();
+	int    nshards  = m_nworkers;
+	shard_layout layout(nshards, n, nproblem);
+	// Note: Concurrent calls must not generate the same segment name
+	static std::atomic<unsigned> nsegments(0);
+	std::ostringstream name;
+	name << "/santa_shards_" << getpid() << "_" << nsegments++;
+	SharedSegment segment(name.str(), layout.size);
+	
+	shard_header& header = *(shard_header*)segment.data();
+	header.magic            = shard_magic;
+	header.nshards          = nshards;
+	header.npresents        = n;
+	header.nproblem         = nproblem;
+	header.sleigh_size      = problem.sleigh_size();
+	header.collision_method = solution.collision_method();
+	dtype* columns = (dtype*)(segment.data() + layout.solution);
+	dtype* dims    = (dtype*)(segment.data() + layout.problem);
+	{
+		PROFILE_SCOPE("copy to shared memory");
+		thrust::copy(solution.xminima_begin(), solution.xminima_begin() + n,
+		             columns + 0*n);
+		thrust::copy(solution.xmaxima_begin(), solution.xmaxima_begin() + n,
+		             columns + 1*n);
+		thrust::copy(solution.yminima_begin(), solution.yminima_begin() + n,
+		             columns + 2*n);
+		thrust::copy(solution.ymaxima_begin(), solution.ymaxima_begin() + n,
+		             columns + 3*n);
+		thrust::copy(solution.zminima_begin(), solution.zminima_begin() + n,
+		             columns + 4*n);
+		thrust::copy(solution.zmaxima_begin(), solution.zmaxima_begin() + n,
+		             columns + 5*n);
+		thrust::copy(problem.widths_begin(),  problem.widths_begin()  + nproblem,
+		             dims + 0*nproblem);
+		thrust::copy(problem.heights_begin(), problem.heights_begin() + nproblem,
+		             dims + 1*nproblem);
+		thrust::copy(problem.depths_begin(),  problem.depths_begin()  + nproblem,
+		             dims + 2*nproblem);
+	}
+	// Cut the slabs at quantiles of zmin
+	dtype* bounds = (dtype*)(segment.data() + layout.bounds);
+	{
+		std::vector<dtype> zminima(columns + 4*n, columns + 5*n);
+		std::sort(zminima.begin(), zminima.end());
+		bounds[0] = INT_MIN;
+		for( int s=1; s<=nshards; ++s ) {
+			bounds[s] = n ? zminima[std::min(s*n/nshards, n-1)] : INT_MIN;
+		}
+	}
+	
+	std::vector<std::string> errors;
+	{
+		PROFILE_SCOPE("workers");
+		// Note: Unless told otherwise, each worker gets an equal share of
+		//         the cores for its own parallel loops
+		std::vector<std::string> env_strings;
+		for( char** e=environ; *e; ++e ) {
+			env_strings.push_back(*e);
+		}
+		if( !getenv("OMP_NUM_THREADS") ) {
+			long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+			std::ostringstream setting;
+			setting << "OMP_NUM_THREADS=" << std::max(1L, ncores / nshards);
+			env_strings.push_back(setting.str());
+		}
+		std::vector<char*> env;
+		for( size_t e=0; e<env_strings.size(); ++e ) {
+			env.push_back(&env_strings[e][0]);
+		}
+		env.push_back(0);
+		std::string executable = m_executable;
+		std::vector<pid_t> pids;
+		for( int s=0; s<nshards; ++s ) {
+			std::ostringstream arg;
+			arg << "--shard-worker=" << name.str() << ":" << s;
+			std::string worker_arg = arg.str();
+			char* argv[3] = {&executable[0], &worker_arg[0], 0};
+			pid_t pid;
+			if( posix_spawn(&pid, executable.c_str(), 0, 0,
+			                argv, &env[0]) != 0 ) {
+				errors.push_back("Failed to start " + executable);
+				break;
+			}
+			pids.push_back(pid);
+		}
+		// Note: Every started worker is waited for, even after a failure
+		for( size_t w=0; w<pids.size(); ++w ) {
+			int   status = 0;
+			pid_t waited;
+			do {
+				waited = waitpid(pids[w], &status, 0);
+			} while( waited < 0 && errno == EINTR );
+			// Note: waitpid fails with ECHILD if the host program ignores
+			//         SIGCHLD, in which case the exit status is unknown
+			if( waited < 0 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+				std::ostringstream error;
+				error << "Shard worker " << w << " failed";
+				errors.push_back(error.str());
+			}
+		}
+	}
+	shard_result* results = (shard_result*)(segment.data() + layout.results);
+	int boundary_violations  = 0;
+	int dimension_mismatches = 0;
+	int collisions           = 0;
+	for( int s=0; s<nshards && errors.empty(); ++s ) {
+		if( !results[s].done ) {
+			errors.push_back(results[s].error[0] ? results[s].error
+			                 : "Shard worker produced no result");
+			break;
+		}
+		boundary_violations  += results[s].boundary_violations;
+		dimension_mismatches += results[s].dimension_mismatches;
+		collisions           += results[s].collisions;
+	}
+	if( !errors.empty() ) {
+		for( int s=0; s<nshards; ++s ) {
+			if( results[s].error[0] ) {
+				errors.back() += std::string(": ") + results[s].error;
+				break;
+			}
+		}
+		throw std::runtime_error(errors.back());
+	}
+	
+	int size_difference = int(n) - int(nproblem);
+	if( _size_difference ) {
+		*_size_difference = size_difference;
+	}
+	if( _boundary_violations ) {
+		*_boundary_violations = boundary_violations;
+	}
+	if( _dimension_mismatches ) {
+		*_dimension_mismatches = dimension_mismatches;
+	}
+	if( _collisions ) {
+		*_collisions = collisions;
+	}
+	return (size_difference      == 0 &&
+	        boundary_violations  == 0 &&
+	        dimension_mismatches == 0 &&
+	        collisions           == 0);
+}
+
+int SantaShardedValidator::worker_main(int argc, char* argv[]) {
+	const std::string prefix = "--shard-worker=";
+	std::string spec;
+	for( int a=1; a<argc; ++a ) {
+		if( std::string(argv[a]).compare(0, prefix.size(), prefix) == 0 ) {
+			spec = argv[a] + prefix.size();
+		}
+	}
+	if( spec.empty() ) {
+		return -1;
+	}
+	size_t colon = spec.rfind(':');
+	if( colon == std::string::npos ) {
+		fprintf(stderr, "Invalid shard worker argument: %s\n", spec.c_str());
+		return 1;
+	}
+	std::string name = spec.substr(0, colon);
+	int shard = atoi(spec.c_str() + colon + 1);
+	try {
+		SharedSegment segment(name);
+		try {
+			run_shard(segment, shard);
+		}
+		catch( std::exception& e ) {
+			// Note: Reported back through the segment as well as stderr
+			const shard_header& header = *(const shard_header*)segment.data();
+			if( header.magic == shard_magic &&
+			    shard >= 0 && shard < header.nshards ) {
+				shard_layout layout(header.nshards, header.npresents,
+				                    header.nproblem);
+				shard_result& result =
+					((shard_result*)(segment.data() + layout.results))[shard];
+				strncpy(result.error, e.what(), sizeof(result.error)-1);
+			}
+			throw;
+		}
+	}
+	catch( std::exception& e ) {
+		fprintf(stderr, "Shard worker %d: %s\n", shard, e.what());
+		return 1;
+	}
+	return 0;
+}
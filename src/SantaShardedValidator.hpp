@@ -0,0 +1,66 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#pragma once
+
+#include <string>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+
+// Validation sharded over worker processes by z-slab.
+// The coordinator copies the problem and the ID-ordered extrema into a
+//   POSIX shared-memory segment, cuts the z-axis into one slab per worker
+//   (at quantiles of zmin, so each gets a similar no. presents) and
+//   launches the workers, which attach to the segment by name.
+// A worker owns the presents whose zmin lies in its slab and checks their
+//   bounds and dimensions. It also loads a halo of the presents that start
+//   below the slab but reach into it. A colliding pair is counted only by
+//   the slab holding the larger zmin of the two, i.e., as
+//   collisions(owned + halo) - collisions(halo).
+// The counts always equal those that SantaSolution::validate would return.
+// Note: Workers are started by re-running the current executable with
+//         --shard-worker=<segment>:<shard>, so any program that validates
+//         sharded must first hand its arguments to worker_main.
+class SantaShardedValidator {
+public:
+	typedef SantaSolution::dtype dtype;
+private:
+	int         m_nworkers;
+	std::string m_executable;
+public:
+	// Uses nworkers worker processes, started from executable (or the
+	//   current one if empty)
+	explicit SantaShardedValidator(int         nworkers,
+	                               std::string executable="");
+	// Returns the same value and counts as solution.validate with
+	//   quick=false, using the solution's collision method
+	int validate(const SantaProblem&  problem,
+	             const SantaSolution& solution,
+	             int*                 size_difference=0,
+	             int*                 boundary_violations=0,
+	             int*                 dimension_mismatches=0,
+	             int*                 collisions=0) const;
+	// Runs a worker if the arguments ask for one
+	// Returns -1 if not, otherwise the exit status for the worker process
+	static int worker_main(int argc, char* argv[]);
+};
@@ -20,404 +20,985 @@ benbarsdell@gmail.com
 */
 
 #include <SantaSolution.hpp>
+#include <SantaWorkspace.hpp>
+#include "file_io.hpp"
+#include "compressed_io.hpp"
+#include "solution_csv.hpp"
+#include "validation_functors.hpp"
+#include "stopwatch.hpp"
 
 #include <vector>
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <climits>
 
 #include <thrust/transform.h>
 #include <thrust/sort.h>
 #include <thrust/inner_product.h>
+#include <thrust/transform_reduce.h>
 #include <thrust/sequence.h>
 #include <thrust/binary_search.h>
+#include <thrust/reduce.h>
+#include <thrust/scan.h>
+#include <thrust/for_each.h>
 #include <thrust/iterator/counting_iterator.h>
 #include <thrust/iterator/zip_iterator.h>
 #include <thrust/iterator/permutation_iterator.h>
 #include <thrust/iterator/constant_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/copy.h>
+#include <thrust/gather.h>
+#include <thrust/find.h>
+#include <thrust/scatter.h>
 
 typedef SantaSolution::dtype       dtype;
+typedef SantaSolution::stype       stype;
 typedef SantaSolution::const_diter const_diter;
 
 using std::min;
 using std::max;
 
-template<typename T>
-inline __host__ __device__
-T max8(T z1, T z2, T z3, T z4, T z5, T z6, T z7, T z8) {
-	// Note: Hierarchical method maximises instruction-level parallelism
-	//         (at the cost of a couple more registers per thread)
-	T max_a, max_b, max_c;
-	max_a = max(z1, z2);
-	max_b = max(z3, z4);
-	max_c = max(max_a, max_b);
-	max_a = max(z5, z6);
-	max_b = max(z7, z8);
-	return max( max_c, max(max_a, max_b) );
-}
-
-template<typename T>
-inline __host__ __device__
-T min8(T z1, T z2, T z3, T z4, T z5, T z6, T z7, T z8) {
-	// Note: Hierarchical method maximises instruction-level parallelism
-	//         (at the cost of a couple more registers per thread)
-	T min_a, min_b, min_c;
-	min_a = min(z1, z2);
-	min_b = min(z3, z4);
-	min_c = min(min_a, min_b);
-	min_a = min(z5, z6);
-	min_b = min(z7, z8);
-	return min( min_c, min(min_a, min_b) );
-}
-
-struct abs_diff_functor : public thrust::binary_function<dtype, dtype, dtype> {
-	inline __host__ __device__
-	dtype operator()(dtype id, dtype i) const {
-		//return abs(id - i);
-		return abs(max(id, i) - min(id, i));
+// Parses the runs of whole rows handed over by compressed::for_each_line_block
+//   into growing host columns (IDs, then the six extrema), stopping once
+//   count rows have been parsed
+struct solution_block_parser {
+	size_t             count;
+	std::vector<dtype> columns[7];
+	explicit solution_block_parser(size_t count_) : count(count_) {}
+	bool operator()(const char* begin, const char* end, bool first) {
+		csv::CsvChunks chunks(begin, end, first);
+		size_t offset = columns[0].size();
+		size_t n = std::min(chunks.rows(), count - offset);
+		if( n == 0 ) {
+			return offset < count;
+		}
+		for( int c=0; c<7; ++c ) {
+			columns[c].resize(offset + n);
+		}
+		solution_row_parser parser = {&columns[0][offset],
+		                              &columns[1][offset], &columns[2][offset],
+		                              &columns[3][offset], &columns[4][offset],
+		                              &columns[5][offset], &columns[6][offset]};
+		chunks.for_each_row(n, parser);
+		return offset + n < count;
 	}
 };
 
 size_t SantaSolution::load(std::string filename, size_t count) {
-	std::vector<dtype> ids;
-	std::vector<dtype> xminima, xmaxima;
-	std::vector<dtype> yminima, ymaxima;
-	std::vector<dtype> zminima, zmaxima;
-	std::ifstream stream(filename.c_str());
-	if( !stream ) {
-		throw std::runtime_error("Failed to open " + filename);
+	PROFILE_SCOPE("SantaSolution::load");
+	if( compressed::is_compressed(filename) ) {
+		return load_compressed(filename, count);
 	}
-	std::string value;
-	// Read header line
-	std::getline(stream, value);
-	size_t i = 0;
-	for( ; i<count; ++i ) {
-		dtype id, x[8], y[8], z[8];
-		// First load the ID
-		std::getline(stream, value, ',');
-		if( !stream ) {
-			break;
-		}
-		// Note: Converts 1-based to 0-based indexing
-		id = atoi(value.c_str()) - 1;
-		ids.push_back( id );
-		// Now load the x,y,z for each vertex
-		for( int v=0; v<7; ++v ) {
-			std::getline(stream, value, ','); x[v] = atoi(value.c_str());
-			std::getline(stream, value, ','); y[v] = atoi(value.c_str());
-			std::getline(stream, value, ','); z[v] = atoi(value.c_str());
-		}
-		// Note: The last column loaded separately due to newline
-		std::getline(stream, value, ',');  x[7] = atoi(value.c_str());
-		std::getline(stream, value, ',');  y[7] = atoi(value.c_str());
-		std::getline(stream, value, '\n'); z[7] = atoi(value.c_str());
-		// Convert 8 vertices to 2 extrema for each coordinate
-		xminima.push_back( min8(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7]) );
-		xmaxima.push_back( max8(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7]) );
-		yminima.push_back( min8(y[0],y[1],y[2],y[3],y[4],y[5],y[6],y[7]) );
-		ymaxima.push_back( max8(y[0],y[1],y[2],y[3],y[4],y[5],y[6],y[7]) );
-		zminima.push_back( min8(z[0],z[1],z[2],z[3],z[4],z[5],z[6],z[7]) );
-		zmaxima.push_back( max8(z[0],z[1],z[2],z[3],z[4],z[5],z[6],z[7]) );
-	}
-	size_t n = xminima.size();
-	this->resize(n); // Note: Ensures tmp arrays get allocated
-	// Copy loaded data to the device
-	m_xminima = xminima; m_xmaxima = xmaxima;
-	m_yminima = yminima; m_ymaxima = ymaxima;
-	m_zminima = zminima; m_zmaxima = zmaxima;
-	m_tmp_ids = ids;
+	// Note: The file is memory-mapped and parsed in place, in parallel
+	//         over newline-aligned chunks
+	MappedFile file(filename);
+	csv::CsvChunks chunks(file.begin(), file.end());
+	size_t n = std::min(chunks.rows(), count);
+	this->resize(n);
+	SantaWorkspacePool::Lease workspace(0);
+	HostColumn<dvector> ids(workspace->m_ids, n);
+	HostColumn<svector, dtype> xminima(m_xminima, n), xmaxima(m_xmaxima, n);
+	HostColumn<svector, dtype> yminima(m_yminima, n), ymaxima(m_ymaxima, n);
+	HostColumn<dvector>        zminima(m_zminima, n), zmaxima(m_zmaxima, n);
+	solution_row_parser parser = {ids.data(),
+	                              xminima.data(), xmaxima.data(),
+	                              yminima.data(), ymaxima.data(),
+	                              zminima.data(), zmaxima.data()};
+	{
+		PROFILE_SCOPE("parse");
+		chunks.for_each_row(n, parser);
+	}
+	{
+		// Copy loaded data to the device (only needed for discrete devices)
+		PROFILE_SCOPE("copy to device");
+		ids.commit();
+		xminima.commit(); xmaxima.commit();
+		yminima.commit(); ymaxima.commit();
+		zminima.commit(); zmaxima.commit();
+	}
+	PROFILE_SCOPE("sort by ID");
 	// Note: This defines a strict ordering by ID value and then by order
 	//         in file; technically the actual ID values don't matter.
-	thrust::stable_sort_by_key(m_tmp_ids.begin(), m_tmp_ids.end(),
+	thrust::stable_sort_by_key(THRUST_PAR(workspace->m_allocator),
+	                           workspace->m_ids.begin(),
+	                           workspace->m_ids.end(),
+	                           this->begin());
+	return n;
+}
+size_t SantaSolution::load_compressed(std::string filename, size_t count) {
+	// Note: Decoding runs on its own thread, a few blocks ahead of the
+	//         parser, so only those blocks (not the whole decompressed
+	//         file) are ever held in memory
+	solution_block_parser parser(count);
+	{
+		PROFILE_SCOPE("decompress and parse");
+		compressed::for_each_line_block(filename, parser);
+	}
+	size_t n = parser.columns[0].size();
+	if( n == 0 ) {
+		this->resize(0);
+		return 0;
+	}
+	const std::vector<dtype>* c = parser.columns;
+	{
+		PROFILE_SCOPE("copy to device");
+		// Note: Still in file order until sorted below
+		assign(n, &c[1][0], &c[2][0], &c[3][0], &c[4][0], &c[5][0], &c[6][0]);
+	}
+	SantaWorkspacePool::Lease workspace(0);
+	workspace->m_ids.assign(c[0].begin(), c[0].end());
+	PROFILE_SCOPE("sort by ID");
+	thrust::stable_sort_by_key(THRUST_PAR(workspace->m_allocator),
+	                           workspace->m_ids.begin(),
+	                           workspace->m_ids.end(),
 	                           this->begin());
-	return i;
+	return n;
+}
+// Formats one solution row (id,x1,y1,z1,...,x8,y8,z8) at p and returns
+//   the end of the row
+inline char* format_solution_row(char* p, dtype id,
+                                 dtype xmin, dtype xmax,
+                                 dtype ymin, dtype ymax,
+                                 dtype zmin, dtype zmax) {
+	p = csv::format_int(p, id);
+	// Iterate over all combinations of (xlo|xhi) (ylo|yhi) (zlo|zhi)
+	for( int ix=0; ix<2; ++ix ) {
+		dtype x = (ix==0) ? xmin : xmax;
+		for( int iy=0; iy<2; ++iy ) {
+			dtype y = (iy==0) ? ymin : ymax;
+			for( int iz=0; iz<2; ++iz ) {
+				dtype z = (iz==0) ? zmin : zmax;
+				*p++ = ','; p = csv::format_int(p, x);
+				*p++ = ','; p = csv::format_int(p, y);
+				*p++ = ','; p = csv::format_int(p, z);
+			}
+		}
+	}
+	*p++ = '\n';
+	return p;
 }
+
+// Formats row i of ID-ordered extrema columns
+struct solution_row_formatter {
+	const dtype* xminima;
+	const dtype* xmaxima;
+	const dtype* yminima;
+	const dtype* ymaxima;
+	const dtype* zminima;
+	const dtype* zmaxima;
+	inline char* operator()(char* p, size_t i) const {
+		// Note: 1-based indexing for IDs
+		return format_solution_row(p, dtype(i+1),
+		                           xminima[i], xmaxima[i],
+		                           yminima[i], ymaxima[i],
+		                           zminima[i], zmaxima[i]);
+	}
+};
+
 // Saves solution-definition csv file with cols(id,x1,y1,z1,...,x8,y8,z8)
 void SantaSolution::save(std::string filename) {
-	std::ofstream stream(filename.c_str());
+	std::ofstream stream(filename.c_str(), std::ios::binary);
 	if( !stream ) {
 		throw std::runtime_error("Failed to open " + filename);
 	}
 	stream << "id,x1,y1,z1,x2,y2,z2,x3,y3,z3,x4,y4,z4,"
 	       <<    "x5,y5,z5,x6,y6,z6,x7,y7,z7,x8,y8,z8"
-	       << std::endl;
-	for( size_t i=0; i<size(); ++i ) {
-		dtype id = i+1; // Note: 1-based indexing for IDs
-		stream << id;
-		// Iterate over all combinations of (xlo|xhi) (ylo|yhi) (zlo|zhi)
-		for( int ix=0; ix<2; ++ix ) {
-			dtype x = (ix==0) ? m_xminima[i] : m_xmaxima[i];
-			for( int iy=0; iy<2; ++iy ) {
-				dtype y = (iy==0) ? m_yminima[i] : m_ymaxima[i];
-				for( int iz=0; iz<2; ++iz ) {
-					dtype z = (iz==0) ? m_zminima[i] : m_zmaxima[i];
-					stream << "," << x
-					       << "," << y
-					       << "," << z;
-				}
-			}
+	       << "\n";
+	// Copy the extrema to the host in one transfer per column
+	HostCopy<svector, dtype> xminima(m_xminima), xmaxima(m_xmaxima);
+	HostCopy<svector, dtype> yminima(m_yminima), ymaxima(m_ymaxima);
+	HostCopy<dvector>        zminima(m_zminima), zmaxima(m_zmaxima);
+	const size_t max_row_chars = 25 * 12; // 25 signed ints + separators
+	solution_row_formatter formatter = {xminima.data(), xmaxima.data(),
+	                                    yminima.data(), ymaxima.data(),
+	                                    zminima.data(), zmaxima.data()};
+	csv::write_rows(stream, size(), max_row_chars, formatter);
+	if( !stream ) {
+		throw std::runtime_error("Failed to write " + filename);
+	}
+}
+
+static const char solution_magic[8] = {'S','A','N','T','A','S','O','L'};
+
+void SantaSolution::save_binary(std::string filename) const {
+	HostCopy<svector, dtype> xminima(m_xminima), xmaxima(m_xmaxima);
+	HostCopy<svector, dtype> yminima(m_yminima), ymaxima(m_ymaxima);
+	HostCopy<dvector>        zminima(m_zminima), zmaxima(m_zmaxima);
+	std::vector<const dtype*> columns;
+	columns.push_back(xminima.data()); columns.push_back(xmaxima.data());
+	columns.push_back(yminima.data()); columns.push_back(ymaxima.data());
+	columns.push_back(zminima.data()); columns.push_back(zmaxima.data());
+	snapshot::write(filename, solution_magic, 0, size(), columns);
+}
+
+size_t SantaSolution::load_binary(std::string filename) {
+	PROFILE_SCOPE("SantaSolution::load_binary");
+	snapshot::Reader reader(filename, solution_magic, 6, sizeof(dtype));
+	size_t n = reader.count();
+	// Note: Columns are already in ID order, and always hold dtype values
+	//         whatever the storage type
+	assign(n,
+	       reader.column<dtype>(0), reader.column<dtype>(1),
+	       reader.column<dtype>(2), reader.column<dtype>(3),
+	       reader.column<dtype>(4), reader.column<dtype>(5));
+	return n;
+}
+
+void SantaSolution::assign(size_t n,
+                           const dtype* xminima, const dtype* xmaxima,
+                           const dtype* yminima, const dtype* ymaxima,
+                           const dtype* zminima, const dtype* zmaxima) {
+	const dtype* xy_src[4] = {xminima, xmaxima, yminima, ymaxima};
+	for( int c=0; c<4; ++c ) {
+		check_range<stype>(xy_src[c], xy_src[c] + n);
+	}
+	this->resize(n);
+	svector* xy_columns[4] = {&m_xminima, &m_xmaxima,
+	                          &m_yminima, &m_ymaxima};
+	for( int c=0; c<4; ++c ) {
+		thrust::copy(xy_src[c], xy_src[c] + n, xy_columns[c]->begin());
+	}
+	thrust::copy(zminima, zminima + n, m_zminima.begin());
+	thrust::copy(zmaxima, zmaxima + n, m_zmaxima.begin());
+}
+
+void SantaSolution::update(size_t count, const dtype* ids,
+                           const dtype* xminima, const dtype* xmaxima,
+                           const dtype* yminima, const dtype* ymaxima,
+                           const dtype* zminima, const dtype* zmaxima) {
+	for( size_t i=0; i<count; ++i ) {
+		if( ids[i] < 0 || size_t(ids[i]) >= size() ) {
+			throw std::out_of_range("Present ID out of range");
+		}
+	}
+	const dtype* src[6] = {xminima, xmaxima, yminima, ymaxima,
+	                       zminima, zmaxima};
+	for( int c=0; c<4; ++c ) {
+		check_range<stype>(src[c], src[c] + count);
+	}
+	// Note: Values are staged on the device and scattered into place
+	dvector d_ids(ids, ids + count);
+	dvector values(count);
+	svector* xy_columns[4] = {&m_xminima, &m_xmaxima,
+	                          &m_yminima, &m_ymaxima};
+	dvector* z_columns[2]  = {&m_zminima, &m_zmaxima};
+	for( int c=0; c<6; ++c ) {
+		thrust::copy(src[c], src[c] + count, values.begin());
+		if( c < 4 ) {
+			thrust::scatter(values.begin(), values.end(), d_ids.begin(),
+			                xy_columns[c]->begin());
+		}
+		else {
+			thrust::scatter(values.begin(), values.end(), d_ids.begin(),
+			                z_columns[c-4]->begin());
 		}
-		stream << std::endl;
 	}
 }
 
-// Branchless compare-and-swap
-template<typename T>
-__host__ __device__
-inline void cas(T& a, T& b) {
-	T a_ = a;
-	a = min(a_, b);
-	b = max(a_, b);
+size_t SantaSolution::patch_csv(const char* begin, const char* end) {
+	csv::CsvChunks chunks(begin, end, false);
+	size_t n = chunks.rows();
+	std::vector<dtype> ids(n);
+	std::vector<dtype> xminima(n), xmaxima(n);
+	std::vector<dtype> yminima(n), ymaxima(n);
+	std::vector<dtype> zminima(n), zmaxima(n);
+	if( n == 0 ) {
+		return 0;
+	}
+	solution_row_parser parser = {&ids[0],
+	                              &xminima[0], &xmaxima[0],
+	                              &yminima[0], &ymaxima[0],
+	                              &zminima[0], &zmaxima[0]};
+	chunks.for_each_row(n, parser);
+	update(n, &ids[0],
+	       &xminima[0], &xmaxima[0],
+	       &yminima[0], &ymaxima[0],
+	       &zminima[0], &zmaxima[0]);
+	return n;
 }
-// Branchless sorting network
-template<typename T>
-__host__ __device__
-inline void sort3(T& a, T& b, T& c) {
-	cas(a, b);
-	cas(b, c);
-	cas(a, b);
+
+bool SantaSolution::is_binary(std::string filename) {
+	return snapshot::is_snapshot(filename, solution_magic);
 }
 
-struct dim_mismatch_functor
-	: public thrust::binary_function<void,void,bool> {
-	template<typename Tuple1, typename Tuple2>
+// Searches the pairs i < j < range_ends[i] for one at which pair_func is
+//   nonzero, stopping all workers as soon as one is found
+// Returns the row i of the pair and writes its column j to *col, or
+//   returns -1 if there is no such pair
+template<class BinaryFunction>
+dtype find_first_pair(CachingAllocator& allocator,
+                      const dtype*      range_ends,
+                      dtype             nrows,
+                      BinaryFunction    pair_func,
+                      dtype*            col) {
+	using thrust::make_counting_iterator;
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	TempBuffer<int> first(allocator, 1);
+	first[0] = INT_MAX;
+	first_pair_functor<BinaryFunction> search_func = {pair_func,
+	                                                  {first.data()}};
+	thrust::device_ptr<const dtype> ends = thrust::device_pointer_cast(range_ends);
+	thrust::for_each(THRUST_PAR(allocator),
+	                 make_zip_iterator(make_tuple(make_counting_iterator<dtype>(0),
+	                                              ends)),
+	                 make_zip_iterator(make_tuple(make_counting_iterator<dtype>(0),
+	                                              ends)) + nrows,
+	                 search_func);
+	int row = first[0];
+	if( row == INT_MAX ) {
+		return -1;
+	}
+	// Note: Only the reported row is searched again to find the column
+	*col = *thrust::find_if(THRUST_PAR(allocator),
+	                        make_counting_iterator<dtype>(row+1),
+	                        make_counting_iterator<dtype>(ends[row]),
+	                        row_pair_predicate<BinaryFunction>(pair_func, row));
+	return row;
+}
+
+// Writes the colliding pairs in row i of the sweep to ids_a/b, starting at
+//   row_offsets[i] and stopping once max_pairs have been written in total
+template<class BinaryFunction>
+struct pair_emit_functor {
+	const long long* row_offsets;
+	const dtype*     range_ends;
+	const dtype*     ids;
+	long long        max_pairs;
+	BinaryFunction   pair_func;
+	dtype*           ids_a;
+	dtype*           ids_b;
 	inline __host__ __device__
-	bool operator()(Tuple1 soln_extrema, Tuple2 prob_dims) const {
-		Tuple1& s = soln_extrema;
-		Tuple2& p = prob_dims;
-		// Note: extrema define *closed* intervals
-		dtype s1 = thrust::get<1>(s) - (thrust::get<0>(s)-1);
-		dtype s2 = thrust::get<3>(s) - (thrust::get<2>(s)-1);
-		dtype s3 = thrust::get<5>(s) - (thrust::get<4>(s)-1);
-		dtype p1 = thrust::get<0>(p);
-		dtype p2 = thrust::get<1>(p);
-		dtype p3 = thrust::get<2>(p);
-		
-		// Compare after ignoring relative order (to allow arb. permutations)
-		sort3(s1, s2, s3);
-		sort3(p1, p2, p3);
-		return s1 != p1 || s2 != p2 || s3 != p3;
+	void operator()(dtype i) const {
+		long long p = row_offsets[i];
+		for( dtype j=i+1; j<range_ends[i] && p<max_pairs; ++j ) {
+			if( pair_func(i, j) ) {
+				dtype a = ids[i];
+				dtype b = ids[j];
+				ids_a[p] = min(a, b);
+				ids_b[p] = max(a, b);
+				++p;
+			}
+		}
 	}
 };
 
-template<class BinaryFunction1, class BinaryFunction2>
-struct range_reduce_functor
-	: public thrust::binary_function<dtype,dtype,
-	                                 typename BinaryFunction1::result_type> {
-	dtype           init;
-	BinaryFunction1 reduce_func;
-	BinaryFunction2 transform_func;
-	range_reduce_functor(dtype           init_,
-	                     BinaryFunction1 reduce_func_,
-	                     BinaryFunction2 transform_func_)
-		: init(init_), reduce_func(reduce_func_),
-		  transform_func(transform_func_) {}
-	typedef typename BinaryFunction1::result_type result_type;
+// Converts the violation counts of one present into its ViolationFlags
+template<class CountFunction>
+struct violation_flags_functor
+	: public thrust::unary_function<void,unsigned char> {
+	CountFunction count_func;
+	violation_flags_functor(CountFunction count_func_)
+		: count_func(count_func_) {}
+	template<typename T>
 	inline __host__ __device__
-	result_type operator()(dtype begin, dtype end) const {
-		result_type result = init;
-		dtype i = begin;
-		for( dtype j=i+1; j<end; ++j ) {
-			result = reduce_func(result, transform_func(i,j));
+	unsigned char operator()(T x) const {
+		validation_counts c = count_func(x);
+		unsigned char flags = 0;
+		if( c.xmin || c.xmax || c.ymin || c.ymax || c.zmin ) {
+			flags |= SantaSolution::VIOLATES_BOUNDS;
 		}
-		return result;
+		if( c.dims ) {
+			flags |= SantaSolution::VIOLATES_DIMENSIONS;
+		}
+		return flags;
 	}
 };
-template<class BinaryFunction1, class BinaryFunction2>
-range_reduce_functor<BinaryFunction1,BinaryFunction2>
-make_range_reduce_functor(dtype init,
-                          BinaryFunction1 reduce_func,
-                          BinaryFunction2 transform_func) {
-	typedef range_reduce_functor<BinaryFunction1,BinaryFunction2> type;
-	return type(init, reduce_func, transform_func);
+template<class CountFunction>
+violation_flags_functor<CountFunction>
+make_violation_flags_functor(CountFunction count_func) {
+	return violation_flags_functor<CountFunction>(count_func);
 }
-
-struct collision_functor
-	: public thrust::binary_function<dtype,dtype,dtype> {
-	const dtype* ids;
-	const dtype* xminima;
-	const dtype* xmaxima;
-	const dtype* yminima;
-	const dtype* ymaxima;
-	collision_functor(const dtype* ids_,
-	                  const dtype* xminima_,
-	                  const dtype* xmaxima_,
-	                  const dtype* yminima_,
-	                  const dtype* ymaxima_)
-		: ids(ids_),
-		  xminima(xminima_), xmaxima(xmaxima_),
-		  yminima(yminima_), ymaxima(ymaxima_) {}
+struct is_nonzero_functor
+	: public thrust::unary_function<unsigned char,dtype> {
 	inline __host__ __device__
-	dtype operator()(dtype i, dtype j) const {
-		// Determine whether presents i and j collide (in the x-y plane)
-		dtype ixb = xminima[ids[i]];
-		dtype ixe = xmaxima[ids[i]];
-		dtype iyb = yminima[ids[i]];
-		dtype iye = ymaxima[ids[i]];
-		dtype jxb = xminima[ids[j]];
-		dtype jxe = xmaxima[ids[j]];
-		dtype jyb = yminima[ids[j]];
-		dtype jye = ymaxima[ids[j]];
-		return !(ixe < jxb || jxe < ixb ||
-		         iye < jyb || jye < iyb );
+	dtype operator()(unsigned char x) const { return x != 0; }
+};
+// Writes the ID and flags of present i to position offsets[i] if it has any
+//   flags set and fewer than max_presents precede it
+struct flag_emit_functor {
+	const unsigned char* all_flags;
+	const dtype*         offsets;
+	dtype                max_presents;
+	dtype*               ids;
+	unsigned char*       flags;
+	inline __host__ __device__
+	void operator()(dtype i) const {
+		if( all_flags[i] && offsets[i] < max_presents ) {
+			ids[offsets[i]]   = i;
+			flags[offsets[i]] = all_flags[i];
+		}
 	}
 };
 
-int SantaSolution::validate(const SantaProblem& problem,
-                            bool quick,
-                            int* _size_difference,
-                            int* _boundary_violations,
-                            int* _dimension_mismatches,
-                            int* _collisions) const {
-	// Check that sizes match
-	int size_difference = int(this->size()) - int(problem.size());
-	if( _size_difference ) {
-		*_size_difference = size_difference;
-	}
-	if( quick && _size_difference != 0 ) {
-		return false;
-	}
-	
-	// Check sleigh bounds in each dimension
-	using thrust::make_constant_iterator;
-	dtype sleigh_size = problem.sleigh_size();
-	int boundary_violations = 0;
-	// sum(xminima <= 0)
-	int xmin_violations =
-		thrust::inner_product(m_xminima.begin(),
-		                      m_xminima.end(),
-		                      make_constant_iterator<dtype>(0),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      thrust::less_equal<dtype>());
-	boundary_violations += xmin_violations;
-	if( _boundary_violations ) {
-		*_boundary_violations = boundary_violations;
-	}
-	if( quick && xmin_violations > 0 ) {
-		return false;
-	}
-	// sum(xmaxima > sleigh_size)
-	int xmax_violations =
-		thrust::inner_product(m_xmaxima.begin(),
-		                      m_xmaxima.end(),
-		                      make_constant_iterator<dtype>(sleigh_size),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      thrust::greater<dtype>());
-	boundary_violations += xmax_violations;
-	if( _boundary_violations ) {
-		*_boundary_violations = boundary_violations;
-	}
-	if( quick && xmax_violations > 0 ) {
-		return false;
+// Bounding box and summed extents of all presents, which determine the
+//   layout of the collision grid
+struct grid_stats {
+	dtype     xmin, ymin, zmin;
+	dtype     xmax, ymax, zmax;
+	long long xsum, ysum, zsum;
+};
+struct grid_stats_functor
+	: public thrust::unary_function<void,grid_stats> {
+	template<typename Tuple>
+	inline __host__ __device__
+	grid_stats operator()(Tuple soln_extrema) const {
+		Tuple& s = soln_extrema;
+		grid_stats g;
+		g.xmin = thrust::get<0>(s); g.xmax = thrust::get<1>(s);
+		g.ymin = thrust::get<2>(s); g.ymax = thrust::get<3>(s);
+		g.zmin = thrust::get<4>(s); g.zmax = thrust::get<5>(s);
+		g.xsum = g.xmax - (g.xmin-1);
+		g.ysum = g.ymax - (g.ymin-1);
+		g.zsum = g.zmax - (g.zmin-1);
+		return g;
 	}
-	int ymin_violations =
-		thrust::inner_product(m_yminima.begin(),
-		                      m_yminima.end(),
-		                      make_constant_iterator<dtype>(0),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      thrust::less_equal<dtype>());
-	boundary_violations += ymin_violations;
-	if( _boundary_violations ) {
-		*_boundary_violations = boundary_violations;
+};
+struct grid_stats_combine
+	: public thrust::binary_function<grid_stats,grid_stats,grid_stats> {
+	inline __host__ __device__
+	grid_stats operator()(const grid_stats& a, const grid_stats& b) const {
+		grid_stats g;
+		g.xmin = min(a.xmin, b.xmin); g.xmax = max(a.xmax, b.xmax);
+		g.ymin = min(a.ymin, b.ymin); g.ymax = max(a.ymax, b.ymax);
+		g.zmin = min(a.zmin, b.zmin); g.zmax = max(a.zmax, b.zmax);
+		g.xsum = a.xsum + b.xsum;
+		g.ysum = a.ysum + b.ysum;
+		g.zsum = a.zsum + b.zsum;
+		return g;
 	}
-	if( quick && ymin_violations > 0 ) {
-		return false;
+};
+// Maps coords to cells of a uniform grid covering all presents
+struct grid_layout {
+	dtype     x0, y0, z0;          // Origin
+	dtype     xcell, ycell, zcell; // Cell dimensions
+	long long nx, ny;              // No. cells along x and y
+	inline __host__ __device__
+	dtype cell_x(dtype x) const { return (x - x0) / xcell; }
+	inline __host__ __device__
+	dtype cell_y(dtype y) const { return (y - y0) / ycell; }
+	inline __host__ __device__
+	dtype cell_z(dtype z) const { return (z - z0) / zcell; }
+	inline __host__ __device__
+	long long key(dtype cx, dtype cy, dtype cz) const {
+		return (cz * ny + cy) * nx + cx;
 	}
-	int ymax_violations =
-		thrust::inner_product(m_ymaxima.begin(),
-		                      m_ymaxima.end(),
-		                      make_constant_iterator<dtype>(sleigh_size),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      thrust::greater<dtype>());
-	boundary_violations += ymax_violations;
-	if( _boundary_violations ) {
-		*_boundary_violations = boundary_violations;
+};
+// Returns the no. grid cells a present overlaps
+struct grid_cell_count_functor
+	: public thrust::unary_function<void,long long> {
+	grid_layout grid;
+	grid_cell_count_functor(grid_layout grid_) : grid(grid_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	long long operator()(Tuple soln_extrema) const {
+		Tuple& s = soln_extrema;
+		long long nx = grid.cell_x(thrust::get<1>(s)) - grid.cell_x(thrust::get<0>(s)) + 1;
+		long long ny = grid.cell_y(thrust::get<3>(s)) - grid.cell_y(thrust::get<2>(s)) + 1;
+		long long nz = grid.cell_z(thrust::get<5>(s)) - grid.cell_z(thrust::get<4>(s)) + 1;
+		return nx * ny * nz;
 	}
-	if( quick && ymax_violations > 0 ) {
-		return false;
+};
+// Writes a (cell key, present ID) entry for every cell a present overlaps
+struct grid_emit_functor {
+	grid_layout      grid;
+	const stype*     xminima; const stype* xmaxima;
+	const stype*     yminima; const stype* ymaxima;
+	const dtype*     zminima; const dtype* zmaxima;
+	const long long* offsets;
+	long long*       keys;
+	dtype*           ids;
+	inline __host__ __device__
+	void operator()(dtype i) const {
+		long long e = offsets[i];
+		for( dtype cz=grid.cell_z(zminima[i]); cz<=grid.cell_z(zmaxima[i]); ++cz ) {
+			for( dtype cy=grid.cell_y(yminima[i]); cy<=grid.cell_y(ymaxima[i]); ++cy ) {
+				for( dtype cx=grid.cell_x(xminima[i]); cx<=grid.cell_x(xmaxima[i]); ++cx ) {
+					keys[e] = grid.key(cx, cy, cz);
+					ids[e]  = i;
+					++e;
+				}
+			}
+		}
 	}
-	int zmin_violations =
-		thrust::inner_product(m_zminima.begin(),
-		                      m_zminima.end(),
-		                      make_constant_iterator<dtype>(0),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      thrust::less_equal<dtype>());
-	boundary_violations += zmin_violations;
-	if( _boundary_violations ) {
-		*_boundary_violations = boundary_violations;
+};
+// Determines whether the presents of grid entries i and j (which share a
+//   cell) collide, counting each colliding pair only in the cell that
+//   contains the min corner of their intersection.
+struct grid_collision_functor {
+	grid_layout      grid;
+	const long long* keys;
+	const dtype*     ids;
+	const stype*     xminima; const stype* xmaxima;
+	const stype*     yminima; const stype* ymaxima;
+	const dtype*     zminima; const dtype* zmaxima;
+	inline __host__ __device__
+	dtype operator()(dtype i, dtype j) const {
+		dtype a = ids[i];
+		dtype b = ids[j];
+		// Note: extrema define *closed* intervals
+		if( xmaxima[a] < xminima[b] || xmaxima[b] < xminima[a] ||
+		    ymaxima[a] < yminima[b] || ymaxima[b] < yminima[a] ||
+		    zmaxima[a] < zminima[b] || zmaxima[b] < zminima[a] ) {
+			return 0;
+		}
+		dtype cx = grid.cell_x(max(xminima[a], xminima[b]));
+		dtype cy = grid.cell_y(max(yminima[a], yminima[b]));
+		dtype cz = grid.cell_z(max(zminima[a], zminima[b]));
+		return grid.key(cx, cy, cz) == keys[i];
 	}
-	if( quick && zmin_violations > 0 ) {
-		return false;
+};
+
+bool SantaSolution::count_collisions_grid(SantaWorkspace& workspace,
+                                          int*            collisions,
+                                          dtype*          pair) const {
+	// Presents are binned into a uniform grid whose cells match the mean
+	//   present extent, the entries are sorted by cell and every pair of
+	//   entries within a cell is tested exactly.
+	// Note: Cost is proportional to the no. presents sharing each cell,
+	//         independent of how many presents share a z range.
+	PROFILE_SCOPE("grid");
+	CachingAllocator& allocator = workspace.m_allocator;
+	size_t n = size();
+	if( n == 0 ) {
+		*collisions = 0;
+		if( pair ) {
+			pair[0] = pair[1] = -1;
+		}
+		return true;
 	}
-	// Note: No upper bound on z
+	grid_stats init = {m_xminima[0], m_yminima[0], m_zminima[0],
+	                   m_xmaxima[0], m_ymaxima[0], m_zmaxima[0], 0, 0, 0};
+	grid_stats stats = thrust::transform_reduce(THRUST_PAR(allocator),
+	                                            this->begin(), this->end(),
+	                                            grid_stats_functor(),
+	                                            init,
+	                                            grid_stats_combine());
+	grid_layout grid;
+	grid.x0 = stats.xmin; grid.y0 = stats.ymin; grid.z0 = stats.zmin;
+	grid.xcell = max((long long)1, stats.xsum / (long long)n);
+	grid.ycell = max((long long)1, stats.ysum / (long long)n);
+	grid.zcell = max((long long)1, stats.zsum / (long long)n);
+	grid.nx = grid.cell_x(stats.xmax) + 1;
+	grid.ny = grid.cell_y(stats.ymax) + 1;
+	double ncells = double(grid.nx) * grid.ny * (grid.cell_z(stats.zmax) + 1);
 	
-	// Check for dimension mismatches
-	// sum(soln_dims != prob_dims)
-	int dimension_mismatches = thrust::inner_product(this->begin(),
-	                                                 this->end(),
-	                                                 problem.begin(),
-	                                                 dtype(0),
-	                                                 thrust::plus<dtype>(),
-	                                                 dim_mismatch_functor());
-	if( _dimension_mismatches ) {
-		*_dimension_mismatches = dimension_mismatches;
-	}
-	if( quick && dimension_mismatches > 0 ) {
+	// Count the entries and give up if presents span too many cells
+	//   (e.g., a few huge presents in a badly broken solution)
+	const long long max_cells_per_present = 32;
+	TempBuffer<long long> offsets(allocator, n);
+	thrust::transform(THRUST_PAR(allocator),
+	                  this->begin(), this->end(), offsets.begin(),
+	                  grid_cell_count_functor(grid));
+	long long nentries = thrust::reduce(THRUST_PAR(allocator),
+	                                    offsets.begin(), offsets.end(),
+	                                    (long long)0);
+	if( ncells > 4e18 ||
+	    nentries > max_cells_per_present * (long long)n ||
+	    nentries > (long long)INT_MAX ) {
 		return false;
 	}
+	thrust::exclusive_scan(THRUST_PAR(allocator),
+	                       offsets.begin(), offsets.end(), offsets.begin());
 	
-	// Check for any collisions between presents
-	// This starts by finding all intersections between presents in the z
-	//   dimension using an O(NlogN) algorithm, and then directly checks each
-	//   z-intersecting pair for a full collision in x and y as well.
-	dvector& ids = m_tmp_ids;
-	thrust::sequence(ids.begin(), ids.end());
-	dvector& zminima = m_tmp_sorted;
+	using thrust::raw_pointer_cast;
+	TempBuffer<long long> keys(allocator, nentries);
+	TempBuffer<dtype>     ids(allocator, nentries);
+	TempBuffer<dtype>     range_ends(allocator, nentries);
+	grid_emit_functor emit = {grid,
+	                          raw_pointer_cast(&m_xminima[0]),
+	                          raw_pointer_cast(&m_xmaxima[0]),
+	                          raw_pointer_cast(&m_yminima[0]),
+	                          raw_pointer_cast(&m_ymaxima[0]),
+	                          raw_pointer_cast(&m_zminima[0]),
+	                          raw_pointer_cast(&m_zmaxima[0]),
+	                          offsets.data(),
+	                          keys.data(),
+	                          ids.data()};
+	using thrust::make_counting_iterator;
+	thrust::for_each(THRUST_PAR(allocator),
+	                 make_counting_iterator<dtype>(0),
+	                 make_counting_iterator<dtype>(n),
+	                 emit);
+	thrust::sort_by_key(THRUST_PAR(allocator),
+	                    keys.begin(), keys.end(), ids.begin());
+	// Each entry's collision range runs to the end of its cell
+	thrust::upper_bound(THRUST_PAR(allocator),
+	                    keys.begin(), keys.end(),
+	                    keys.begin(), keys.end(),
+	                    range_ends.begin());
+	grid_collision_functor collision_func = {grid,
+	                                         keys.data(),
+	                                         ids.data(),
+	                                         raw_pointer_cast(&m_xminima[0]),
+	                                         raw_pointer_cast(&m_xmaxima[0]),
+	                                         raw_pointer_cast(&m_yminima[0]),
+	                                         raw_pointer_cast(&m_ymaxima[0]),
+	                                         raw_pointer_cast(&m_zminima[0]),
+	                                         raw_pointer_cast(&m_zmaxima[0])};
+	if( pair ) {
+		dtype col;
+		dtype row = find_first_pair(allocator,
+		                            range_ends.data(), nentries,
+		                            collision_func, &col);
+		*collisions = row >= 0;
+		pair[0] = row >= 0 ? dtype(ids[row]) : -1;
+		pair[1] = row >= 0 ? dtype(ids[col]) : -1;
+		return true;
+	}
+	*collisions = reduce_pairs_balanced(allocator,
+	                                    range_ends.data(), nentries,
+	                                    collision_func);
+	return true;
+}
+
+void SantaSolution::sort_z_ranges(SantaWorkspace& workspace) const {
+	PROFILE_SCOPE("sort z ranges");
+	CachingAllocator& allocator = workspace.m_allocator;
+	dvector& ids = workspace.m_ids;
+	ids.resize(size());
+	thrust::sequence(THRUST_PAR(allocator), ids.begin(), ids.end());
+	dvector& zminima = workspace.m_sorted;
 	zminima = m_zminima;
 	//dvector& range_ends = ids; // Note: We can re-use ids when this is needed
-	dvector& range_ends = m_tmp_indices;
+	dvector& range_ends = workspace.m_indices;
+	range_ends.resize(size());
 	// Sort interval starts, keeping track of ordering. These form the
 	//   starts of the collision ranges.
-	thrust::stable_sort_by_key(zminima.begin(), zminima.end(), // Keys
+	thrust::stable_sort_by_key(THRUST_PAR(allocator),
+	                           zminima.begin(), zminima.end(), // Keys
 	                           ids.begin());                   // Values
 	// Find where corresponding interval ends would be inserted into
 	//   sorted starts. These form the ends of the collision ranges.
-	thrust::upper_bound(zminima.begin(), zminima.end(),
+	thrust::upper_bound(THRUST_PAR(allocator),
+	                    zminima.begin(), zminima.end(),
 	                    make_permutation_iterator(m_zmaxima.begin(),
 	                                              ids.begin()),
 	                    make_permutation_iterator(m_zmaxima.begin(),
 	                                              ids.end()),
 	                    range_ends.begin());
+}
+
+packed_boxes<SantaSolution::stype>
+SantaSolution::pack_sorted_boxes(SantaWorkspace& workspace) const {
+	PROFILE_SCOPE("pack boxes");
+	CachingAllocator& allocator = workspace.m_allocator;
+	// Note: The x/y extents are stored as consecutive columns so that a
+	//         row of the sweep reads each one contiguously
+	const dvector& ids = workspace.m_ids;
+	size_t n = size();
+	workspace.m_boxes.resize(4 * n);
+	const svector* columns[4] = {&m_xminima, &m_xmaxima,
+	                             &m_yminima, &m_ymaxima};
+	for( int c=0; c<4; ++c ) {
+		thrust::gather(THRUST_PAR(allocator),
+		               ids.begin(), ids.end(),
+		               columns[c]->begin(),
+		               workspace.m_boxes.begin() + c * n);
+	}
+	const stype* base = thrust::raw_pointer_cast(workspace.m_boxes.data());
+	packed_boxes<stype> boxes = {base, base + n, base + 2*n, base + 3*n};
+	return boxes;
+}
+
+bool SantaSolution::sweep_is_dense(SantaWorkspace& workspace) const {
+	CachingAllocator& allocator = workspace.m_allocator;
+	// Note: The sweep tests every z-overlapping pair, which is nearly
+	//         quadratic for layered packings; the grid only tests
+	//         presents that are also close in x and y, but sorts several
+	//         cell entries per present to do so. Binning a present costs
+	//         about as much as sweeping 256 pairs with the scalar loop, or
+	//         3072 32-bit (6144 16-bit) pairs with AVX2 or AVX-512, which
+	//         are both limited by memory bandwidth rather than vector width
+	//         at that point.
+	long long max_sweep_pairs_per_present =
+		box_sweep::simd_level<stype>() == box_sweep::SIMD_SCALAR ? 256 :
+		3072 * 4 / (long long)sizeof(stype);
+	using thrust::make_counting_iterator;
+	long long sweep_pairs =
+		thrust::inner_product(THRUST_PAR(allocator),
+		                      make_counting_iterator<dtype>(0),
+		                      make_counting_iterator<dtype>(size()),
+		                      workspace.m_indices.begin(),
+		                      (long long)0,
+		                      thrust::plus<long long>(),
+		                      span_length_functor());
+	return sweep_pairs > max_sweep_pairs_per_present * (long long)size();
+}
+
+int SantaSolution::count_collisions(CollisionMethod method,
+                                    SantaWorkspace* _workspace) const {
+	PROFILE_SCOPE("count_collisions");
+	SantaWorkspacePool::Lease lease(_workspace);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	int collisions;
+	if( method == COLLISIONS_GRID &&
+	    count_collisions_grid(workspace, &collisions) ) {
+		return collisions;
+	}
+	// This starts by finding all intersections between presents in the z
+	//   dimension using an O(NlogN) algorithm, and then directly checks each
+	//   z-intersecting pair for a full collision in x and y as well.
+	sort_z_ranges(workspace);
+	dvector& range_ends = workspace.m_indices;
+	using thrust::make_counting_iterator;
+	if( method == COLLISIONS_AUTO && sweep_is_dense(workspace) &&
+	    count_collisions_grid(workspace, &collisions) ) {
+		return collisions;
+	}
 	// For each interval, iterate through all z-collisions and compute
 	//   whether the collision also occurred in x and y dims.
+	PROFILE_SCOPE("sweep");
 	using thrust::raw_pointer_cast;
-	collision_functor collision_func(raw_pointer_cast(&ids[0]),
-	                                 raw_pointer_cast(&m_xminima[0]),
-	                                 raw_pointer_cast(&m_xmaxima[0]),
-	                                 raw_pointer_cast(&m_yminima[0]),
-	                                 raw_pointer_cast(&m_ymaxima[0]));
-	using thrust::make_counting_iterator;
+	packed_collision_functor collision_func(pack_sorted_boxes(workspace));
+	if( method != COLLISIONS_SWEEP ) {
+		// Note: Spreads long z-overlap spans over many workers
+		return reduce_pairs_balanced(allocator,
+		                             raw_pointer_cast(&range_ends[0]), size(),
+		                             collision_func);
+	}
 	// sum(count_collisions(index))
-	int collisions =
-		thrust::inner_product(make_counting_iterator<dtype>(0),
+	collisions =
+		thrust::inner_product(THRUST_PAR(allocator),
+		                      make_counting_iterator<dtype>(0),
 		                      make_counting_iterator<dtype>(size()),
 		                      range_ends.begin(),
-		                      dtype(0),
-		                      thrust::plus<dtype>(),
-		                      make_range_reduce_functor(dtype(0),
-		                                                thrust::plus<dtype>(),
-		                                                collision_func));
-	if( _collisions ) {
-		*_collisions = collisions;
+		                      (long long)0,
+		                      thrust::plus<long long>(),
+		                      make_row_reduce_functor(collision_func));
+	return collisions;
+}
+
+size_t SantaSolution::find_collisions(size_t              max_pairs,
+                                      std::vector<dtype>* ids_a,
+                                      std::vector<dtype>* ids_b,
+                                      SantaWorkspace*     _workspace) const {
+	SantaWorkspacePool::Lease lease(_workspace);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	// Note: The total comes from count_collisions, so it uses the same
+	//         method as validate. The pairs themselves are then found by
+	//         counting the colliding pairs in each row of the z-sweep,
+	//         scanning the counts to get each row's output offset and
+	//         revisiting the rows that start before the cap. Rows are
+	//         counted a chunk at a time, stopping once the cap is reached.
+	size_t npairs   = count_collisions(m_collision_method, &workspace);
+	size_t nwritten = std::min(npairs, max_pairs);
+	TempBuffer<dtype> out_a(allocator, nwritten);
+	TempBuffer<dtype> out_b(allocator, nwritten);
+	if( nwritten > 0 ) {
+		sort_z_ranges(workspace);
+		dvector& ids        = workspace.m_ids;
+		dvector& range_ends = workspace.m_indices;
+		using thrust::make_counting_iterator;
+		using thrust::raw_pointer_cast;
+		packed_collision_functor collision_func(pack_sorted_boxes(workspace));
+		const dtype chunk_rows = 1 << 16;
+		dtype nrows = size();
+		TempBuffer<long long> row_offsets(allocator, nrows);
+		dtype     ncounted = 0;
+		long long nfound   = 0;
+		while( ncounted < nrows && nfound < (long long)nwritten ) {
+			dtype end = std::min(nrows, ncounted + chunk_rows);
+			thrust::transform(THRUST_PAR(allocator),
+			                  make_counting_iterator<dtype>(ncounted),
+			                  make_counting_iterator<dtype>(end),
+			                  range_ends.begin() + ncounted,
+			                  row_offsets.begin() + ncounted,
+			                  make_row_reduce_functor(collision_func));
+			long long last_row_count = row_offsets[end-1];
+			thrust::exclusive_scan(THRUST_PAR(allocator),
+			                       row_offsets.begin() + ncounted,
+			                       row_offsets.begin() + end,
+			                       row_offsets.begin() + ncounted,
+			                       nfound);
+			nfound   = row_offsets[end-1] + last_row_count;
+			ncounted = end;
+		}
+		// Rows are in increasing offset order, so those at or beyond the
+		//   cap can be skipped entirely.
+		dtype nemit = thrust::lower_bound(THRUST_PAR(allocator),
+		                                  row_offsets.data(),
+		                                  row_offsets.data() + ncounted,
+		                                  (long long)nwritten)
+			- row_offsets.data();
+		pair_emit_functor<packed_collision_functor> emit_func = {
+			row_offsets.data(),
+			raw_pointer_cast(&range_ends[0]),
+			raw_pointer_cast(&ids[0]),
+			(long long)nwritten,
+			collision_func,
+			out_a.data(),
+			out_b.data()};
+		thrust::for_each(THRUST_PAR(allocator),
+		                 make_counting_iterator<dtype>(0),
+		                 make_counting_iterator<dtype>(nemit),
+		                 emit_func);
+	}
+	if( ids_a ) {
+		ids_a->resize(nwritten);
+		thrust::copy(out_a.begin(), out_a.end(), ids_a->begin());
+	}
+	if( ids_b ) {
+		ids_b->resize(nwritten);
+		thrust::copy(out_b.begin(), out_b.end(), ids_b->begin());
+	}
+	return npairs;
+}
+
+size_t SantaSolution::find_violations(const SantaProblem&         problem,
+                                      size_t                      max_presents,
+                                      std::vector<dtype>*         ids,
+                                      std::vector<unsigned char>* flags) const {
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	using thrust::make_counting_iterator;
+	using thrust::raw_pointer_cast;
+	using thrust::make_transform_iterator;
+	// Flag each present in the same way that validate counts them
+	size_t n        = this->size();
+	size_t nmatched = std::min(n, problem.size());
+	thrust::device_vector<unsigned char> all_flags(n);
+	thrust::transform(make_zip_iterator(make_tuple(this->begin(),
+	                                               problem.begin())),
+	                  make_zip_iterator(make_tuple(this->begin(),
+	                                               problem.begin()))
+	                  + nmatched,
+	                  all_flags.begin(),
+	                  make_violation_flags_functor(
+	                      bounds_dims_functor(problem.sleigh_size())));
+	thrust::transform(this->begin() + nmatched, this->end(),
+	                  all_flags.begin() + nmatched,
+	                  make_violation_flags_functor(
+	                      bounds_functor(problem.sleigh_size())));
+	// Compact the flagged presents into the output, up to the cap
+	size_t nflagged = 0;
+	dvector offsets(n);
+	if( n > 0 ) {
+		thrust::exclusive_scan(make_transform_iterator(all_flags.begin(),
+		                                               is_nonzero_functor()),
+		                       make_transform_iterator(all_flags.end(),
+		                                               is_nonzero_functor()),
+		                       offsets.begin());
+		nflagged = offsets[n-1] + (all_flags[n-1] != 0);
+	}
+	size_t nwritten = std::min(nflagged, max_presents);
+	dvector                              out_ids(nwritten);
+	thrust::device_vector<unsigned char> out_flags(nwritten);
+	if( nwritten > 0 ) {
+		flag_emit_functor emit_func = {
+			raw_pointer_cast(&all_flags[0]),
+			raw_pointer_cast(&offsets[0]),
+			(dtype)nwritten,
+			raw_pointer_cast(&out_ids[0]),
+			raw_pointer_cast(&out_flags[0])};
+		thrust::for_each(make_counting_iterator<dtype>(0),
+		                 make_counting_iterator<dtype>(n),
+		                 emit_func);
 	}
-	if( quick && collisions > 0 ) {
+	if( ids ) {
+		ids->resize(nwritten);
+		thrust::copy(out_ids.begin(), out_ids.end(), ids->begin());
+	}
+	if( flags ) {
+		flags->resize(nwritten);
+		thrust::copy(out_flags.begin(), out_flags.end(), flags->begin());
+	}
+	return nflagged;
+}
+
+int SantaSolution::validate(const SantaProblem& problem,
+                            bool quick,
+                            int* _size_difference,
+                            int* _boundary_violations,
+                            int* _dimension_mismatches,
+                            int* _collisions,
+                            SantaWorkspace* _workspace) const {
+	PROFILE_SCOPE("SantaSolution::validate");
+	SantaWorkspacePool::Lease lease(_workspace);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	// Check that sizes match
+	int size_difference = int(this->size()) - int(problem.size());
+	if( _size_difference ) {
+		*_size_difference = size_difference;
+	}
+	if( quick && size_difference != 0 ) {
 		return false;
 	}
+	if( quick ) {
+		// Note: Only the check that failed first is known
+		Violation violation;
+		bool valid = find_first_violation(problem, &violation, &workspace);
+		if( _boundary_violations ) {
+			*_boundary_violations = violation.check == CHECK_BOUNDS;
+		}
+		if( violation.check == CHECK_BOUNDS ) {
+			return false;
+		}
+		if( _dimension_mismatches ) {
+			*_dimension_mismatches = violation.check == CHECK_DIMENSIONS;
+		}
+		if( violation.check == CHECK_DIMENSIONS ) {
+			return false;
+		}
+		if( _collisions ) {
+			*_collisions = violation.check == CHECK_COLLISIONS;
+		}
+		return valid;
+	}
+	
+	// Check sleigh bounds and dimensions in a single fused pass
+	// Note: Presents beyond the end of the problem (if any) can only be
+	//         checked against the bounds.
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	size_t nmatched = std::min(this->size(), problem.size());
+	validation_counts zero = {0, 0, 0, 0, 0, 0};
+	validation_counts counts = zero;
+	{
+		PROFILE_SCOPE("bounds and dimensions");
+		counts =
+			thrust::transform_reduce(THRUST_PAR(allocator),
+			                         make_zip_iterator(make_tuple(this->begin(),
+			                                                      problem.begin())),
+			                         make_zip_iterator(make_tuple(this->begin(),
+			                                                      problem.begin()))
+			                         + nmatched,
+			                         bounds_dims_functor(problem.sleigh_size()),
+			                         zero,
+			                         validation_counts_plus());
+		if( nmatched < this->size() ) {
+			counts = validation_counts_plus()(
+				counts,
+				thrust::transform_reduce(THRUST_PAR(allocator),
+				                         this->begin() + nmatched,
+				                         this->end(),
+				                         bounds_functor(problem.sleigh_size()),
+				                         zero,
+				                         validation_counts_plus()));
+		}
+	}
+	int boundary_violations = (counts.xmin + counts.xmax +
+	                           counts.ymin + counts.ymax +
+	                           counts.zmin);
+	if( _boundary_violations ) {
+		*_boundary_violations = boundary_violations;
+	}
+	
+	// sum(soln_dims != prob_dims)
+	int dimension_mismatches = counts.dims;
+	if( _dimension_mismatches ) {
+		*_dimension_mismatches = dimension_mismatches;
+	}
+	
+	// Check for any collisions between presents
+	int collisions = count_collisions(m_collision_method, &workspace);
+	if( _collisions ) {
+		*_collisions = collisions;
+	}
 	
 	return (size_difference      == 0 &&
 	        boundary_violations  == 0 &&
@@ -425,32 +1006,124 @@ int SantaSolution::validate(const SantaProblem& problem,
 	        collisions           == 0);
 }
 
-int SantaSolution::score() const {
-	dtype zmax = *thrust::max_element(m_zmaxima.begin(), m_zmaxima.end());
-	
-	// Initialise temporary data spaces
-	dvector& ids = m_tmp_ids;
-	thrust::sequence(ids.begin(), ids.end());
-	dvector& zmaxima = m_tmp_sorted;
-	zmaxima = m_zmaxima;
-	
-	// Produce IDs sorted primarily by zmax, secondarily by ID
-	thrust::sort_by_key(ids.begin(),
-	                    ids.end(),
-	                    zmaxima.begin());
-	thrust::stable_sort_by_key(zmaxima.rbegin(),
-	                           zmaxima.rend(),
-	                           ids.rbegin());
+bool SantaSolution::find_first_violation(const SantaProblem& problem,
+                                         Violation*          violation,
+                                         SantaWorkspace*     _workspace) const {
+	PROFILE_SCOPE("SantaSolution::find_first_violation");
+	SantaWorkspacePool::Lease lease(_workspace);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	using thrust::make_zip_iterator;
+	using thrust::make_tuple;
+	using thrust::make_counting_iterator;
+	using thrust::raw_pointer_cast;
+	Violation result = {CHECK_NONE, -1, -1};
+	size_t nmatched = std::min(this->size(), problem.size());
+	if( this->size() != problem.size() ) {
+		result.check   = CHECK_SIZE;
+		result.present = nmatched;
+	}
+	// Check sleigh bounds and dimensions, stopping at the first bounds
+	//   violation
+	if( result.check == CHECK_NONE ) {
+		PROFILE_SCOPE("bounds and dimensions");
+		typedef thrust::zip_iterator<
+			thrust::tuple<const_iterator,
+			              SantaProblem::const_iterator> > matched_iterator;
+		// Note: Blocks are small enough to be spread over the workers yet
+		//         long enough to amortise polling the stop flag
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+		const dtype block_size = 32;
+#else
+		const dtype block_size = 4096;
+#endif
+		dtype nblocks = (nmatched + block_size-1) / block_size;
+		TempBuffer<int> first(allocator, 1);
+		first[0] = INT_MAX;
+		first_violation_functor<bounds_dims_functor, matched_iterator>
+			search_func = {bounds_dims_functor(problem.sleigh_size()),
+			               make_zip_iterator(make_tuple(this->begin(),
+			                                            problem.begin())),
+			               dtype(nmatched), block_size, {first.data()}};
+		thrust::for_each(THRUST_PAR(allocator),
+		                 make_counting_iterator<dtype>(0),
+		                 make_counting_iterator<dtype>(nblocks),
+		                 search_func);
+		if( first[0] != INT_MAX ) {
+			bool bounds    = first[0] < dtype(nmatched);
+			result.check   = bounds ? CHECK_BOUNDS : CHECK_DIMENSIONS;
+			result.present = bounds ? first[0] : first[0] - dtype(nmatched);
+		}
+	}
+	// Check for collisions, stopping at the first colliding pair
+	if( result.check == CHECK_NONE ) {
+		dtype pair[2] = {-1, -1};
+		int   found;
+		bool  use_grid = m_collision_method == COLLISIONS_GRID;
+		sort_z_ranges(workspace);
+		if( m_collision_method == COLLISIONS_AUTO ) {
+			use_grid = sweep_is_dense(workspace);
+		}
+		if( !use_grid || !count_collisions_grid(workspace, &found, pair) ) {
+			PROFILE_SCOPE("sweep");
+			packed_collision_functor collision_func(pack_sorted_boxes(workspace));
+			dtype col;
+			dtype row = find_first_pair(allocator,
+			                            raw_pointer_cast(workspace.m_indices.data()),
+			                            size(), collision_func, &col);
+			if( row >= 0 ) {
+				pair[0] = workspace.m_ids[row];
+				pair[1] = workspace.m_ids[col];
+			}
+		}
+		if( pair[0] >= 0 ) {
+			result.check   = CHECK_COLLISIONS;
+			result.present = min(pair[0], pair[1]);
+			result.other   = max(pair[0], pair[1]);
+		}
+	}
+	if( violation ) {
+		*violation = result;
+	}
+	return result.check == CHECK_NONE;
+}
+
+SantaSolution::score_type SantaSolution::score(SantaWorkspace* _workspace) const {
+	PROFILE_SCOPE("SantaSolution::score");
+	if( size() == 0 ) {
+		return 0;
+	}
+	SantaWorkspacePool::Lease lease(_workspace);
+	SantaWorkspace&   workspace = *lease;
+	CachingAllocator& allocator = workspace.m_allocator;
+	// Produce IDs sorted primarily by zmax (descending), secondarily by ID
+	// Note: A single sort of packed keys replaces a sort by ID followed by a
+	//         stable sort by zmax, and lets thrust use a radix sort.
+	using thrust::make_counting_iterator;
+	thrust::device_vector<uint64_t>& keys = workspace.m_keys;
+	{
+		PROFILE_SCOPE("sort keys");
+		keys.resize(size());
+		thrust::transform(THRUST_PAR(allocator),
+		                  m_zmaxima.begin(),
+		                  m_zmaxima.end(),
+		                  make_counting_iterator<dtype>(0),
+		                  keys.begin(),
+		                  score_key_functor());
+		thrust::sort(THRUST_PAR(allocator), keys.begin(), keys.end());
+	}
+	dtype zmax = score_key_zmax(keys[0]);
 	
 	// Compute ordering metric
 	// sum(abs(IDs - index))
-	using thrust::make_counting_iterator;
-	dtype sigma = thrust::inner_product(ids.begin(),
-	                                    ids.end(),
-	                                    make_counting_iterator<dtype>(0),
-	                                    dtype(0),
-	                                    thrust::plus<dtype>(),
-	                                    abs_diff_functor());
-	dtype score = 2 * zmax + sigma;
+	PROFILE_SCOPE("ordering metric");
+	score_type sigma = thrust::inner_product(THRUST_PAR(allocator),
+	                                         keys.begin(),
+	                                         keys.end(),
+	                                         make_counting_iterator<long long>(0),
+	                                         score_type(0),
+	                                         thrust::plus<score_type>(),
+	                                         key_abs_diff_functor());
+	score_type score = 2 * score_type(zmax) + sigma;
 	return score;
 }
@@ -21,47 +21,133 @@ benbarsdell@gmail.com
 
 #pragma once
 
+#include <vector>
+
+#include <stdint.h>
+
 #include <thrust/device_vector.h>
 #include <thrust/iterator/zip_iterator.h>
 
 #include <SantaProblem.hpp>
 
+template<typename T> struct packed_boxes;
+class SantaWorkspace;
+
 class SantaSolution {
 public:
 	typedef int                              dtype;
-	typedef thrust::device_vector<dtype>     dvector;
+	// Storage type of the x and y extents, which are bounded by the sleigh
+	//   size (see SantaProblem::stype)
+	// Note: z extents are unbounded and always stored as dtype
+	typedef SantaProblem::stype              stype;
+	typedef column_vector<dtype>::type       dvector;
+	typedef column_vector<stype>::type       svector;
 	typedef typename dvector::iterator       diter;
 	typedef typename dvector::const_iterator const_diter;
-	typedef thrust::zip_iterator<thrust::tuple<diter, diter,
-	                                           diter, diter,
+	typedef typename svector::iterator       siter;
+	typedef typename svector::const_iterator const_siter;
+	typedef thrust::zip_iterator<thrust::tuple<siter, siter,
+	                                           siter, siter,
 	                                           diter, diter> > iterator;
-	typedef thrust::zip_iterator<thrust::tuple<const_diter,
-	                                           const_diter,
-	                                           const_diter,
-	                                           const_diter,
+	typedef thrust::zip_iterator<thrust::tuple<const_siter,
+	                                           const_siter,
+	                                           const_siter,
+	                                           const_siter,
 	                                           const_diter,
 	                                           const_diter> > const_iterator;
 	typedef typename iterator::reference       reference;
 	typedef typename const_iterator::reference const_reference;
+	// Note: The ordering term of the score grows as N^2
+	typedef long long                          score_type;
+	// Algorithms for counting collisions between presents
+	enum CollisionMethod {
+		COLLISIONS_AUTO,           // Grid if z-overlaps are dense,
+		                           //   otherwise balanced sweep
+		COLLISIONS_SWEEP,          // Test all pairs of presents that overlap
+		                           //   in z, one present per worker
+		COLLISIONS_GRID,           // Test all pairs sharing a cell of a 3D
+		                           //   grid
+		COLLISIONS_SWEEP_BALANCED  // As sweep, but with the pairs spread
+		                           //   evenly over the workers
+	};
+	// Per-present violation flags reported by find_violations
+	enum ViolationFlag {
+		VIOLATES_BOUNDS     = 1<<0,
+		VIOLATES_DIMENSIONS = 1<<1
+	};
+	// The checks made by validate, in the order in which they are made
+	enum ValidationCheck {
+		CHECK_NONE,        // No violation
+		CHECK_SIZE,        // No. presents differs from the problem
+		CHECK_BOUNDS,      // Present lies outside the sleigh
+		CHECK_DIMENSIONS,  // Present's extents don't match its dimensions
+		CHECK_COLLISIONS   // Present intersects another present
+	};
+	// Describes the violation found by find_first_violation
+	struct Violation {
+		ValidationCheck check;
+		dtype           present; // (0-based) ID of the offending present,
+		                         //   or the first unmatched one for
+		                         //   CHECK_SIZE
+		dtype           other;   // The other present of a collision
+	};
 private:
 	// Note: These are always to be kept in ID order
-	dvector m_xminima, m_xmaxima;
-	dvector m_yminima, m_ymaxima;
+	svector m_xminima, m_xmaxima;
+	svector m_yminima, m_ymaxima;
 	dvector m_zminima, m_zmaxima;
-	// Temporary spaces required for some of the algorithms
-	mutable dvector m_tmp_ids;
-	mutable dvector m_tmp_sorted;
-	mutable dvector m_tmp_indices;
+	CollisionMethod m_collision_method;
+	// Note: The queries below keep all of their temporary storage in a
+	//         SantaWorkspace, so a solution holds no mutable state.
+	// Sorts the presents by zmin into the workspace's ids and finds the end
+	//   of each one's z-overlap range in that order (in its indices)
+	void sort_z_ranges(SantaWorkspace& workspace) const;
+	// Gathers the x/y extents into the workspace's boxes in the order of
+	//   its ids
+	packed_boxes<stype> pack_sorted_boxes(SantaWorkspace& workspace) const;
+	// Returns true if COLLISIONS_AUTO should use the grid rather than the
+	//   sweep, given the z ranges found by sort_z_ranges
+	bool sweep_is_dense(SantaWorkspace& workspace) const;
+	// Returns false if the grid would be too large to be worthwhile
+	// If pair is given, stops at the first colliding pair found instead of
+	//   counting them all, writing its IDs to pair[0] and pair[1] (or -1)
+	bool count_collisions_grid(SantaWorkspace& workspace,
+	                           int*            collisions,
+	                           dtype*          pair=0) const;
+	// Streams a gzip/zstd-compressed csv file through the parser
+	size_t load_compressed(std::string filename, size_t count);
 public:
 	inline SantaSolution();
 	inline SantaSolution(size_t size, dtype val=dtype());
 	inline SantaSolution(std::string filename);
 	// Loads solution-definition csv file with cols(id,x1,y1,z1,...,x8,y8,z8)
+	//   which may be gzip- or zstd-compressed (see compressed_io.hpp)
 	// Returns no. loaded
 	size_t                load(std::string filename,
 	                           size_t      count=size_t(-1));
 	// Saves solution-definition csv file with cols(id,x1,y1,z1,...,x8,y8,z8)
 	void                  save(std::string filename);
+	// Saves/loads a binary columnar snapshot of the ID-sorted extrema
+	//   Returns no. loaded
+	void                  save_binary(std::string filename) const;
+	size_t                load_binary(std::string filename);
+	// Returns true if filename is a binary solution snapshot
+	static bool           is_binary(std::string filename);
+	// Replaces the solution with count presents whose extrema are given as
+	//   host columns in ID order (as stored in a binary snapshot)
+	void                  assign(size_t count,
+	                             const dtype* xminima, const dtype* xmaxima,
+	                             const dtype* yminima, const dtype* ymaxima,
+	                             const dtype* zminima, const dtype* zmaxima);
+	// Sets the extrema of the presents with the given (0-based, unique) IDs
+	void                  update(size_t count, const dtype* ids,
+	                             const dtype* xminima, const dtype* xmaxima,
+	                             const dtype* yminima, const dtype* ymaxima,
+	                             const dtype* zminima, const dtype* zmaxima);
+	// Applies rows in the solution-definition csv format (without a
+	//   header), each replacing the present with its ID
+	// Returns no. rows applied
+	size_t                patch_csv(const char* begin, const char* end);
 	inline size_t         size() const;
 	inline void           resize(size_t size, dtype val=dtype());
 	inline iterator       begin();
@@ -70,17 +156,63 @@ public:
 	inline const_iterator end() const;
 	inline reference       operator[](size_t i);
 	inline const_reference operator[](size_t i) const;
+	inline const_siter    xminima_begin() const;
+	inline const_siter    xmaxima_begin() const;
+	inline const_siter    yminima_begin() const;
+	inline const_siter    ymaxima_begin() const;
+	inline const_diter    zminima_begin() const;
+	inline const_diter    zmaxima_begin() const;
+	inline CollisionMethod collision_method() const;
+	// Sets the method used by validate to count collisions
+	inline void           set_collision_method(CollisionMethod method);
+	// Note: The queries below are safe to call from many threads at once.
+	//         Those needing temporary storage take it from the given
+	//         workspace, or else borrow one from SantaWorkspacePool::global().
+	// Returns the no. pairs of presents that intersect
+	int count_collisions(CollisionMethod method=COLLISIONS_AUTO,
+	                     SantaWorkspace* workspace=0) const;
+	// Writes the (0-based) IDs of at most max_pairs colliding pairs of
+	//   presents to ids_a and ids_b (with ids_a[k] < ids_b[k])
+	// Returns the total no. colliding pairs, which may exceed max_pairs
+	size_t find_collisions(size_t              max_pairs,
+	                       std::vector<dtype>* ids_a,
+	                       std::vector<dtype>* ids_b,
+	                       SantaWorkspace*     workspace=0) const;
+	// Writes the (0-based) IDs and ViolationFlags of at most max_presents
+	//   presents that violate the sleigh bounds or their dimensions
+	// Returns the total no. such presents, which may exceed max_presents
+	size_t find_violations(const SantaProblem&         problem_def,
+	                       size_t                      max_presents,
+	                       std::vector<dtype>*         ids,
+	                       std::vector<unsigned char>* flags) const;
+	// Returns true if the solution is valid, writing the no. violations of
+	//   each check to the given counts
+	// Note: In quick mode this stops at the first violation found (see
+	//         find_first_violation), reporting a count of 1 for the check
+	//         that failed and leaving the counts of later checks unset.
 	int validate(const SantaProblem& problem_def,
 	             bool                quick=false,
 	             int*                size_difference=0,
 	             int*                boundary_violations=0,
 	             int*                dimension_mismatches=0,
-	             int*                collisions=0) const;
-	int score() const;
+	             int*                collisions=0,
+	             SantaWorkspace*     workspace=0) const;
+	// Returns true if the solution is valid
+	// Otherwise, describes a violation in *violation, stopping all workers
+	//   as soon as one finds it instead of counting every violation
+	// Note: The first check to fail is reported. The first dimension
+	//         mismatch is reported, but which bounds violation or collision
+	//         is reported depends on the workers' timing.
+	bool find_first_violation(const SantaProblem& problem_def,
+	                          Violation*          violation=0,
+	                          SantaWorkspace*     workspace=0) const;
+	score_type score(SantaWorkspace* workspace=0) const;
 };
-SantaSolution::SantaSolution() {}
-SantaSolution::SantaSolution(size_t n, dtype val) { resize(n, val); }
-SantaSolution::SantaSolution(std::string filename) {
+SantaSolution::SantaSolution() : m_collision_method(COLLISIONS_AUTO) {}
+SantaSolution::SantaSolution(size_t n, dtype val)
+	: m_collision_method(COLLISIONS_AUTO) { resize(n, val); }
+SantaSolution::SantaSolution(std::string filename)
+	: m_collision_method(COLLISIONS_AUTO) {
 	this->load(filename);
 }
 size_t SantaSolution::size() const {
@@ -93,10 +225,6 @@ void SantaSolution::resize(size_t n, dtype val) {
 	m_ymaxima.resize(n, val);
 	m_zminima.resize(n, val);
 	m_zmaxima.resize(n, val);
-	
-	m_tmp_ids.resize(n);
-	m_tmp_sorted.resize(n);
-	m_tmp_indices.resize(n);
 }
 SantaSolution::iterator SantaSolution::begin() {
 	using thrust::make_zip_iterator;
@@ -126,3 +254,15 @@ SantaSolution::const_iterator SantaSolution::end() const {
 }
 SantaSolution::reference       SantaSolution::operator[](size_t i)       { return *(begin() + i); }
 SantaSolution::const_reference SantaSolution::operator[](size_t i) const { return *(begin() + i); }
+SantaSolution::const_siter SantaSolution::xminima_begin() const { return m_xminima.begin(); }
+SantaSolution::const_siter SantaSolution::xmaxima_begin() const { return m_xmaxima.begin(); }
+SantaSolution::const_siter SantaSolution::yminima_begin() const { return m_yminima.begin(); }
+SantaSolution::const_siter SantaSolution::ymaxima_begin() const { return m_ymaxima.begin(); }
+SantaSolution::const_diter SantaSolution::zminima_begin() const { return m_zminima.begin(); }
+SantaSolution::const_diter SantaSolution::zmaxima_begin() const { return m_zmaxima.begin(); }
+SantaSolution::CollisionMethod SantaSolution::collision_method() const {
+	return m_collision_method;
+}
+void SantaSolution::set_collision_method(CollisionMethod method) {
+	m_collision_method = method;
+}
@@ -0,0 +1,467 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#include <SantaStreamValidator.hpp>
+#include "validation_functors.hpp"
+#include "solution_csv.hpp"
+#include "compressed_io.hpp"
+#include "file_io.hpp"
+#include "stopwatch.hpp"
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include <thrust/copy.h>
+#include <thrust/tuple.h>
+
+typedef SantaStreamValidator::Box Box;
+
+// Calls sink(begin, end, first) on successive newline-aligned blocks of a
+//   plain or compressed csv file until it returns false, where first is
+//   true only for the block that starts with the header line
+// Note: Plain files are memory-mapped, so their pages are read on demand
+//         and can be dropped again by the OS; they need not fit in memory.
+template<typename Sink>
+void for_each_csv_block(std::string filename, Sink& sink) {
+	if( compressed::is_compressed(filename) ) {
+		compressed::for_each_line_block(filename, sink);
+		return;
+	}
+	MappedFile file(filename);
+	const size_t block_size = compressed::BlockReader::block_size;
+	const char* begin = file.begin();
+	bool first = true;
+	while( begin != file.end() ) {
+		const char* end = begin + std::min(block_size,
+		                                   size_t(file.end() - begin));
+		while( end != file.end() && end[-1] != '\n' ) {
+			++end;
+		}
+		if( !sink(begin, end, first) ) {
+			return;
+		}
+		first = false;
+		begin = end;
+	}
+}
+
+struct box_zmin_less {
+	inline bool operator()(const Box& a, const Box& b) const {
+		return a.zmin < b.zmin;
+	}
+};
+
+// A run of boxes sorted by zmin, either held in memory or spilled to a
+//   scratch file and read back a piece at a time
+class SortedRun {
+	FILE*            m_file;
+	std::vector<Box> m_boxes;
+	size_t           m_pos;
+	SortedRun(const SortedRun&);
+	SortedRun& operator=(const SortedRun&);
+public:
+	enum { read_size = 1 << 14 };
+	// Takes over the (sorted) boxes, leaving the vector empty
+	explicit SortedRun(std::vector<Box>& boxes) : m_file(0), m_pos(0) {
+		m_boxes.swap(boxes);
+	}
+	// Writes the (sorted) boxes to a new scratch file in dir
+	SortedRun(const std::vector<Box>& boxes, std::string dir)
+		: m_file(0), m_pos(0) {
+		std::string path = dir + "/santa_run_XXXXXX";
+		std::vector<char> name(path.begin(), path.end());
+		name.push_back('\0');
+		int fd = mkstemp(&name[0]);
+		if( fd < 0 ) {
+			throw std::runtime_error("Failed to create scratch file in " + dir);
+		}
+		// Note: Unlinked straight away so that it is deleted however the
+		//         process exits
+		unlink(&name[0]);
+		m_file = fdopen(fd, "w+b");
+		if( !m_file ) {
+			close(fd);
+			throw std::runtime_error("Failed to open scratch file in " + dir);
+		}
+		if( fwrite(&boxes[0], sizeof(Box), boxes.size(), m_file) != boxes.size()
+		    || fflush(m_file) != 0 ) {
+			fclose(m_file);
+			throw std::runtime_error("Failed to write scratch file in " + dir);
+		}
+		rewind(m_file);
+	}
+	~SortedRun() {
+		if( m_file ) {
+			fclose(m_file);
+		}
+	}
+	// Returns the next box, or 0 at the end of the run
+	// Note: The box remains valid until the next call
+	const Box* next() {
+		if( m_pos == m_boxes.size() ) {
+			if( !m_file ) {
+				return 0;
+			}
+			m_boxes.resize(read_size);
+			size_t nread = fread(&m_boxes[0], sizeof(Box), read_size, m_file);
+			if( ferror(m_file) ) {
+				throw std::runtime_error("Failed to read scratch file");
+			}
+			m_boxes.resize(nread);
+			m_pos = 0;
+			if( nread == 0 ) {
+				return 0;
+			}
+		}
+		return &m_boxes[m_pos++];
+	}
+};
+
+// Parses blocks of solution rows into boxes, counting bounds violations
+//   and ID occurrences on the way, and cuts the boxes into sorted runs
+// Note: Every run but the last is spilled to disk
+class run_builder {
+	dtype              m_sleigh_size;
+	size_t             m_run_size;
+	std::string        m_scratch_dir;
+	std::vector<dtype> m_columns[7];
+	std::vector<Box>   m_boxes;
+	run_builder(const run_builder&);
+	run_builder& operator=(const run_builder&);
+	void spill() {
+		std::sort(m_boxes.begin(), m_boxes.end(), box_zmin_less());
+		runs.push_back(0);
+		runs.back() = new SortedRun(m_boxes, m_scratch_dir);
+		m_boxes.clear();
+	}
+public:
+	size_t                  nrows;
+	validation_counts       bounds;
+	std::vector<dtype>      id_counts;   // No. rows with each problem ID
+	std::vector<dtype>      outlier_ids; // IDs outside the problem
+	std::vector<SortedRun*> runs;
+	run_builder(dtype sleigh_size, size_t nproblem,
+	            size_t run_size, std::string scratch_dir)
+		: m_sleigh_size(sleigh_size),
+		  m_run_size(std::max(run_size, size_t(1))),
+		  m_scratch_dir(scratch_dir),
+		  nrows(0), id_counts(nproblem, 0) {
+		validation_counts zero = {0, 0, 0, 0, 0, 0};
+		bounds = zero;
+	}
+	~run_builder() {
+		for( size_t r=0; r<runs.size(); ++r ) {
+			delete runs[r];
+		}
+	}
+	bool operator()(const char* begin, const char* end, bool first) {
+		csv::CsvChunks chunks(begin, end, first);
+		size_t n = chunks.rows();
+		if( n == 0 ) {
+			return true;
+		}
+		for( int c=0; c<7; ++c ) {
+			m_columns[c].resize(n);
+		}
+		std::vector<dtype>* c = m_columns;
+		solution_row_parser parser = {&c[0][0],
+		                              &c[1][0], &c[2][0], &c[3][0],
+		                              &c[4][0], &c[5][0], &c[6][0]};
+		chunks.for_each_row(n, parser);
+		// Note: Rejected exactly as SantaSolution::load would reject them
+		for( int k=1; k<5; ++k ) {
+			check_range<stype>(&c[k][0], &c[k][0] + n);
+		}
+		bounds_functor     check_bounds(m_sleigh_size);
+		validation_counts_plus plus;
+		for( size_t i=0; i<n; ++i ) {
+			Box box = {c[1][i], c[2][i], c[3][i], c[4][i], c[5][i], c[6][i],
+			           c[0][i], 0};
+			bounds = plus(bounds,
+			              check_bounds(thrust::make_tuple(box.xmin, box.xmax,
+			                                              box.ymin, box.ymax,
+			                                              box.zmin, box.zmax)));
+			// Note: The occurrence counts the earlier rows with the same ID
+			if( box.id >= 0 && size_t(box.id) < id_counts.size() ) {
+				box.occurrence = id_counts[box.id]++;
+			}
+			else {
+				box.occurrence = outlier_ids.size();
+				outlier_ids.push_back(box.id);
+			}
+			m_boxes.push_back(box);
+			if( m_boxes.size() == m_run_size ) {
+				spill();
+			}
+		}
+		nrows += n;
+		return true;
+	}
+	// Sorts the final run, which is kept in memory
+	void finish() {
+		if( m_boxes.empty() && !runs.empty() ) {
+			return;
+		}
+		std::sort(m_boxes.begin(), m_boxes.end(), box_zmin_less());
+		runs.push_back(0);
+		runs.back() = new SortedRun(m_boxes);
+	}
+};
+
+// Maps each box to the position that SantaSolution::load gives it, i.e.,
+//   its place in the file's rows stably sorted by ID
+// Note: IDs outside the problem are errors and assumed to be rare, so
+//         they are ranked in memory.
+class rank_map {
+	std::vector<dtype> m_offsets; // Position of the first row of each ID
+	std::vector<dtype> m_outlier_ranks;
+public:
+	explicit rank_map(run_builder& builder) {
+		const std::vector<dtype>& outliers = builder.outlier_ids;
+		std::vector<std::pair<dtype, dtype> > order(outliers.size());
+		dtype nbelow = 0;
+		for( size_t k=0; k<outliers.size(); ++k ) {
+			order[k] = std::make_pair(outliers[k], dtype(k));
+			nbelow += outliers[k] < 0;
+		}
+		// Note: Ties are broken by file order, as in a stable sort
+		std::sort(order.begin(), order.end());
+		m_offsets.swap(builder.id_counts);
+		dtype position = nbelow;
+		for( size_t id=0; id<m_offsets.size(); ++id ) {
+			dtype count = m_offsets[id];
+			m_offsets[id] = position;
+			position += count;
+		}
+		dtype ninrange = position - nbelow;
+		m_outlier_ranks.resize(order.size());
+		for( size_t k=0; k<order.size(); ++k ) {
+			m_outlier_ranks[order[k].second] = dtype(k) +
+				(dtype(k) < nbelow ? 0 : ninrange);
+		}
+	}
+	inline dtype operator()(const Box& box) const {
+		if( box.id >= 0 && size_t(box.id) < m_offsets.size() ) {
+			return m_offsets[box.id] + box.occurrence;
+		}
+		return m_outlier_ranks[box.occurrence];
+	}
+};
+
+// The boxes whose z-extents are still open at the sweep's current zmin,
+//   binned into a coarse grid of x-y cells that each hold a copy of every
+//   box overlapping them
+class open_boxes {
+	struct Entry {
+		dtype xmin, xmax;
+		dtype ymin, ymax;
+		dtype zmax;
+	};
+	typedef std::pair<dtype, size_t> expiry; // (zmax, no. cells)
+	enum { cells_per_side = 32 };
+	dtype                            m_cell_size;
+	std::vector<std::vector<Entry> > m_cells;
+	std::priority_queue<expiry, std::vector<expiry>,
+	                    std::greater<expiry> > m_expiries;
+	size_t                           m_entries;      // Held, open or not
+	size_t                           m_open_entries;
+	inline int cell(dtype v) const {
+		// Note: Clamped, so boxes outside the sleigh land in edge cells
+		if( v <= 0 ) {
+			return 0;
+		}
+		return std::min(int((v-1) / m_cell_size), int(cells_per_side-1));
+	}
+	// Drops the boxes that end below z
+	void close(dtype z) {
+		while( !m_expiries.empty() && m_expiries.top().first < z ) {
+			m_open_entries -= m_expiries.top().second;
+			m_expiries.pop();
+		}
+		// Note: Closed boxes are mostly dropped lazily as cells are
+		//         visited; this catches those in cells left unvisited
+		if( m_entries > 2*m_open_entries + 4096 ) {
+			for( size_t c=0; c<m_cells.size(); ++c ) {
+				std::vector<Entry>& cell = m_cells[c];
+				for( size_t k=0; k<cell.size(); ) {
+					if( cell[k].zmax < z ) {
+						cell[k] = cell.back();
+						cell.pop_back();
+					}
+					else {
+						++k;
+					}
+				}
+			}
+			m_entries = m_open_entries;
+		}
+	}
+public:
+	explicit open_boxes(dtype sleigh_size)
+		: m_cell_size(std::max(dtype(1), dtype((sleigh_size + cells_per_side-1)
+		                                       / cells_per_side))),
+		  m_cells(cells_per_side*cells_per_side),
+		  m_entries(0), m_open_entries(0) {}
+	// Returns the no. open boxes that collide with box, and then opens it
+	// Note: Boxes must arrive in order of zmin
+	int insert(const Box& box) {
+		close(box.zmin);
+		Entry entry = {box.xmin, box.xmax, box.ymin, box.ymax, box.zmax};
+		int cx0 = cell(box.xmin), cx1 = cell(box.xmax);
+		int cy0 = cell(box.ymin), cy1 = cell(box.ymax);
+		int collisions = 0;
+		for( int cy=cy0; cy<=cy1; ++cy ) {
+			for( int cx=cx0; cx<=cx1; ++cx ) {
+				std::vector<Entry>& cell_entries = m_cells[cy*cells_per_side + cx];
+				for( size_t k=0; k<cell_entries.size(); ) {
+					const Entry& e = cell_entries[k];
+					if( e.zmax < box.zmin ) {
+						cell_entries[k] = cell_entries.back();
+						cell_entries.pop_back();
+						--m_entries;
+						continue;
+					}
+					// Note: Each pair is counted only in the cell holding
+					//         the low corner of their x-y overlap
+					if( !(e.xmax < box.xmin || box.xmax < e.xmin ||
+					      e.ymax < box.ymin || box.ymax < e.ymin) &&
+					    cell(std::max(e.xmin, box.xmin)) == cx &&
+					    cell(std::max(e.ymin, box.ymin)) == cy ) {
+						++collisions;
+					}
+					++k;
+				}
+				cell_entries.push_back(entry);
+			}
+		}
+		size_t ncells = size_t(cx1-cx0+1) * (cy1-cy0+1);
+		m_entries      += ncells;
+		m_open_entries += ncells;
+		m_expiries.push(expiry(box.zmax, ncells));
+		return collisions;
+	}
+};
+
+SantaStreamValidator::SantaStreamValidator(const SantaProblem& problem,
+                                           std::string         scratch_dir,
+                                           size_t              run_size)
+	: m_problem(problem), m_scratch_dir(scratch_dir),
+	  m_run_size(run_size), m_run_count(0) {
+	if( m_scratch_dir.empty() ) {
+		const char* tmpdir = getenv("TMPDIR");
+		m_scratch_dir = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+	}
+}
+
+int SantaStreamValidator::validate(std::string filename,
+                                   int*        _size_difference,
+                                   int*        _boundary_violations,
+                                   int*        _dimension_mismatches,
+                                   int*        _collisions) {
+	PROFILE_SCOPE("SantaStreamValidator::validate");
+	size_t nproblem = m_problem.size();
+	run_builder builder(m_problem.sleigh_size(), nproblem,
+	                    m_run_size, m_scratch_dir);
+	{
+		PROFILE_SCOPE("parse and sort runs");
+		for_each_csv_block(filename, builder);
+		builder.finish();
+	}
+	m_run_count = builder.runs.size();
+	int size_difference = int(builder.nrows) - int(nproblem);
+	validation_counts& b = builder.bounds;
+	int boundary_violations = b.xmin + b.xmax + b.ymin + b.ymax + b.zmin;
+	
+	// Note: Dimensions are read in rank order, which is random access, so
+	//         they are copied to the host once
+	std::vector<dtype> widths(nproblem), heights(nproblem), depths(nproblem);
+	thrust::copy(m_problem.widths_begin(),  m_problem.widths_begin()  + nproblem,
+	             widths.begin());
+	thrust::copy(m_problem.heights_begin(), m_problem.heights_begin() + nproblem,
+	             heights.begin());
+	thrust::copy(m_problem.depths_begin(),  m_problem.depths_begin()  + nproblem,
+	             depths.begin());
+	rank_map rank(builder);
+	size_t nmatched = std::min(builder.nrows, nproblem);
+	
+	int dimension_mismatches = 0;
+	int collisions = 0;
+	{
+		PROFILE_SCOPE("merge and sweep");
+		typedef std::pair<dtype, size_t> head; // (zmin, run)
+		std::priority_queue<head, std::vector<head>,
+		                    std::greater<head> > heads;
+		std::vector<SortedRun*>& runs = builder.runs;
+		std::vector<const Box*> current(runs.size());
+		for( size_t r=0; r<runs.size(); ++r ) {
+			if( (current[r] = runs[r]->next()) ) {
+				heads.push(head(current[r]->zmin, r));
+			}
+		}
+		open_boxes open(m_problem.sleigh_size());
+		dim_mismatch_functor mismatch;
+		while( !heads.empty() ) {
+			size_t r = heads.top().second;
+			heads.pop();
+			const Box& box = *current[r];
+			size_t i = rank(box);
+			if( i < nmatched ) {
+				dimension_mismatches +=
+					mismatch(thrust::make_tuple(box.xmin, box.xmax,
+					                            box.ymin, box.ymax,
+					                            box.zmin, box.zmax),
+					         thrust::make_tuple(widths[i], heights[i],
+					                            depths[i]));
+			}
+			collisions += open.insert(box);
+			if( (current[r] = runs[r]->next()) ) {
+				heads.push(head(current[r]->zmin, r));
+			}
+		}
+	}
+	
+	if( _size_difference ) {
+		*_size_difference = size_difference;
+	}
+	if( _boundary_violations ) {
+		*_boundary_violations = boundary_violations;
+	}
+	if( _dimension_mismatches ) {
+		*_dimension_mismatches = dimension_mismatches;
+	}
+	if( _collisions ) {
+		*_collisions = collisions;
+	}
+	return (size_difference      == 0 &&
+	        boundary_violations  == 0 &&
+	        dimension_mismatches == 0 &&
+	        collisions           == 0);
+}
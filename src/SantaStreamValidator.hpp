@@ -0,0 +1,79 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#pragma once
+
+#include <string>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+
+// Out-of-core validation of solution files too large to be loaded whole.
+// The file is streamed once, checking each present's bounds as it is
+//   parsed, while its boxes are sorted by zmin into runs of at most
+//   run_size presents that are spilled to unlinked scratch files.
+// The runs are then merged into a single z-sweep that keeps resident only
+//   the presents whose z-extents are still open (binned into a coarse x-y
+//   grid), checking each present's dimensions and collisions as it enters.
+// The counts always equal those that SantaSolution::validate would return
+//   for the same file.
+// Note: The problem is held in memory as usual, plus one ID counter per
+//         present for matching presents to problem rows.
+class SantaStreamValidator {
+public:
+	typedef SantaSolution::dtype dtype;
+	typedef SantaSolution::stype stype;
+	enum { default_run_size = 1 << 22 };
+	// A present as spilled to a run, with what is needed to recover its
+	//   place in ID order (see rank)
+	struct Box {
+		dtype xmin, xmax;
+		dtype ymin, ymax;
+		dtype zmin, zmax;
+		dtype id;
+		dtype occurrence;
+	};
+private:
+	const SantaProblem& m_problem;
+	std::string         m_scratch_dir;
+	size_t              m_run_size;
+	size_t              m_run_count;
+	SantaStreamValidator(const SantaStreamValidator&);
+	SantaStreamValidator& operator=(const SantaStreamValidator&);
+public:
+	// Scratch files go in scratch_dir, or $TMPDIR (or /tmp) if empty
+	SantaStreamValidator(const SantaProblem& problem,
+	                     std::string         scratch_dir="",
+	                     size_t              run_size=default_run_size);
+	// Validates a solution csv file (optionally gzip/zstd-compressed)
+	//   without loading it
+	// Returns the same value and counts as SantaSolution::validate with
+	//   quick=false
+	int validate(std::string filename,
+	             int*        size_difference=0,
+	             int*        boundary_violations=0,
+	             int*        dimension_mismatches=0,
+	             int*        collisions=0);
+	// Returns the no. sorted runs used by the last validate
+	inline size_t run_count() const;
+};
+size_t SantaStreamValidator::run_count() const { return m_run_count; }
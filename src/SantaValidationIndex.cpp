@@ -0,0 +1,352 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#include <SantaValidationIndex.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <thrust/copy.h>
+
+typedef SantaValidationIndex::dtype dtype;
+
+using std::min;
+using std::max;
+
+// Presents spanning more cells than this are kept out of the grid
+static const size_t max_cells_per_present = 64;
+
+// Note: Rounds towards -inf so that out-of-bounds coords bin correctly
+inline dtype floor_div(dtype a, dtype b) {
+	return (a >= 0) ? a / b : -((-a + b-1) / b);
+}
+
+inline void sort3(dtype& a, dtype& b, dtype& c) {
+	if( a > b ) std::swap(a, b);
+	if( b > c ) std::swap(b, c);
+	if( a > b ) std::swap(a, b);
+}
+
+SantaValidationIndex::SantaValidationIndex(const SantaProblem&  problem,
+                                           const SantaSolution& solution)
+	: m_sleigh_size(problem.sleigh_size()),
+	  m_boundary_violations(0),
+	  m_dimension_mismatches(0),
+	  m_collisions(0) {
+	size_t n = solution.size();
+	m_size_difference = int(n) - int(problem.size());
+	// Copy the extrema and dimensions to the host
+	hvector* xy_columns[4] = {&m_xminima, &m_xmaxima,
+	                          &m_yminima, &m_ymaxima};
+	SantaSolution::const_siter xy_sources[4] = {solution.xminima_begin(),
+	                                            solution.xmaxima_begin(),
+	                                            solution.yminima_begin(),
+	                                            solution.ymaxima_begin()};
+	for( int c=0; c<4; ++c ) {
+		xy_columns[c]->resize(n);
+		thrust::copy(xy_sources[c], xy_sources[c] + n,
+		             xy_columns[c]->begin());
+	}
+	m_zminima.resize(n);
+	m_zmaxima.resize(n);
+	thrust::copy(solution.zminima_begin(), solution.zminima_begin() + n,
+	             m_zminima.begin());
+	thrust::copy(solution.zmaxima_begin(), solution.zmaxima_begin() + n,
+	             m_zmaxima.begin());
+	size_t np = problem.size();
+	m_widths.resize(np);
+	m_heights.resize(np);
+	m_depths.resize(np);
+	thrust::copy(problem.widths_begin(),  problem.widths_begin()  + np,
+	             m_widths.begin());
+	thrust::copy(problem.heights_begin(), problem.heights_begin() + np,
+	             m_heights.begin());
+	thrust::copy(problem.depths_begin(),  problem.depths_begin()  + np,
+	             m_depths.begin());
+
+	// Cells are sized to the mean present extent along each axis so that
+	//   each present overlaps only a handful of cells
+	double sums[3] = {0, 0, 0};
+	for( size_t i=0; i<n; ++i ) {
+		sums[0] += m_xmaxima[i] - m_xminima[i] + 1;
+		sums[1] += m_ymaxima[i] - m_yminima[i] + 1;
+		sums[2] += m_zmaxima[i] - m_zminima[i] + 1;
+	}
+	for( int d=0; d<3; ++d ) {
+		m_cell_size[d] = max(dtype(1), dtype(n ? sums[d] / n : 1));
+	}
+	m_nbuckets = 1;
+	while( m_nbuckets < 2*n ) {
+		m_nbuckets *= 2;
+	}
+	m_buckets.resize(m_nbuckets);
+	m_touched.resize(n, 0);
+
+	for( size_t i=0; i<n; ++i ) {
+		insert(i);
+		m_boundary_violations  += boundary_violations(i);
+		m_dimension_mismatches += dimension_mismatch(i);
+	}
+	// Note: The initial count comes from the solution's own (much faster)
+	//         sweep; the grid is only searched around updated presents
+	m_collisions = solution.count_collisions();
+}
+
+size_t SantaValidationIndex::bucket(dtype cx, dtype cy, dtype cz) const {
+	uint64_t h = (uint64_t)(uint32_t)cx * 0x9E3779B97F4A7C15ull;
+	h ^= (uint64_t)(uint32_t)cy * 0xC2B2AE3D27D4EB4Full;
+	h ^= (uint64_t)(uint32_t)cz * 0x165667B19E3779F9ull;
+	h ^= h >> 29;
+	return h & (m_nbuckets-1);
+}
+
+bool SantaValidationIndex::is_large(dtype id) const {
+	size_t nx = floor_div(m_xmaxima[id], m_cell_size[0])
+		- floor_div(m_xminima[id], m_cell_size[0]) + 1;
+	size_t ny = floor_div(m_ymaxima[id], m_cell_size[1])
+		- floor_div(m_yminima[id], m_cell_size[1]) + 1;
+	size_t nz = floor_div(m_zmaxima[id], m_cell_size[2])
+		- floor_div(m_zminima[id], m_cell_size[2]) + 1;
+	return nx > max_cells_per_present ||
+	       ny > max_cells_per_present ||
+	       nz > max_cells_per_present ||
+	       nx*ny*nz > max_cells_per_present;
+}
+
+bool SantaValidationIndex::collide(dtype a, dtype b) const {
+	// Note: extrema define *closed* intervals
+	return !(m_xmaxima[a] < m_xminima[b] || m_xmaxima[b] < m_xminima[a] ||
+	         m_ymaxima[a] < m_yminima[b] || m_ymaxima[b] < m_yminima[a] ||
+	         m_zmaxima[a] < m_zminima[b] || m_zmaxima[b] < m_zminima[a]);
+}
+
+int SantaValidationIndex::boundary_violations(dtype id) const {
+	// Note: No upper bound on z
+	return (m_xminima[id] <= 0) + (m_xmaxima[id] > m_sleigh_size) +
+	       (m_yminima[id] <= 0) + (m_ymaxima[id] > m_sleigh_size) +
+	       (m_zminima[id] <= 0);
+}
+
+int SantaValidationIndex::dimension_mismatch(dtype id) const {
+	if( size_t(id) >= m_widths.size() ) {
+		return 0;
+	}
+	dtype s1 = m_xmaxima[id] - (m_xminima[id]-1);
+	dtype s2 = m_ymaxima[id] - (m_yminima[id]-1);
+	dtype s3 = m_zmaxima[id] - (m_zminima[id]-1);
+	dtype p1 = m_widths[id];
+	dtype p2 = m_heights[id];
+	dtype p3 = m_depths[id];
+	// Compare after ignoring relative order (to allow arb. permutations)
+	sort3(s1, s2, s3);
+	sort3(p1, p2, p3);
+	return s1 != p1 || s2 != p2 || s3 != p3;
+}
+
+void SantaValidationIndex::insert(dtype id) {
+	if( is_large(id) ) {
+		m_large.push_back(id);
+		return;
+	}
+	dtype cx0 = floor_div(m_xminima[id], m_cell_size[0]);
+	dtype cx1 = floor_div(m_xmaxima[id], m_cell_size[0]);
+	dtype cy0 = floor_div(m_yminima[id], m_cell_size[1]);
+	dtype cy1 = floor_div(m_ymaxima[id], m_cell_size[1]);
+	dtype cz0 = floor_div(m_zminima[id], m_cell_size[2]);
+	dtype cz1 = floor_div(m_zmaxima[id], m_cell_size[2]);
+	for( dtype cz=cz0; cz<=cz1; ++cz ) {
+		for( dtype cy=cy0; cy<=cy1; ++cy ) {
+			for( dtype cx=cx0; cx<=cx1; ++cx ) {
+				hvector& cell = m_buckets[bucket(cx, cy, cz)];
+				// Note: Cells that clash in the hash share a bucket, and
+				//         each present is only listed once per bucket. The
+				//         present is in no bucket before this call, so an
+				//         earlier listing here can only be the last one.
+				if( cell.empty() || cell.back() != id ) {
+					cell.push_back(id);
+				}
+			}
+		}
+	}
+}
+
+void SantaValidationIndex::erase(dtype id) {
+	if( is_large(id) ) {
+		m_large.erase(std::find(m_large.begin(), m_large.end(), id));
+		return;
+	}
+	dtype cx0 = floor_div(m_xminima[id], m_cell_size[0]);
+	dtype cx1 = floor_div(m_xmaxima[id], m_cell_size[0]);
+	dtype cy0 = floor_div(m_yminima[id], m_cell_size[1]);
+	dtype cy1 = floor_div(m_ymaxima[id], m_cell_size[1]);
+	dtype cz0 = floor_div(m_zminima[id], m_cell_size[2]);
+	dtype cz1 = floor_div(m_zmaxima[id], m_cell_size[2]);
+	for( dtype cz=cz0; cz<=cz1; ++cz ) {
+		for( dtype cy=cy0; cy<=cy1; ++cy ) {
+			for( dtype cx=cx0; cx<=cx1; ++cx ) {
+				hvector& cell = m_buckets[bucket(cx, cy, cz)];
+				hvector::iterator it = std::find(cell.begin(), cell.end(), id);
+				// Note: Order within a bucket doesn't matter
+				if( it != cell.end() ) {
+					*it = cell.back();
+					cell.pop_back();
+				}
+			}
+		}
+	}
+}
+
+void SantaValidationIndex::find_collisions(dtype id, hvector& result) const {
+	if( is_large(id) ) {
+		for( dtype other=0; other<dtype(size()); ++other ) {
+			if( other != id && collide(id, other) ) {
+				result.push_back(other);
+			}
+		}
+		return;
+	}
+	dtype cx0 = floor_div(m_xminima[id], m_cell_size[0]);
+	dtype cx1 = floor_div(m_xmaxima[id], m_cell_size[0]);
+	dtype cy0 = floor_div(m_yminima[id], m_cell_size[1]);
+	dtype cy1 = floor_div(m_ymaxima[id], m_cell_size[1]);
+	dtype cz0 = floor_div(m_zminima[id], m_cell_size[2]);
+	dtype cz1 = floor_div(m_zmaxima[id], m_cell_size[2]);
+	for( dtype cz=cz0; cz<=cz1; ++cz ) {
+		for( dtype cy=cy0; cy<=cy1; ++cy ) {
+			for( dtype cx=cx0; cx<=cx1; ++cx ) {
+				const hvector& cell = m_buckets[bucket(cx, cy, cz)];
+				for( size_t k=0; k<cell.size(); ++k ) {
+					dtype other = cell[k];
+					if( other == id || !collide(id, other) ) {
+						continue;
+					}
+					// Note: A colliding pair is only reported from the cell
+					//         containing the min corner of its intersection,
+					//         which de-duplicates pairs sharing several cells
+					//         (and pairs sharing a bucket via hash clashes).
+					dtype x = max(m_xminima[id], m_xminima[other]);
+					dtype y = max(m_yminima[id], m_yminima[other]);
+					dtype z = max(m_zminima[id], m_zminima[other]);
+					if( floor_div(x, m_cell_size[0]) == cx &&
+					    floor_div(y, m_cell_size[1]) == cy &&
+					    floor_div(z, m_cell_size[2]) == cz ) {
+						result.push_back(other);
+					}
+				}
+			}
+		}
+	}
+	for( size_t k=0; k<m_large.size(); ++k ) {
+		if( collide(id, m_large[k]) ) {
+			result.push_back(m_large[k]);
+		}
+	}
+}
+
+int SantaValidationIndex::update(size_t       count,
+                                 const dtype* ids,
+                                 const dtype* xminima, const dtype* xmaxima,
+                                 const dtype* yminima, const dtype* ymaxima,
+                                 const dtype* zminima, const dtype* zmaxima,
+                                 int* size_difference,
+                                 int* boundary_violations,
+                                 int* dimension_mismatches,
+                                 int* collisions) {
+	std::vector<dtype> unique_ids;
+	unique_ids.reserve(count);
+	// Note: All IDs are checked before any are flagged as touched
+	for( size_t k=0; k<count; ++k ) {
+		if( ids[k] < 0 || size_t(ids[k]) >= size() ) {
+			throw std::out_of_range("Present ID out of range");
+		}
+	}
+	for( size_t k=0; k<count; ++k ) {
+		if( !m_touched[ids[k]] ) {
+			m_touched[ids[k]] = 1;
+			unique_ids.push_back(ids[k]);
+		}
+	}
+	// Remove the contributions of the touched presents' old extrema
+	// Note: Pairs of touched presents are counted once, by their lower ID
+	for( size_t k=0; k<unique_ids.size(); ++k ) {
+		dtype id = unique_ids[k];
+		m_boundary_violations  -= this->boundary_violations(id);
+		m_dimension_mismatches -= this->dimension_mismatch(id);
+		m_neighbours.clear();
+		find_collisions(id, m_neighbours);
+		for( size_t j=0; j<m_neighbours.size(); ++j ) {
+			dtype other = m_neighbours[j];
+			m_collisions -= (!m_touched[other] || other > id);
+		}
+	}
+	for( size_t k=0; k<unique_ids.size(); ++k ) {
+		erase(unique_ids[k]);
+	}
+	// Note: If an ID appears more than once, its last extrema win
+	for( size_t k=0; k<count; ++k ) {
+		dtype id = ids[k];
+		m_xminima[id] = xminima[k]; m_xmaxima[id] = xmaxima[k];
+		m_yminima[id] = yminima[k]; m_ymaxima[id] = ymaxima[k];
+		m_zminima[id] = zminima[k]; m_zmaxima[id] = zmaxima[k];
+	}
+	for( size_t k=0; k<unique_ids.size(); ++k ) {
+		insert(unique_ids[k]);
+	}
+	// Add the contributions of the new extrema
+	for( size_t k=0; k<unique_ids.size(); ++k ) {
+		dtype id = unique_ids[k];
+		m_boundary_violations  += this->boundary_violations(id);
+		m_dimension_mismatches += this->dimension_mismatch(id);
+		m_neighbours.clear();
+		find_collisions(id, m_neighbours);
+		for( size_t j=0; j<m_neighbours.size(); ++j ) {
+			dtype other = m_neighbours[j];
+			m_collisions += (!m_touched[other] || other > id);
+		}
+	}
+	for( size_t k=0; k<unique_ids.size(); ++k ) {
+		m_touched[unique_ids[k]] = 0;
+	}
+	return validate(size_difference, boundary_violations,
+	                dimension_mismatches, collisions);
+}
+
+int SantaValidationIndex::validate(int* size_difference,
+                                   int* boundary_violations,
+                                   int* dimension_mismatches,
+                                   int* collisions) const {
+	if( size_difference ) {
+		*size_difference = m_size_difference;
+	}
+	if( boundary_violations ) {
+		*boundary_violations = m_boundary_violations;
+	}
+	if( dimension_mismatches ) {
+		*dimension_mismatches = m_dimension_mismatches;
+	}
+	if( collisions ) {
+		*collisions = m_collisions;
+	}
+	return (m_size_difference      == 0 &&
+	        m_boundary_violations  == 0 &&
+	        m_dimension_mismatches == 0 &&
+	        m_collisions           == 0);
+}
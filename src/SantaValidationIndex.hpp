@@ -0,0 +1,93 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+
+// Stateful, host-side validation of a solution that is modified a few
+//   presents at a time (e.g., by a local-search optimiser).
+// The presents are binned into a hashed uniform 3D grid so that an update
+//   only re-checks the moved presents against their spatial neighbours.
+// The counts always equal those that SantaSolution::validate would return
+//   for the current extrema.
+class SantaValidationIndex {
+public:
+	typedef SantaSolution::dtype dtype;
+private:
+	typedef std::vector<dtype> hvector;
+	// Note: These are always to be kept in ID order
+	hvector m_xminima, m_xmaxima;
+	hvector m_yminima, m_ymaxima;
+	hvector m_zminima, m_zmaxima;
+	hvector m_widths, m_heights, m_depths;
+	dtype   m_sleigh_size;
+	int     m_size_difference;
+	int     m_boundary_violations;
+	int     m_dimension_mismatches;
+	int     m_collisions;
+	// Grid of present IDs, hashed by cell coords
+	dtype   m_cell_size[3];
+	size_t  m_nbuckets;
+	std::vector<hvector> m_buckets;
+	// Presents spanning too many cells to be binned; checked against all
+	hvector m_large;
+	// Scratch space for updates
+	std::vector<unsigned char> m_touched;
+	hvector m_neighbours;
+
+	inline size_t bucket(dtype cx, dtype cy, dtype cz) const;
+	inline bool   is_large(dtype id) const;
+	inline bool   collide(dtype a, dtype b) const;
+	inline int    boundary_violations(dtype id) const;
+	inline int    dimension_mismatch(dtype id) const;
+	void          insert(dtype id);
+	void          erase(dtype id);
+	// Appends the IDs of all presents that collide with present id
+	void          find_collisions(dtype id, hvector& result) const;
+public:
+	SantaValidationIndex(const SantaProblem&  problem,
+	                     const SantaSolution& solution);
+	inline size_t size() const;
+	// Sets new extrema for the presents with the given (0-based) IDs and
+	//   re-checks just those presents.
+	// Returns the same value and counts that validate would return
+	int update(size_t       count,
+	           const dtype* ids,
+	           const dtype* xminima, const dtype* xmaxima,
+	           const dtype* yminima, const dtype* ymaxima,
+	           const dtype* zminima, const dtype* zmaxima,
+	           int*         size_difference=0,
+	           int*         boundary_violations=0,
+	           int*         dimension_mismatches=0,
+	           int*         collisions=0);
+	// Returns the counts for the current extrema without modifying them
+	int validate(int* size_difference=0,
+	             int* boundary_violations=0,
+	             int* dimension_mismatches=0,
+	             int* collisions=0) const;
+};
+size_t SantaValidationIndex::size() const { return m_xminima.size(); }
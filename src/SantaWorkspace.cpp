@@ -0,0 +1,99 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#include <SantaWorkspace.hpp>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#else
+#include <mutex>
+#endif
+
+void SantaWorkspace::clear() {
+	// Note: Swapping with empty vectors actually releases their storage
+	dvector().swap(m_ids);
+	dvector().swap(m_sorted);
+	dvector().swap(m_indices);
+	thrust::device_vector<uint64_t>().swap(m_keys);
+	svector().swap(m_boxes);
+	m_allocator.release();
+}
+
+// Note: Uses the same threading layer as parallel_for.hpp
+#if defined(_OPENMP)
+struct SantaWorkspacePool::Lock {
+	omp_lock_t lock;
+	Lock()  { omp_init_lock(&lock); }
+	~Lock() { omp_destroy_lock(&lock); }
+	void acquire() { omp_set_lock(&lock); }
+	void release() { omp_unset_lock(&lock); }
+};
+#else
+struct SantaWorkspacePool::Lock {
+	std::mutex mutex;
+	void acquire() { mutex.lock(); }
+	void release() { mutex.unlock(); }
+};
+#endif
+
+SantaWorkspacePool::SantaWorkspacePool() : m_lock(new Lock) {}
+SantaWorkspacePool::~SantaWorkspacePool() {
+	clear();
+	delete m_lock;
+}
+SantaWorkspacePool& SantaWorkspacePool::global() {
+	// Note: Never destroyed, because a static destructor could free device
+	//         memory after the CUDA runtime has been torn down
+	static SantaWorkspacePool* pool = new SantaWorkspacePool;
+	return *pool;
+}
+SantaWorkspace* SantaWorkspacePool::acquire() {
+	SantaWorkspace* workspace = 0;
+	m_lock->acquire();
+	if( !m_idle.empty() ) {
+		workspace = m_idle.back();
+		m_idle.pop_back();
+	}
+	m_lock->release();
+	// Note: New workspaces are created outside the lock
+	return workspace ? workspace : new SantaWorkspace;
+}
+void SantaWorkspacePool::release(SantaWorkspace* workspace) {
+	m_lock->acquire();
+	m_idle.push_back(workspace);
+	m_lock->release();
+}
+size_t SantaWorkspacePool::idle() const {
+	m_lock->acquire();
+	size_t n = m_idle.size();
+	m_lock->release();
+	return n;
+}
+void SantaWorkspacePool::clear() {
+	std::vector<SantaWorkspace*> idle;
+	m_lock->acquire();
+	idle.swap(m_idle);
+	m_lock->release();
+	for( size_t i=0; i<idle.size(); ++i ) {
+		delete idle[i];
+	}
+}
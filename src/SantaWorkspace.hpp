@@ -0,0 +1,110 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <thrust/device_vector.h>
+
+#include <SantaProblem.hpp>
+#include "caching_allocator.hpp"
+
+// Temporary storage for the queries of SantaSolution (validate, score etc.)
+//   and SantaBatch
+// Note: A workspace may only be used by one thread at a time, but any
+//         number of threads may query the same (unmodified) solution at
+//         once, each with its own workspace.
+class SantaWorkspace {
+	friend class SantaSolution;
+	friend class SantaBatch;
+	typedef int                              dtype;
+	typedef SantaProblem::stype              stype;
+	typedef column_vector<dtype>::type       dvector;
+	typedef column_vector<stype>::type       svector;
+	dvector m_ids;
+	dvector m_sorted;
+	dvector m_indices;
+	thrust::device_vector<uint64_t> m_keys;
+	svector m_boxes;
+	// Note: The vectors above are sized on first use, and the allocator
+	//         caches the storage that algorithms use internally
+	CachingAllocator m_allocator;
+	SantaWorkspace(const SantaWorkspace& );
+	SantaWorkspace& operator=(const SantaWorkspace& );
+public:
+	SantaWorkspace() {}
+	inline const CachingAllocator& allocator() const;
+	// Frees all storage held by the workspace
+	void clear();
+};
+const CachingAllocator& SantaWorkspace::allocator() const { return m_allocator; }
+
+// Thread-safe pool of workspaces, from which queries that are not given a
+//   workspace borrow one
+// Note: Workspaces are reused most-recently-released first, so a thread
+//         making repeated queries tends to get back warm storage.
+class SantaWorkspacePool {
+	struct Lock;
+	std::vector<SantaWorkspace*> m_idle;
+	Lock*                        m_lock;
+	SantaWorkspacePool(const SantaWorkspacePool& );
+	SantaWorkspacePool& operator=(const SantaWorkspacePool& );
+public:
+	// Borrows a workspace for the lifetime of the lease, unless one is given
+	class Lease {
+		SantaWorkspacePool* m_pool;
+		SantaWorkspace*     m_workspace;
+		Lease(const Lease& );
+		Lease& operator=(const Lease& );
+	public:
+		inline explicit Lease(SantaWorkspace*     workspace,
+		                      SantaWorkspacePool& pool=global());
+		inline ~Lease();
+		inline SantaWorkspace& operator*()  const { return *m_workspace; }
+		inline SantaWorkspace* operator->() const { return  m_workspace; }
+	};
+	SantaWorkspacePool();
+	~SantaWorkspacePool();
+	// The process-wide pool
+	// Note: Its workspaces are never freed unless clear() is called
+	static SantaWorkspacePool& global();
+	// Returns an idle workspace, creating one if there are none
+	SantaWorkspace* acquire();
+	// Returns a workspace obtained from acquire to the pool
+	void            release(SantaWorkspace* workspace);
+	// Returns the no. idle workspaces
+	size_t          idle() const;
+	// Destroys all idle workspaces
+	void            clear();
+};
+SantaWorkspacePool::Lease::Lease(SantaWorkspace*     workspace,
+                                 SantaWorkspacePool& pool)
+	: m_pool(workspace ? 0 : &pool),
+	  m_workspace(workspace ? workspace : pool.acquire()) {}
+SantaWorkspacePool::Lease::~Lease() {
+	if( m_pool ) {
+		m_pool->release(m_workspace);
+	}
+}
@@ -0,0 +1,234 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#pragma once
+
+/*
+  Box-overlap counting for the z-sweep over a packed, z-sorted buffer of
+    x/y extents:
+    count_overlaps(boxes, i, begin, end) - no. boxes in [begin,end) whose
+                                           x/y extents overlap box i's
+    simd_level()                         - the instruction set in use
+  On x86 host builds the loop is vectorised with AVX-512 or AVX2 (16 or 8
+    32-bit boxes, or 32 or 16 16-bit boxes, per instruction), chosen once
+    at run time from the CPU's features; otherwise it is scalar.
+*/
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <stdint.h>
+
+#include <thrust/functional.h>
+
+#if !defined(__CUDACC__) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BOX_SWEEP_X86
+#include <immintrin.h>
+#endif
+
+// Column pointers into a buffer of boxes stored in sweep (zmin) order
+template<typename T>
+struct packed_boxes {
+	const T* xminima;
+	const T* xmaxima;
+	const T* yminima;
+	const T* ymaxima;
+};
+
+namespace box_sweep {
+
+enum SimdLevel {
+	SIMD_SCALAR,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+template<typename T>
+inline __host__ __device__
+int count_overlaps_scalar(const packed_boxes<T>& b,
+                          size_t i, size_t begin, size_t end) {
+	T ixb = b.xminima[i], ixe = b.xmaxima[i];
+	T iyb = b.yminima[i], iye = b.ymaxima[i];
+	int count = 0;
+	for( size_t j=begin; j<end; ++j ) {
+		// Note: extrema define *closed* intervals
+		count += !(ixe < b.xminima[j] || b.xmaxima[j] < ixb ||
+		           iye < b.yminima[j] || b.ymaxima[j] < iyb);
+	}
+	return count;
+}
+
+#ifdef BOX_SWEEP_X86
+
+__attribute__((target("avx2")))
+inline int count_overlaps_avx2(const packed_boxes<int>& b,
+                               size_t i, size_t begin, size_t end) {
+	__m256i ixb = _mm256_set1_epi32(b.xminima[i]);
+	__m256i ixe = _mm256_set1_epi32(b.xmaxima[i]);
+	__m256i iyb = _mm256_set1_epi32(b.yminima[i]);
+	__m256i iye = _mm256_set1_epi32(b.ymaxima[i]);
+	int count = 0;
+	size_t j = begin;
+	for( ; j+8<=end; j+=8 ) {
+		__m256i jxb = _mm256_loadu_si256((const __m256i*)(b.xminima + j));
+		__m256i jxe = _mm256_loadu_si256((const __m256i*)(b.xmaxima + j));
+		__m256i jyb = _mm256_loadu_si256((const __m256i*)(b.yminima + j));
+		__m256i jye = _mm256_loadu_si256((const __m256i*)(b.ymaxima + j));
+		__m256i apart = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpgt_epi32(jxb, ixe),
+			                _mm256_cmpgt_epi32(ixb, jxe)),
+			_mm256_or_si256(_mm256_cmpgt_epi32(jyb, iye),
+			                _mm256_cmpgt_epi32(iyb, jye)));
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(apart));
+		count += 8 - __builtin_popcount(mask);
+	}
+	return count + count_overlaps_scalar(b, i, j, end);
+}
+
+__attribute__((target("avx2")))
+inline int count_overlaps_avx2(const packed_boxes<int16_t>& b,
+                               size_t i, size_t begin, size_t end) {
+	__m256i ixb = _mm256_set1_epi16(b.xminima[i]);
+	__m256i ixe = _mm256_set1_epi16(b.xmaxima[i]);
+	__m256i iyb = _mm256_set1_epi16(b.yminima[i]);
+	__m256i iye = _mm256_set1_epi16(b.ymaxima[i]);
+	int count = 0;
+	size_t j = begin;
+	for( ; j+16<=end; j+=16 ) {
+		__m256i jxb = _mm256_loadu_si256((const __m256i*)(b.xminima + j));
+		__m256i jxe = _mm256_loadu_si256((const __m256i*)(b.xmaxima + j));
+		__m256i jyb = _mm256_loadu_si256((const __m256i*)(b.yminima + j));
+		__m256i jye = _mm256_loadu_si256((const __m256i*)(b.ymaxima + j));
+		__m256i apart = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpgt_epi16(jxb, ixe),
+			                _mm256_cmpgt_epi16(ixb, jxe)),
+			_mm256_or_si256(_mm256_cmpgt_epi16(jyb, iye),
+			                _mm256_cmpgt_epi16(iyb, jye)));
+		// Note: Each 16-bit lane sets two mask bits
+		unsigned mask = _mm256_movemask_epi8(apart);
+		count += 16 - __builtin_popcount(mask) / 2;
+	}
+	return count + count_overlaps_scalar(b, i, j, end);
+}
+
+__attribute__((target("avx512f")))
+inline int count_overlaps_avx512(const packed_boxes<int>& b,
+                                 size_t i, size_t begin, size_t end) {
+	__m512i ixb = _mm512_set1_epi32(b.xminima[i]);
+	__m512i ixe = _mm512_set1_epi32(b.xmaxima[i]);
+	__m512i iyb = _mm512_set1_epi32(b.yminima[i]);
+	__m512i iye = _mm512_set1_epi32(b.ymaxima[i]);
+	int count = 0;
+	size_t j = begin;
+	for( ; j+16<=end; j+=16 ) {
+		__m512i jxb = _mm512_loadu_si512(b.xminima + j);
+		__m512i jxe = _mm512_loadu_si512(b.xmaxima + j);
+		__m512i jyb = _mm512_loadu_si512(b.yminima + j);
+		__m512i jye = _mm512_loadu_si512(b.ymaxima + j);
+		__mmask16 apart = _mm512_cmpgt_epi32_mask(jxb, ixe) |
+		                  _mm512_cmpgt_epi32_mask(ixb, jxe) |
+		                  _mm512_cmpgt_epi32_mask(jyb, iye) |
+		                  _mm512_cmpgt_epi32_mask(iyb, jye);
+		count += 16 - __builtin_popcount(apart);
+	}
+	return count + count_overlaps_scalar(b, i, j, end);
+}
+
+__attribute__((target("avx512bw")))
+inline int count_overlaps_avx512(const packed_boxes<int16_t>& b,
+                                 size_t i, size_t begin, size_t end) {
+	__m512i ixb = _mm512_set1_epi16(b.xminima[i]);
+	__m512i ixe = _mm512_set1_epi16(b.xmaxima[i]);
+	__m512i iyb = _mm512_set1_epi16(b.yminima[i]);
+	__m512i iye = _mm512_set1_epi16(b.ymaxima[i]);
+	int count = 0;
+	size_t j = begin;
+	for( ; j+32<=end; j+=32 ) {
+		__m512i jxb = _mm512_loadu_si512(b.xminima + j);
+		__m512i jxe = _mm512_loadu_si512(b.xmaxima + j);
+		__m512i jyb = _mm512_loadu_si512(b.yminima + j);
+		__m512i jye = _mm512_loadu_si512(b.ymaxima + j);
+		__mmask32 apart = _mm512_cmpgt_epi16_mask(jxb, ixe) |
+		                  _mm512_cmpgt_epi16_mask(ixb, jxe) |
+		                  _mm512_cmpgt_epi16_mask(jyb, iye) |
+		                  _mm512_cmpgt_epi16_mask(iyb, jye);
+		count += 32 - __builtin_popcount(apart);
+	}
+	return count + count_overlaps_scalar(b, i, j, end);
+}
+
+// Returns the best level that the CPU supports for boxes of type T
+// Note: SANTA_SIMD=(scalar|avx2|avx512) lowers the level (e.g., to
+//         compare them)
+template<typename T>
+inline SimdLevel detect_simd_level() {
+	bool avx512 = (sizeof(T) == 2) ? __builtin_cpu_supports("avx512bw")
+	                               : __builtin_cpu_supports("avx512f");
+	SimdLevel level = avx512                          ? SIMD_AVX512 :
+	                  __builtin_cpu_supports("avx2") ? SIMD_AVX2   :
+	                                                   SIMD_SCALAR;
+	const char* env = getenv("SANTA_SIMD");
+	if( env ) {
+		SimdLevel requested = strcmp(env, "scalar") == 0 ? SIMD_SCALAR :
+		                      strcmp(env, "avx2")   == 0 ? SIMD_AVX2   :
+		                                                   SIMD_AVX512;
+		level = requested < level ? requested : level;
+	}
+	return level;
+}
+
+#endif // BOX_SWEEP_X86
+
+// Returns the instruction set that count_overlaps uses for boxes of type T
+template<typename T>
+inline SimdLevel simd_level() {
+#ifdef BOX_SWEEP_X86
+	static const SimdLevel level = detect_simd_level<T>();
+	return level;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+template<typename T>
+inline int count_overlaps(const packed_boxes<T>& b,
+                          size_t i, size_t begin, size_t end,
+                          SimdLevel level) {
+#ifdef BOX_SWEEP_X86
+	switch( level ) {
+	case SIMD_AVX512: return count_overlaps_avx512(b, i, begin, end);
+	case SIMD_AVX2:   return count_overlaps_avx2(b, i, begin, end);
+	default: break;
+	}
+#endif
+	return count_overlaps_scalar(b, i, begin, end);
+}
+
+template<typename T>
+inline int count_overlaps(const packed_boxes<T>& b,
+                          size_t i, size_t begin, size_t end) {
+	return count_overlaps(b, i, begin, end, simd_level<T>());
+}
+
+} // namespace box_sweep
@@ -0,0 +1,236 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+/*
+  Pooled temporary storage for Thrust algorithms:
+    CachingAllocator - keeps freed blocks for reuse by later requests
+    TempBuffer       - scoped typed array taken from a CachingAllocator
+    THRUST_PAR(a)    - the device system's execution policy using allocator a
+*/
+
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+
+#include <thrust/device_ptr.h>
+#include <thrust/device_malloc.h>
+#include <thrust/device_free.h>
+
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+#include <thrust/system/cuda/execution_policy.h>
+#define THRUST_PAR(allocator) thrust::cuda::par(allocator)
+#elif THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_TBB
+#include <thrust/system/tbb/execution_policy.h>
+#define THRUST_PAR(allocator) thrust::tbb::par(allocator)
+#elif THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CPP
+#include <thrust/system/cpp/execution_policy.h>
+#define THRUST_PAR(allocator) thrust::cpp::par(allocator)
+#else
+#include <thrust/system/omp/execution_policy.h>
+#define THRUST_PAR(allocator) thrust::omp::par(allocator)
+#endif
+
+// Allocator that Thrust uses for the temporary storage of algorithms
+//   launched with THRUST_PAR(allocator).
+// Freed blocks are cached (not returned to the system) and reused by any
+//   later request that fits, so a repeated sequence of algorithms on data of
+//   the same size only allocates memory the first time.
+// Blocks are recorded in a table that only grows when a block is taken from
+//   the system, and are linked into per-size-class free lists and an in-use
+//   list through their records, so cached requests make no heap allocations.
+// Note: Not thread-safe; each thread should use its own allocator
+class CachingAllocator {
+public:
+	typedef char value_type;
+	struct Stats {
+		size_t allocations;       // Requests passed on to the system
+		size_t reuses;            // Requests served from the cache
+		size_t bytes_reserved;    // Bytes held, whether cached or in use
+		size_t bytes_in_use;
+		size_t peak_bytes_in_use;
+	};
+private:
+	struct Block {
+		char*  ptr;
+		size_t size;
+		int    next; // Next record in the same list, or -1
+	};
+	// Note: Class c holds the free blocks of [2^c, 2^(c+1)) bytes (and
+	//         class 0 also those of 0 bytes)
+	enum { NUM_SIZE_CLASSES = 8*sizeof(size_t) };
+	std::vector<Block> m_blocks;
+	int                m_free_blocks[NUM_SIZE_CLASSES];
+	int                m_allocated_blocks; // Most recently allocated first
+	int                m_spare_records;    // Of blocks returned to the system
+	Stats              m_stats;
+	inline void         init();
+	static inline int   size_class(size_t size);
+	// Unlinks and returns the record after prev (or the head) of a list
+	inline int          unlink(int* head, int prev);
+public:
+	inline CachingAllocator();
+	// Note: Copies start with an empty cache, and assignment keeps the
+	//         existing one, so that the owners of blocks never change
+	inline CachingAllocator(const CachingAllocator& );
+	CachingAllocator& operator=(const CachingAllocator& ) { return *this; }
+	inline ~CachingAllocator();
+	inline char*        allocate(std::ptrdiff_t num_bytes);
+	inline void         deallocate(char* ptr, size_t );
+	// Returns all cached (but not in-use) blocks to the system
+	inline void         release();
+	inline const Stats& stats() const;
+};
+CachingAllocator::CachingAllocator()                          { init(); }
+CachingAllocator::CachingAllocator(const CachingAllocator& ) { init(); }
+void CachingAllocator::init() {
+	Stats zero = {0, 0, 0, 0, 0};
+	m_stats = zero;
+	for( int c=0; c<NUM_SIZE_CLASSES; ++c ) {
+		m_free_blocks[c] = -1;
+	}
+	m_allocated_blocks = -1;
+	m_spare_records    = -1;
+}
+int CachingAllocator::size_class(size_t size) {
+	int c = 0;
+	while( size >>= 1 ) {
+		++c;
+	}
+	return c;
+}
+int CachingAllocator::unlink(int* head, int prev) {
+	int* link   = prev < 0 ? head : &m_blocks[prev].next;
+	int  record = *link;
+	*link = m_blocks[record].next;
+	return record;
+}
+CachingAllocator::~CachingAllocator() {
+	release();
+	// Note: Blocks still in use are leaked rather than freed under their
+	//         users' feet.
+}
+char* CachingAllocator::allocate(std::ptrdiff_t num_bytes) {
+	size_t size = num_bytes;
+	// Reuse the smallest cached block that fits, as long as it would not
+	//   waste more than half of itself
+	// Note: Such blocks can only be in the request's size class or the next
+	int best = -1, best_prev = -1, best_class = -1;
+	int first_class = size_class(size);
+	for( int c=first_class; c<=first_class+1 && c<NUM_SIZE_CLASSES; ++c ) {
+		for( int r=m_free_blocks[c], prev=-1; r>=0;
+		     prev=r, r=m_blocks[r].next ) {
+			size_t block_size = m_blocks[r].size;
+			if( block_size >= size && block_size / 2 <= size &&
+			    (best < 0 || block_size < m_blocks[best].size) ) {
+				best       = r;
+				best_prev  = prev;
+				best_class = c;
+			}
+		}
+	}
+	int record;
+	if( best >= 0 ) {
+		record = unlink(&m_free_blocks[best_class], best_prev);
+		++m_stats.reuses;
+	}
+	else {
+		char* ptr = thrust::raw_pointer_cast(thrust::device_malloc<char>(size));
+		if( !ptr && size ) {
+			throw std::runtime_error("CachingAllocator: allocation failed");
+		}
+		if( m_spare_records >= 0 ) {
+			record = unlink(&m_spare_records, -1);
+		}
+		else {
+			record = (int)m_blocks.size();
+			m_blocks.push_back(Block());
+		}
+		m_blocks[record].ptr  = ptr;
+		m_blocks[record].size = size;
+		++m_stats.allocations;
+		m_stats.bytes_reserved += size;
+	}
+	m_blocks[record].next = m_allocated_blocks;
+	m_allocated_blocks    = record;
+	size = m_blocks[record].size;
+	m_stats.bytes_in_use += size;
+	if( m_stats.bytes_in_use > m_stats.peak_bytes_in_use ) {
+		m_stats.peak_bytes_in_use = m_stats.bytes_in_use;
+	}
+	return m_blocks[record].ptr;
+}
+void CachingAllocator::deallocate(char* ptr, size_t ) {
+	// Note: Blocks are usually freed in reverse order of allocation, so
+	//         this search rarely goes past the first few in-use blocks
+	int prev = -1;
+	int r    = m_allocated_blocks;
+	while( r >= 0 && m_blocks[r].ptr != ptr ) {
+		prev = r;
+		r    = m_blocks[r].next;
+	}
+	if( r < 0 ) {
+		throw std::invalid_argument("CachingAllocator: unknown pointer");
+	}
+	unlink(&m_allocated_blocks, prev);
+	int c = size_class(m_blocks[r].size);
+	m_blocks[r].next = m_free_blocks[c];
+	m_free_blocks[c] = r;
+	m_stats.bytes_in_use -= m_blocks[r].size;
+}
+const CachingAllocator::Stats& CachingAllocator::stats() const {
+	return m_stats;
+}
+void CachingAllocator::release() {
+	for( int c=0; c<NUM_SIZE_CLASSES; ++c ) {
+		while( m_free_blocks[c] >= 0 ) {
+			int r = unlink(&m_free_blocks[c], -1);
+			thrust::device_free(thrust::device_pointer_cast(m_blocks[r].ptr));
+			m_stats.bytes_reserved -= m_blocks[r].size;
+			m_blocks[r].next = m_spare_records;
+			m_spare_records  = r;
+		}
+	}
+}
+
+// An uninitialised device array of n elements of T, taken from (and
+//   returned to) a CachingAllocator
+template<typename T>
+class TempBuffer {
+	CachingAllocator& m_allocator;
+	T*                m_data;
+	size_t            m_size;
+	TempBuffer(const TempBuffer& );
+	TempBuffer& operator=(const TempBuffer& );
+public:
+	typedef thrust::device_ptr<T>         iterator;
+	typedef typename iterator::reference reference;
+	TempBuffer(CachingAllocator& allocator, size_t n)
+		: m_allocator(allocator),
+		  m_data((T*)allocator.allocate(n * sizeof(T))), m_size(n) {}
+	~TempBuffer() { m_allocator.deallocate((char*)m_data, m_size * sizeof(T)); }
+	size_t   size()  const { return m_size; }
+	T*       data()  const { return m_data; }
+	iterator begin() const { return thrust::device_pointer_cast(m_data); }
+	iterator end()   const { return begin() + m_size; }
+	reference operator[](size_t i) const { return begin()[i]; }
+};
@@ -22,69 +22,592 @@ benbarsdell@gmail.com
 #include <iostream>
 using std::cout;
 using std::endl;
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <glob.h>
+#include <thread>
 
 #include <SantaProblem.hpp>
 #include <SantaSolution.hpp>
+#include <SantaWorkspace.hpp>
+#include <SantaStreamValidator.hpp>
+#include <SantaShardedValidator.hpp>
 
 #include "stopwatch.hpp"
+#include "validation_server.hpp"
+#include "numa_placement.hpp"
+
+// Scores a solution, timing the evaluation
+struct scoring_task {
+	const SantaSolution*       solution;
+	SantaWorkspace*            workspace;
+	SantaSolution::score_type* score;
+	double*                    time;
+	void operator()() const {
+		Stopwatch timer;
+		timer.start();
+		*score = solution->score(workspace);
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+		cudaThreadSynchronize();
+#endif
+		timer.stop();
+		*time = timer.getTime();
+	}
+};
+
+// Expands any glob patterns (e.g., 'submissions/*.csv') in-place, keeping
+//   arguments that match nothing as they are
+std::vector<std::string> expand_globs(const std::vector<std::string>& args) {
+	std::vector<std::string> result;
+	for( size_t a=0; a<args.size(); ++a ) {
+		glob_t matches;
+		if( glob(args[a].c_str(), GLOB_NOCHECK, 0, &matches) == 0 ) {
+			for( size_t m=0; m<matches.gl_pathc; ++m ) {
+				result.push_back(matches.gl_pathv[m]);
+			}
+		}
+		else {
+			result.push_back(args[a]);
+		}
+		globfree(&matches);
+	}
+	return result;
+}
+
+// A solution file loaded ahead of being checked
+struct loaded_solution {
+	SantaSolution solution;
+	std::string   error;
+	double        load_time;
+};
+// Loads one solution file into a slot, recording any error instead of
+//   throwing (so that it can run on the loader thread)
+struct loader_task {
+	std::string                    filename;
+	SantaSolution::CollisionMethod collision_method;
+	loaded_solution*               slot;
+	void operator()() const {
+		Stopwatch timer;
+		timer.start();
+		slot->error.clear();
+		slot->solution.set_collision_method(collision_method);
+		try {
+			if( SantaSolution::is_binary(filename) ) {
+				slot->solution.load_binary(filename);
+			}
+			else {
+				slot->solution.load(filename);
+			}
+		}
+		catch( std::exception& e ) {
+			slot->error = e.what();
+		}
+		timer.stop();
+		slot->load_time = timer.getTime();
+	}
+};
+
+// Checks many solution files against one problem, loading file k+1 on a
+//   second thread while file k is validated and scored, and prints a
+//   table of the results
+// Returns 0 if every solution is valid
+int check_many(const SantaProblem&              problem,
+               const std::vector<std::string>&  filenames,
+               SantaSolution::CollisionMethod   collision_method,
+               bool                             fail_fast,
+               bool                             pipelined) {
+	using std::setw;
+	size_t width = 4;
+	for( size_t k=0; k<filenames.size(); ++k ) {
+		width = std::max(width, filenames[k].size());
+	}
+	cout << std::left << setw(width) << "file" << std::right
+	     << setw(6)  << "valid"
+	     << setw(10) << "size"
+	     << setw(10) << "bounds"
+	     << setw(10) << "dims"
+	     << setw(12) << "collisions"
+	     << setw(18) << "score"
+	     << setw(10) << "load s"
+	     << setw(10) << "check s" << endl;
+	Stopwatch total_timer;
+	total_timer.start();
+	SantaWorkspace  workspace;
+	loaded_solution slots[2];
+	loader_task loader = {filenames[0], collision_method, &slots[0]};
+	loader();
+	size_t nvalid  = 0;
+	size_t nloaded = 0;
+	for( size_t k=0; k<filenames.size(); ++k ) {
+		loaded_solution& current = slots[k % 2];
+		// Start loading the next file into the other slot
+		bool has_next = k+1 < filenames.size();
+		loader_task next = {has_next ? filenames[k+1] : "",
+		                    collision_method, &slots[(k+1) % 2]};
+		std::thread loader_thread;
+		if( has_next && pipelined ) {
+			loader_thread = std::thread(next);
+		}
+		cout << std::left << setw(width) << filenames[k] << std::right;
+		if( !current.error.empty() ) {
+			cout << "  error: " << current.error << endl;
+		}
+		else {
+			++nloaded;
+			Stopwatch timer;
+			timer.start();
+			int size_difference = 0, boundary_violations = 0,
+				dimension_mismatches = 0, collisions = 0;
+			bool valid;
+			if( fail_fast ) {
+				// Note: Only the check that failed first is counted
+				SantaSolution::Violation violation;
+				valid = current.solution.find_first_violation(problem,
+				                                              &violation,
+				                                              &workspace);
+				size_difference      = violation.check == SantaSolution::CHECK_SIZE;
+				boundary_violations  = violation.check == SantaSolution::CHECK_BOUNDS;
+				dimension_mismatches = violation.check == SantaSolution::CHECK_DIMENSIONS;
+				collisions           = violation.check == SantaSolution::CHECK_COLLISIONS;
+			}
+			else {
+				valid = current.solution.validate(problem, false,
+				                                  &size_difference,
+				                                  &boundary_violations,
+				                                  &dimension_mismatches,
+				                                  &collisions,
+				                                  &workspace);
+			}
+			SantaSolution::score_type score = current.solution.score(&workspace);
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+			cudaThreadSynchronize();
+#endif
+			timer.stop();
+			nvalid += valid;
+			cout << setw(6)  << (valid ? "yes" : "no")
+			     << setw(10) << size_difference
+			     << setw(10) << boundary_violations
+			     << setw(10) << dimension_mismatches
+			     << setw(12) << collisions
+			     << setw(18) << score
+			     << std::fixed << std::setprecision(3)
+			     << setw(10) << current.load_time
+			     << setw(10) << timer.getTime() << endl;
+			cout.unsetf(std::ios::floatfield);
+			cout << std::setprecision(6);
+		}
+		if( loader_thread.joinable() ) {
+			loader_thread.join();
+		}
+		else if( has_next ) {
+			next();
+		}
+	}
+	total_timer.stop();
+	double total_time = total_timer.getTime();
+	cout << filenames.size() << " files (" << nvalid << " valid, "
+	     << filenames.size() - nloaded << " unreadable) in "
+	     << total_time << " s = " << filenames.size() / total_time
+	     << " files/s" << endl;
+	return nvalid == filenames.size() ? 0 : -2;
+}
+
+// Lists (1-based) IDs of the offending presents
+void report_violations(const SantaProblem&  problem,
+                       const SantaSolution& solution,
+                       size_t               max_report) {
+	std::vector<int>           ids;
+	std::vector<unsigned char> flags;
+	size_t nflagged = solution.find_violations(problem, max_report,
+	                                           &ids, &flags);
+	if( nflagged > 0 ) {
+		cout << "Presents violating bounds/dimensions ("
+		     << ids.size() << " of " << nflagged << "):" << endl;
+		for( size_t i=0; i<ids.size(); ++i ) {
+			cout << "  " << ids[i]+1 << ":";
+			if( flags[i] & SantaSolution::VIOLATES_BOUNDS ) {
+				cout << " bounds";
+			}
+			if( flags[i] & SantaSolution::VIOLATES_DIMENSIONS ) {
+				cout << " dimensions";
+			}
+			cout << endl;
+		}
+	}
+	std::vector<int> ids_a, ids_b;
+	size_t npairs = solution.find_collisions(max_report, &ids_a, &ids_b);
+	if( npairs > 0 ) {
+		cout << "Colliding pairs (" << ids_a.size() << " of " << npairs
+		     << "):" << endl;
+		for( size_t p=0; p<ids_a.size(); ++p ) {
+			cout << "  " << ids_a[p]+1 << "," << ids_b[p]+1 << endl;
+		}
+	}
+}
+
+// Validates a solution file too large to load with SantaStreamValidator
+// Returns 0 if the solution is valid
+int check_out_of_core(const SantaProblem& problem,
+                      std::string         filename,
+                      std::string         scratch_dir) {
+	Stopwatch timer;
+	timer.start();
+	cout << "Validating solution out of core" << endl;
+	SantaStreamValidator validator(problem, scratch_dir);
+	int size_difference, boundary_violations, dimension_mismatches, collisions;
+	bool validated = validator.validate(filename,
+	                                    &size_difference,
+	                                    &boundary_violations,
+	                                    &dimension_mismatches,
+	                                    &collisions);
+	timer.stop();
+	cout << "Validation time = " << timer.getTime() << " s"
+	     << " (" << validator.run_count() << " sorted runs)" << endl;
+	if( validated ) {
+		cout << "Solution VERIFIED (not scored out of core)" << endl;
+		return 0;
+	}
+	if( size_difference != 0 ) {
+		cout << "Difference in no. presents: " << size_difference << endl;
+	}
+	if( boundary_violations != 0 ) {
+		cout << "Boundary violations: " << boundary_violations << endl;
+	}
+	if( dimension_mismatches != 0 ) {
+		cout << "Dimension mismatches: " << dimension_mismatches << endl;
+	}
+	if( collisions != 0 ) {
+		cout << "Collisions: " << collisions << endl;
+	}
+	return -2;
+}
+
+// Describes the violation at which a fail-fast validation stopped
+void report_first_violation(const SantaSolution::Violation& violation) {
+	cout << "First violation found: ";
+	switch( violation.check ) {
+	case SantaSolution::CHECK_SIZE:
+		cout << "no. presents differs from the problem at present "
+		     << violation.present+1 << endl;
+		break;
+	case SantaSolution::CHECK_BOUNDS:
+		cout << "present " << violation.present+1
+		     << " violates the sleigh bounds" << endl;
+		break;
+	case SantaSolution::CHECK_DIMENSIONS:
+		cout << "present " << violation.present+1
+		     << " does not match its dimensions" << endl;
+		break;
+	case SantaSolution::CHECK_COLLISIONS:
+		cout << "presents " << violation.present+1 << " and "
+		     << violation.other+1 << " collide" << endl;
+		break;
+	default:
+		cout << "none" << endl;
+	}
+}
 
 int main(int argc, char* argv[])
 {	
-#if THRUST_DEVICE_BACKEND == THRUST_DEVICE_BACKEND_CUDA
+	// Note: Sharded validation re-runs this program as its workers
+	int worker_status = SantaShardedValidator::worker_main(argc, argv);
+	if( worker_status >= 0 ) {
+		return worker_status;
+	}
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
 	cudaSetDevice(0); // Note: This also ensures the device is 'warmed up'
 #endif
 	
-	if( argc <= 2 ) {
-		cout << "Usage: " << argv[0] << " presents.csv submissionfile.csv" << endl;
+	std::vector<std::string> args;
+	bool save_binary = false;
+	bool fail_fast   = false;
+	bool concurrent  = false;
+	bool serve       = false;
+	bool out_of_core = false;
+	int  nshards     = 0;
+	bool pin_threads = false;
+	std::string scratch_dir;
+	std::string socket_path;
+	size_t max_report = 0;
+	enum { PROFILE_NONE, PROFILE_TABLE, PROFILE_JSON } profile = PROFILE_NONE;
+	SantaSolution::CollisionMethod collision_method =
+		SantaSolution::COLLISIONS_AUTO;
+	for( int a=1; a<argc; ++a ) {
+		std::string arg = argv[a];
+		if( arg == "--save-binary" ) {
+			save_binary = true;
+		}
+		else if( arg == "--serve" ) {
+			serve = true;
+		}
+		else if( arg.compare(0, 8, "--serve=") == 0 ) {
+			serve = true;
+			socket_path = arg.substr(8);
+		}
+		else if( arg == "--out-of-core" ) {
+			out_of_core = true;
+		}
+		else if( arg.compare(0, 14, "--out-of-core=") == 0 ) {
+			out_of_core = true;
+			scratch_dir = arg.substr(14);
+		}
+		else if( arg.compare(0, 9, "--shards=") == 0 ) {
+			nshards = atoi(arg.c_str() + 9);
+		}
+		else if( arg == "--pin-threads" ) {
+			pin_threads = true;
+		}
+		else if( arg == "--concurrent" ) {
+			concurrent = true;
+		}
+		else if( arg == "--fail-fast" ) {
+			fail_fast = true;
+		}
+		else if( arg == "--collisions=sweep" ) {
+			collision_method = SantaSolution::COLLISIONS_SWEEP;
+		}
+		else if( arg == "--collisions=grid" ) {
+			collision_method = SantaSolution::COLLISIONS_GRID;
+		}
+		else if( arg == "--collisions=balanced" ) {
+			collision_method = SantaSolution::COLLISIONS_SWEEP_BALANCED;
+		}
+		else if( arg == "--collisions=auto" ) {
+			collision_method = SantaSolution::COLLISIONS_AUTO;
+		}
+		else if( arg.compare(0, 9, "--report=") == 0 ) {
+			max_report = strtoul(arg.c_str() + 9, 0, 10);
+		}
+		else if( arg == "--profile" || arg == "--profile=table" ) {
+			profile = PROFILE_TABLE;
+		}
+		else if( arg == "--profile=json" ) {
+			profile = PROFILE_JSON;
+		}
+		else {
+			args.push_back(arg);
+		}
+	}
+	if( args.size() < size_t(serve ? 1 : 2) ) {
+		cout << "Usage: " << argv[0] << " [options]"
+		     << " presents.(csv|bin) submissionfile.(csv|bin)..." << endl;
+		cout << "       " << argv[0] << " --serve[=socket] [options]"
+		     << " presents.(csv|bin)" << endl;
+		cout << "  --save-binary  Also write each csv input as a binary"
+		     << " snapshot (<input>.bin)" << endl;
+		cout << "  --collisions=(auto|sweep|balanced|grid)"
+		     << "  Collision-counting method (default auto)" << endl;
+		cout << "  --fail-fast    Stop validating at the first violation"
+		     << " found and report only that one" << endl;
+		cout << "  --concurrent   Score the solution on a second thread"
+		     << " while validating it" << endl;
+		cout << "  --out-of-core[=dir]  Validate the submission without"
+		     << " loading it, spilling sorted runs to dir (default $TMPDIR);"
+		     << " does not score it" << endl;
+		cout << "  --shards=N     Validate in N worker processes, one per"
+		     << " z-slab (see SantaShardedValidator.hpp)" << endl;
+		cout << "  --pin-threads  Bind each OpenMP thread to one CPU, spread"
+		     << " over the NUMA nodes (see numa_placement.hpp)" << endl;
+		cout << "  --report=N     List up to N colliding pairs and N presents"
+		     << " violating the bounds or dimensions" << endl;
+		cout << "  --serve[=socket]  Load the problem once and serve"
+		     << " validation requests on stdin/stdout or a Unix socket"
+		     << " (see validation_server.hpp)" << endl;
+		cout << "  --profile[=(table|json)]  Print the time spent in each"
+		     << " phase of loading, validation and scoring" << endl;
+		return -1;
+	}
+	std::string presents_filename = args[0];
+	std::vector<std::string> solution_filenames =
+		expand_globs(std::vector<std::string>(args.begin() + 1, args.end()));
+	std::string solution_filename = solution_filenames.empty() ? ""
+	                                : solution_filenames[0];
+	// Note: Several submissions are only validated and scored (see
+	//         check_many), so options for a single one are rejected
+	if( solution_filenames.size() > 1 &&
+	    (save_binary || concurrent || out_of_core || nshards > 0 ||
+	     max_report > 0) ) {
+		cout << "--save-binary, --concurrent, --out-of-core, --shards and"
+		     << " --report apply to a single submission only" << endl;
 		return -1;
 	}
-	std::string presents_filename = argv[1];
-	std::string solution_filename = argv[2];
 	
 	int sleigh_size = 1000;
 	
+	// Note: Pinned before loading so that the columns are first touched
+	//         by the threads that will process them
+	if( pin_threads ) {
+		cout << "Pinned " << numa::pin_threads() << " threads" << endl;
+	}
+	
+	// Note: Timed regions cost almost nothing when the profiler is disabled
+	Profiler::instance().setEnabled(profile != PROFILE_NONE);
+	
 	Stopwatch timer;
 	timer.start();
 	
-	SantaProblem  problem(sleigh_size, presents_filename);
-	SantaSolution solution(solution_filename);
+	// Note: Binary snapshots are detected by their header, not their name
+	SantaProblem  problem;
+	problem.set_sleigh_size(sleigh_size);
+	bool problem_is_binary = SantaProblem::is_binary(presents_filename);
+	if( problem_is_binary ) {
+		problem.load_binary(presents_filename);
+	}
+	else {
+		problem.load(presents_filename);
+	}
+	if( serve ) {
+		// Note: stdout may carry the protocol, so messages go to stderr
+		timer.stop();
+		std::cerr << "Load time = " << timer.getTime() << " s" << endl;
+		try {
+			if( socket_path.empty() ) {
+				server::Connection conn(stdin, stdout);
+				server::serve(conn, problem, collision_method);
+			}
+			else {
+				std::cerr << "Serving on " << socket_path << endl;
+				server::serve_socket(socket_path, problem, collision_method);
+			}
+		}
+		catch( std::exception& e ) {
+			std::cerr << e.what() << endl;
+			return -1;
+		}
+		return 0;
+	}
+	if( solution_filenames.size() > 1 ) {
+		timer.stop();
+		cout << "Load time = " << timer.getTime() << " s" << endl;
+		// Note: Profiling loads the files one after the other, so that
+		//         loads are not timed while they overlap validation
+		int result = check_many(problem, solution_filenames,
+		                        collision_method, fail_fast,
+		                        profile == PROFILE_NONE);
+		if( profile == PROFILE_TABLE ) {
+			Profiler::instance().printTable(cout);
+		}
+		else if( profile == PROFILE_JSON ) {
+			Profiler::instance().printJSON(cout);
+		}
+		return result;
+	}
+	if( out_of_core ) {
+		timer.stop();
+		cout << "Load time = " << timer.getTime() << " s" << endl;
+		int result;
+		try {
+			result = check_out_of_core(problem, solution_filename, scratch_dir);
+		}
+		catch( std::exception& e ) {
+			cout << e.what() << endl;
+			return -1;
+		}
+		if( profile == PROFILE_TABLE ) {
+			Profiler::instance().printTable(cout);
+		}
+		else if( profile == PROFILE_JSON ) {
+			Profiler::instance().printJSON(cout);
+		}
+		return result;
+	}
+	SantaSolution solution;
+	solution.set_collision_method(collision_method);
+	bool solution_is_binary = SantaSolution::is_binary(solution_filename);
+	if( solution_is_binary ) {
+		solution.load_binary(solution_filename);
+	}
+	else {
+		solution.load(solution_filename);
+	}
 	
 	timer.stop();
 	cout << "Load time = " << timer.getTime() << " s" << endl;
 	
+	if( save_binary ) {
+		if( !problem_is_binary ) {
+			problem.save_binary(presents_filename + ".bin");
+			cout << "Wrote " << presents_filename << ".bin" << endl;
+		}
+		if( !solution_is_binary ) {
+			solution.save_binary(solution_filename + ".bin");
+			cout << "Wrote " << solution_filename << ".bin" << endl;
+		}
+	}
+	
+	// Note: Validation and scoring use separate workspaces so that they can
+	//         run side by side. Profiling runs them one after the other,
+	//         so that each phase is timed on its own.
+	SantaWorkspace validation_workspace;
+	SantaWorkspace scoring_workspace;
+	SantaSolution::score_type score;
+	double                    scoring_time;
+	scoring_task scoring = {&solution, &scoring_workspace,
+	                        &score, &scoring_time};
+	std::thread scoring_thread;
+	if( concurrent && profile == PROFILE_NONE ) {
+		scoring_thread = std::thread(scoring);
+	}
+	
 	timer.reset();
 	timer.start();
 	
 	cout << "Validating solution" << endl;
 	//int result = verify_solution(data_cols, soln_cols, sleigh_size);
-	int size_difference, boundary_violations,
-		dimension_mismatches, collisions;
-	bool validated = solution.validate(problem, false,
-	                                   &size_difference,
-	                                   &boundary_violations,
-	                                   &dimension_mismatches,
-	                                   &collisions);
-	
-#if THRUST_DEVICE_BACKEND == THRUST_DEVICE_BACKEND_CUDA
+	int size_difference = 0, boundary_violations = 0,
+		dimension_mismatches = 0, collisions = 0;
+	SantaSolution::Violation violation;
+	bool validated;
+	if( fail_fast ) {
+		validated = solution.find_first_violation(problem, &violation,
+		                                          &validation_workspace);
+	}
+	else if( nshards > 0 ) {
+		try {
+			SantaShardedValidator sharded(nshards);
+			validated = sharded.validate(problem, solution,
+			                             &size_difference,
+			                             &boundary_violations,
+			                             &dimension_mismatches,
+			                             &collisions);
+		}
+		catch( std::exception& e ) {
+			cout << e.what() << endl;
+			if( scoring_thread.joinable() ) {
+				scoring_thread.join();
+			}
+			return -1;
+		}
+	}
+	else {
+		validated = solution.validate(problem, false,
+		                              &size_difference,
+		                              &boundary_violations,
+		                              &dimension_mismatches,
+		                              &collisions,
+		                              &validation_workspace);
+	}
+	
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
 	cudaThreadSynchronize();
 #endif
 	timer.stop();
 	cout << "Validation time = " << timer.getTime() << " s" << endl;
 	cout << "                = " << 1. / timer.getTime() << " Hz" << endl;
 	
-	timer.reset();
-	timer.start();
-	
 	cout << "Evaluating solution" << endl;
-	int score = solution.score();
-	
-#if THRUST_DEVICE_BACKEND == THRUST_DEVICE_BACKEND_CUDA
-	cudaThreadSynchronize();
-#endif
-	timer.stop();
-	cout << "Evaluation time = " << timer.getTime() << " s" << endl;
-	cout << "                = " << 1. / timer.getTime() << " Hz" << endl;
+	if( scoring_thread.joinable() ) {
+		scoring_thread.join();
+	}
+	else {
+		scoring();
+	}
+	cout << "Evaluation time = " << scoring_time << " s" << endl;
+	cout << "                = " << 1. / scoring_time << " Hz" << endl;
 	
+	int result = 0;
 	if( validated ) {
 		cout << "Solution VERIFIED" << endl;
 		cout << "--------------" << endl;
@@ -92,6 +615,9 @@ int main(int argc, char* argv[])
 		cout << "--------------" << endl;
 	}
 	else {
+		if( fail_fast ) {
+			report_first_violation(violation);
+		}
 		if( size_difference != 0 ) {
 			cout << "Difference in no. presents: " << size_difference << endl;
 		}
@@ -104,8 +630,18 @@ int main(int argc, char* argv[])
 		if( collisions != 0 ) {
 			cout << "Collisions: " << collisions << endl;
 		}
-		return -2;
+		if( max_report > 0 ) {
+			report_violations(problem, solution, max_report);
+		}
+		result = -2;
+	}
+	
+	if( profile == PROFILE_TABLE ) {
+		Profiler::instance().printTable(cout);
+	}
+	else if( profile == PROFILE_JSON ) {
+		Profiler::instance().printJSON(cout);
 	}
 	
-	return 0;
+	return result;
 }
@@ -0,0 +1,345 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+/*
+  Streaming decompression of compressed csv inputs (.gz, .zst)
+    detect            - identifies the compression format by magic bytes
+    Decoder           - incremental decoder for one file
+    BlockReader       - decodes a file on its own thread into a small ring
+                          of fixed-size blocks
+    for_each_line_block - hands a sink successive blocks of whole lines
+  gzip needs SANTA_HAVE_ZLIB (-lz) and zstd needs SANTA_HAVE_ZSTD (-lzstd);
+    without them such files are rejected with a clear error.
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef SANTA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SANTA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace compressed {
+
+enum Format { FORMAT_NONE, FORMAT_GZIP, FORMAT_ZSTD };
+
+// Note: Detected by content, not by extension
+inline Format detect(std::string filename) {
+	unsigned char magic[4] = {0, 0, 0, 0};
+	FILE* file = fopen(filename.c_str(), "rb");
+	if( !file ) {
+		return FORMAT_NONE;
+	}
+	size_t nread = fread(magic, 1, 4, file);
+	fclose(file);
+	if( nread >= 2 && magic[0] == 0x1f && magic[1] == 0x8b ) {
+		return FORMAT_GZIP;
+	}
+	if( nread == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+	    magic[2] == 0x2f && magic[3] == 0xfd ) {
+		return FORMAT_ZSTD;
+	}
+	return FORMAT_NONE;
+}
+inline bool is_compressed(std::string filename) {
+	return detect(filename) != FORMAT_NONE;
+}
+
+class Decoder {
+public:
+	virtual ~Decoder() {}
+	// Decodes up to size bytes into data; returns 0 at the end of the file
+	virtual size_t read(char* data, size_t size) = 0;
+};
+
+#ifdef SANTA_HAVE_ZLIB
+class GzipDecoder : public Decoder {
+	gzFile      m_file;
+	std::string m_filename;
+public:
+	explicit GzipDecoder(std::string filename)
+		: m_file(gzopen(filename.c_str(), "rb")), m_filename(filename) {
+		if( !m_file ) {
+			throw std::runtime_error("Failed to open " + filename);
+		}
+		gzbuffer(m_file, 1 << 20);
+	}
+	~GzipDecoder() { gzclose(m_file); }
+	size_t read(char* data, size_t size) {
+		int nread = gzread(m_file, data, (unsigned)size);
+		int error = Z_OK;
+		if( nread == 0 ) {
+			gzerror(m_file, &error);
+		}
+		// Note: zlib reports a truncated stream as a soft Z_BUF_ERROR
+		if( nread < 0 || error == Z_BUF_ERROR ) {
+			throw std::runtime_error("Corrupt gzip data in " + m_filename);
+		}
+		return nread;
+	}
+};
+#endif
+
+#ifdef SANTA_HAVE_ZSTD
+class ZstdDecoder : public Decoder {
+	FILE*              m_file;
+	ZSTD_DStream*      m_stream;
+	std::vector<char>  m_input;
+	ZSTD_inBuffer      m_in;
+	size_t             m_pending; // Non-zero while a frame is incomplete
+	std::string        m_filename;
+public:
+	explicit ZstdDecoder(std::string filename)
+		: m_file(fopen(filename.c_str(), "rb")),
+		  m_stream(ZSTD_createDStream()),
+		  m_input(ZSTD_DStreamInSize()),
+		  m_filename(filename) {
+		if( !m_file ) {
+			ZSTD_freeDStream(m_stream);
+			throw std::runtime_error("Failed to open " + filename);
+		}
+		ZSTD_initDStream(m_stream);
+		m_in.src  = &m_input[0];
+		m_in.size = 0;
+		m_in.pos  = 0;
+		m_pending = 0;
+	}
+	~ZstdDecoder() {
+		ZSTD_freeDStream(m_stream);
+		fclose(m_file);
+	}
+	size_t read(char* data, size_t size) {
+		ZSTD_outBuffer out = {data, size, 0};
+		while( out.pos == 0 ) {
+			if( m_in.pos == m_in.size ) {
+				m_in.size = fread(&m_input[0], 1, m_input.size(), m_file);
+				m_in.pos  = 0;
+				if( m_in.size == 0 ) {
+					if( m_pending ) {
+						throw std::runtime_error("Truncated zstd data in "
+						                         + m_filename);
+					}
+					break;
+				}
+			}
+			size_t ret = ZSTD_decompressStream(m_stream, &out, &m_in);
+			if( ZSTD_isError(ret) ) {
+				throw std::runtime_error("Corrupt zstd data in " + m_filename
+				                         + ": " + ZSTD_getErrorName(ret));
+			}
+			m_pending = ret;
+		}
+		return out.pos;
+	}
+};
+#endif
+
+inline Decoder* open_decoder(std::string filename) {
+	switch( detect(filename) ) {
+	case FORMAT_GZIP:
+#ifdef SANTA_HAVE_ZLIB
+		return new GzipDecoder(filename);
+#else
+		throw std::runtime_error("Built without gzip support: " + filename);
+#endif
+	case FORMAT_ZSTD:
+#ifdef SANTA_HAVE_ZSTD
+		return new ZstdDecoder(filename);
+#else
+		throw std::runtime_error("Built without zstd support: " + filename);
+#endif
+	default:
+		throw std::runtime_error("Not a compressed file: " + filename);
+	}
+}
+
+// Decodes a file into a ring of nblocks blocks of block_size bytes, on a
+//   separate thread, so that decoding overlaps with whatever the caller
+//   does with each block
+// Note: At most nblocks blocks are ever held, whatever the file size.
+class BlockReader {
+public:
+	enum { block_size = 4 << 20, nblocks = 3 };
+private:
+	Decoder*                        m_decoder;
+	std::vector<std::vector<char> > m_blocks;
+	std::vector<size_t>             m_sizes;
+	size_t                          m_head;    // Next block to consume
+	size_t                          m_filled;  // No. decoded blocks held
+	bool                            m_holding; // Consumer holds m_head
+	bool                            m_done;
+	bool                            m_stop;
+	std::string                     m_error;
+	std::mutex                      m_mutex;
+	std::condition_variable         m_changed;
+	std::thread                     m_thread;
+	BlockReader(const BlockReader&);
+	BlockReader& operator=(const BlockReader&);
+	// Decodes into block b; returns false at the end of the file
+	bool decode(size_t b) {
+		std::vector<char>& block = m_blocks[b];
+		size_t size = 0;
+		while( size < block.size() ) {
+			size_t nread = m_decoder->read(&block[size], block.size() - size);
+			if( nread == 0 ) {
+				break;
+			}
+			size += nread;
+		}
+		m_sizes[b] = size;
+		return size > 0;
+	}
+	void run() {
+		size_t tail = 0;
+		for( ;; ) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while( m_filled == nblocks && !m_stop ) {
+					m_changed.wait(lock);
+				}
+				if( m_stop ) {
+					return;
+				}
+			}
+			// Note: Block tail is not visible to the consumer until filled
+			bool more;
+			std::string error;
+			try {
+				more = decode(tail);
+			}
+			catch( std::exception& e ) {
+				more  = false;
+				error = e.what();
+			}
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if( more ) {
+				++m_filled;
+				tail = (tail + 1) % nblocks;
+			}
+			else {
+				m_done  = true;
+				m_error = error;
+			}
+			m_changed.notify_all();
+			if( !more ) {
+				return;
+			}
+		}
+	}
+public:
+	explicit BlockReader(std::string filename)
+		: m_decoder(open_decoder(filename)),
+		  m_blocks(nblocks, std::vector<char>(block_size)),
+		  m_sizes(nblocks, 0),
+		  m_head(0), m_filled(0), m_holding(false),
+		  m_done(false), m_stop(false) {
+		m_thread = std::thread(&BlockReader::run, this);
+	}
+	~BlockReader() {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = true;
+			m_changed.notify_all();
+		}
+		m_thread.join();
+		delete m_decoder;
+	}
+	// Points at the next decoded block and returns its size, or returns 0
+	//   at the end of the file
+	// Note: The block remains valid until the next call, which hands it
+	//         back to the decoder
+	size_t next(const char** data) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if( m_holding ) {
+			m_head = (m_head + 1) % nblocks;
+			--m_filled;
+			m_holding = false;
+			m_changed.notify_all();
+		}
+		while( m_filled == 0 && !m_done ) {
+			m_changed.wait(lock);
+		}
+		if( m_filled == 0 ) {
+			if( !m_error.empty() ) {
+				throw std::runtime_error(m_error);
+			}
+			return 0;
+		}
+		m_holding = true;
+		*data = &m_blocks[m_head][0];
+		return m_sizes[m_head];
+	}
+};
+
+// Calls sink(begin, end, first) on successive runs of whole lines of a
+//   compressed file until it returns false, where first is true only for
+//   the run that starts with the file's first (header) line
+// Note: Only the partial line at the end of each block is copied
+template<typename Sink>
+void for_each_line_block(std::string filename, Sink& sink) {
+	BlockReader reader(filename);
+	std::vector<char> carry;
+	const char* data;
+	size_t size;
+	bool first = true;
+	while( (size = reader.next(&data)) > 0 ) {
+		size_t head = size;
+		while( head > 0 && data[head-1] != '\n' ) {
+			--head;
+		}
+		if( head == 0 ) {
+			carry.insert(carry.end(), data, data + size);
+			continue;
+		}
+		bool more;
+		if( carry.empty() ) {
+			more = sink(data, data + head, first);
+		}
+		else {
+			carry.insert(carry.end(), data, data + head);
+			more = sink(&carry[0], &carry[0] + carry.size(), first);
+		}
+		first = false;
+		carry.assign(data + head, data + size);
+		if( !more ) {
+			return;
+		}
+	}
+	if( !carry.empty() ) {
+		sink(&carry[0], &carry[0] + carry.size(), first);
+	}
+}
+
+} // namespace compressed
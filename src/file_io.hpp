@@ -0,0 +1,510 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+/*
+  Low-level file helpers shared by the SantaProblem and SantaSolution loaders:
+    MappedFile - read-only memory mapping of a whole file
+    HostColumn - host-writable view of a device_vector being filled
+    HostCopy   - host-readable view of a device_vector being written out
+    check_range - rejects values that do not fit a narrower storage type
+    CsvChunks  - newline-aligned split of a csv body for parallel parsing
+    write_rows - parallel formatting of csv rows into an ordered stream
+    snapshot   - versioned binary columnar file format
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "parallel_for.hpp"
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+// Note: This is currently Linux-specific!
+class MappedFile {
+	const char* m_data;
+	size_t      m_size;
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+public:
+	explicit MappedFile(std::string filename) : m_data(0), m_size(0) {
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if( fd < 0 ) {
+			throw std::runtime_error("Failed to open " + filename);
+		}
+		struct stat st;
+		if( ::fstat(fd, &st) != 0 ) {
+			::close(fd);
+			throw std::runtime_error("Failed to stat " + filename);
+		}
+		m_size = st.st_size;
+		if( m_size > 0 ) {
+			void* ptr = ::mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if( ptr == MAP_FAILED ) {
+				::close(fd);
+				throw std::runtime_error("Failed to map " + filename);
+			}
+			::madvise(ptr, m_size, MADV_WILLNEED);
+			m_data = (const char*)ptr;
+		}
+		// Note: The mapping remains valid after the descriptor is closed
+		::close(fd);
+	}
+	~MappedFile() {
+		if( m_data ) {
+			::munmap((void*)m_data, m_size);
+		}
+	}
+	const char* begin() const { return m_data; }
+	const char* end()   const { return m_data + m_size; }
+	size_t      size()  const { return m_size; }
+};
+
+// Throws std::out_of_range if any value in [first,last) cannot be stored
+//   as a T (e.g., in compact storage)
+template<typename T, typename U>
+void check_range(const U* first, const U* last) {
+	typedef std::numeric_limits<T> limits;
+	if( (long long)limits::min() <= (long long)std::numeric_limits<U>::min() &&
+	    (long long)limits::max() >= (long long)std::numeric_limits<U>::max() ) {
+		return;
+	}
+	for( const U* p=first; p!=last; ++p ) {
+		if( (long long)*p < (long long)limits::min() ||
+		    (long long)*p > (long long)limits::max() ) {
+			std::stringstream ss;
+			ss << "Value " << *p << " is out of range for "
+			   << 8*sizeof(T) << "-bit storage";
+			throw std::out_of_range(ss.str());
+		}
+	}
+}
+
+template<typename T, typename U> struct is_same_type       { enum { value = 0 }; };
+template<typename T>             struct is_same_type<T, T> { enum { value = 1 }; };
+
+// Gives the host a raw pointer through which to fill a device_vector with
+//   values of type T.
+// Backends whose device memory is host memory are written in place;
+//   CUDA data, and values that must be narrowed to the vector's type, are
+//   staged on the host and range-checked and copied across by commit().
+template<typename Vector, typename T=typename Vector::value_type>
+class HostColumn {
+	typedef typename Vector::value_type value_type;
+	enum { staged = (THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA ||
+	                 !is_same_type<T, value_type>::value) };
+	Vector&        m_dst;
+	std::vector<T> m_staging;
+public:
+	HostColumn(Vector& dst, size_t n) : m_dst(dst) {
+		m_dst.resize(n);
+		if( staged ) {
+			m_staging.resize(n);
+		}
+	}
+	T* data() {
+		if( staged ) {
+			return m_staging.empty() ? 0 : &m_staging[0];
+		}
+		// Note: Only reached when T is value_type
+		return (T*)thrust::raw_pointer_cast(m_dst.data());
+	}
+	void commit() {
+		if( staged && !m_staging.empty() ) {
+			check_range<value_type>(&m_staging[0],
+			                        &m_staging[0] + m_staging.size());
+			thrust::copy(m_staging.begin(), m_staging.end(), m_dst.begin());
+		}
+	}
+};
+
+// Gives the host a raw pointer through which to read a device_vector as
+//   values of type T.
+// Backends whose device memory is host memory are read in place;
+//   CUDA data, and values that must be widened to T, are copied to the
+//   host in one transfer.
+template<typename Vector, typename T=typename Vector::value_type>
+class HostCopy {
+	typedef typename Vector::value_type value_type;
+	enum { staged = (THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA ||
+	                 !is_same_type<T, value_type>::value) };
+	const Vector&  m_src;
+	std::vector<T> m_staging;
+public:
+	explicit HostCopy(const Vector& src) : m_src(src) {
+		if( staged ) {
+			m_staging.resize(m_src.size());
+			thrust::copy(m_src.begin(), m_src.end(), m_staging.begin());
+		}
+	}
+	const T* data() const {
+		if( staged ) {
+			return m_staging.empty() ? 0 : &m_staging[0];
+		}
+		// Note: Only reached when T is value_type
+		return (const T*)thrust::raw_pointer_cast(m_src.data());
+	}
+};
+
+namespace csv {
+
+// Fast atoi replacement: skips leading blanks, accepts a sign and stops at
+//   the first non-digit. Advances p past the characters consumed.
+template<typename T>
+inline T parse_int(const char*& p, const char* end) {
+	while( p != end && (*p == ' ' || *p == '\t') ) {
+		++p;
+	}
+	bool negative = false;
+	if( p != end && (*p == '-' || *p == '+') ) {
+		negative = (*p == '-');
+		++p;
+	}
+	T value = 0;
+	while( p != end && (unsigned)(*p - '0') < 10u ) {
+		value = value*10 + (*p - '0');
+		++p;
+	}
+	return negative ? -value : value;
+}
+
+// Fast itoa replacement: writes the decimal digits of value at p (without
+//   a terminating null) and returns the end of the written text.
+template<typename T>
+inline char* format_int(char* p, T value) {
+	// Note: Digits are generated in reverse into a scratch buffer
+	char digits[24];
+	char* d = digits + sizeof(digits);
+	bool negative = value < 0;
+	// Note: Works in the unsigned domain so that the minimum value is safe
+	unsigned long long u = negative ? 0ull - (unsigned long long)value
+	                                : (unsigned long long)value;
+	do {
+		*--d = char('0' + u % 10);
+		u /= 10;
+	} while( u );
+	if( negative ) {
+		*--d = '-';
+	}
+	size_t len = digits + sizeof(digits) - d;
+	memcpy(p, d, len);
+	return p + len;
+}
+
+// Sequential reader for the comma-separated integer fields of one line
+class RowReader {
+	const char* m_p;
+	const char* m_end;
+public:
+	RowReader(const char* begin, const char* end) : m_p(begin), m_end(end) {}
+	template<typename T>
+	inline T next() {
+		T value = parse_int<T>(m_p, m_end);
+		const char* comma = (const char*)memchr(m_p, ',', m_end - m_p);
+		m_p = comma ? comma + 1 : m_end;
+		return value;
+	}
+};
+
+inline const char* line_end(const char* p, const char* end) {
+	const char* nl = (const char*)memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+inline bool is_blank(const char* p, const char* end) {
+	for( ; p!=end; ++p ) {
+		if( *p != ' ' && *p != '\t' && *p != '\r' ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Splits the body of a csv file (after its header line) into
+//   newline-aligned chunks and counts the non-blank rows in each, so that
+//   the rows can then be parsed in parallel straight into their final
+//   positions.
+class CsvChunks {
+	std::vector<const char*> m_bounds;  // nchunks+1 chunk boundaries
+	std::vector<size_t>      m_offsets; // nchunks+1 row offsets
+	// Counts the non-blank rows in chunk c into offsets[c+1]
+	struct row_counter {
+		const char* const* bounds;
+		size_t*            offsets;
+		void operator()(size_t c) const {
+			size_t rows = 0;
+			const char* p = bounds[c];
+			while( p < bounds[c+1] ) {
+				const char* e = line_end(p, bounds[c+1]);
+				rows += !is_blank(p, e);
+				p = e + 1;
+			}
+			offsets[c+1] = rows;
+		}
+	};
+	// Calls row_func for the rows of chunk c that are before count
+	template<typename RowFunction>
+	struct row_visitor {
+		const char* const* bounds;
+		const size_t*      offsets;
+		size_t             count;
+		RowFunction        row_func;
+		void operator()(size_t c) {
+			size_t row = offsets[c];
+			const char* p = bounds[c];
+			while( p < bounds[c+1] && row < count ) {
+				const char* e = line_end(p, bounds[c+1]);
+				if( !is_blank(p, e) ) {
+					row_func(row++, p, e);
+				}
+				p = e + 1;
+			}
+		}
+	};
+public:
+	CsvChunks(const char* begin, const char* end, bool skip_header=true) {
+		if( skip_header && begin != end ) {
+			const char* header_end = line_end(begin, end);
+			begin = (header_end == end) ? end : header_end + 1;
+		}
+		int nthreads = host_thread_count();
+		// Note: Oversubscribe chunks so dynamic scheduling can balance load
+		size_t min_chunk_bytes = 1 << 20;
+		size_t nchunks = std::min(size_t(nthreads) * 4,
+		                          size_t(end - begin) / min_chunk_bytes + 1);
+		m_bounds.push_back(begin);
+		for( size_t c=1; c<nchunks; ++c ) {
+			const char* p = begin + (end - begin) * c / nchunks;
+			p = std::max(p, m_bounds.back());
+			p = line_end(p, end);
+			m_bounds.push_back(p == end ? end : p + 1);
+		}
+		m_bounds.push_back(end);
+		nchunks = m_bounds.size() - 1;
+		m_offsets.resize(nchunks+1, 0);
+		row_counter counter = {&m_bounds[0], &m_offsets[0]};
+		parallel_for(nchunks, counter);
+		for( size_t c=0; c<nchunks; ++c ) {
+			m_offsets[c+1] += m_offsets[c];
+		}
+	}
+	size_t rows() const { return m_offsets.back(); }
+	// Calls row_func(row_index, line_begin, line_end) for each of the first
+	//   count non-blank rows, in parallel over chunks
+	template<typename RowFunction>
+	void for_each_row(size_t count, RowFunction row_func) const {
+		row_visitor<RowFunction> visitor = {&m_bounds[0], &m_offsets[0],
+		                                    count, row_func};
+		parallel_for(m_bounds.size() - 1, visitor);
+	}
+};
+
+// Formats the rows of chunk b of the current batch into buffers[b]
+template<typename RowFormatter>
+struct chunk_formatter {
+	size_t                    n;
+	size_t                    row_begin;      // First row of the batch
+	size_t                    rows_per_chunk;
+	size_t                    max_row_chars;
+	std::vector<char>*        buffers;
+	size_t*                   lengths;
+	RowFormatter              format_row;
+	void operator()(size_t b) {
+		size_t begin = row_begin + b * rows_per_chunk;
+		size_t end   = std::min(begin + rows_per_chunk, n);
+		std::vector<char>& buffer = buffers[b];
+		buffer.resize((end - begin) * max_row_chars);
+		char* p = &buffer[0];
+		for( size_t i=begin; i<end; ++i ) {
+			p = format_row(p, i);
+		}
+		lengths[b] = p - &buffer[0];
+	}
+};
+
+// Writes n rows to stream, where format_row(p, i) formats row i at p and
+//   returns the end of the row (at most max_row_chars later).
+// Rows are formatted in parallel into per-chunk buffers, a batch of chunks
+//   at a time, and each batch is then written out in order.
+// Note: The buffers of a batch hold at most about budget_bytes, with chunks
+//         shrunk (down to a minimum) so that each thread gets two of them.
+template<typename RowFormatter>
+void write_rows(std::ostream& stream, size_t n, size_t max_row_chars,
+                RowFormatter format_row) {
+	const size_t budget_bytes       = 32 << 20;
+	const size_t min_rows_per_chunk = 1024;
+	const size_t max_rows_per_chunk = 16384;
+	size_t nthreads = host_thread_count();
+	size_t rows_per_chunk = budget_bytes / (2 * nthreads * max_row_chars);
+	rows_per_chunk = std::max(min_rows_per_chunk,
+	                          std::min(max_rows_per_chunk, rows_per_chunk));
+	size_t nchunks = (n + rows_per_chunk-1) / rows_per_chunk;
+	size_t batch_size = budget_bytes / (rows_per_chunk * max_row_chars);
+	batch_size = std::max(size_t(1), std::min(2 * nthreads, batch_size));
+	batch_size = std::min(batch_size, std::max(size_t(1), nchunks));
+	std::vector<std::vector<char> > buffers(batch_size);
+	std::vector<size_t>             lengths(batch_size);
+	chunk_formatter<RowFormatter> formatter = {n, 0, rows_per_chunk,
+	                                           max_row_chars,
+	                                           &buffers[0], &lengths[0],
+	                                           format_row};
+	for( size_t batch=0; batch<nchunks; batch+=batch_size ) {
+		size_t nbatch = std::min(batch_size, nchunks - batch);
+		formatter.row_begin = batch * rows_per_chunk;
+		parallel_for(nbatch, formatter);
+		for( size_t b=0; b<nbatch; ++b ) {
+			stream.write(&buffers[b][0], lengths[b]);
+		}
+	}
+}
+
+} // namespace csv
+
+namespace snapshot {
+
+// File layout (all integers in native byte order, checked on load):
+//   [0, column_alignment)  Header
+//   then ncolumns raw arrays of count elements, each starting on a
+//   column_alignment boundary so that it can be mapped or copied directly.
+enum {
+	version          = 1,
+	byte_order_mark  = 0x01020304,
+	column_alignment = 4096,
+	max_columns      = 8
+};
+struct Header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t count;
+	uint32_t ncolumns;
+	uint32_t element_size;
+	int64_t  param;    // Class-specific value (e.g., sleigh size)
+	uint64_t offsets[max_columns];
+};
+
+inline uint64_t column_offset(uint64_t count, uint32_t element_size,
+                              uint32_t column) {
+	uint64_t bytes = count * element_size;
+	uint64_t padded = (bytes + column_alignment-1)
+		/ column_alignment * column_alignment;
+	return column_alignment + column * padded;
+}
+
+// Returns true if filename starts with the given 8-byte magic string
+inline bool is_snapshot(std::string filename, const char* magic) {
+	std::ifstream stream(filename.c_str(), std::ios::binary);
+	char buf[8];
+	return stream.read(buf, 8) && memcmp(buf, magic, 8) == 0;
+}
+
+template<typename T>
+void write(std::string filename, const char* magic, int64_t param,
+           size_t count, const std::vector<const T*>& columns) {
+	std::ofstream stream(filename.c_str(), std::ios::binary);
+	if( !stream ) {
+		throw std::runtime_error("Failed to open " + filename);
+	}
+	if( columns.size() > max_columns ) {
+		throw std::logic_error("Too many snapshot columns");
+	}
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, 8);
+	header.version      = version;
+	header.byte_order   = byte_order_mark;
+	header.count        = count;
+	header.ncolumns     = columns.size();
+	header.element_size = sizeof(T);
+	header.param        = param;
+	for( uint32_t c=0; c<header.ncolumns; ++c ) {
+		header.offsets[c] = column_offset(count, sizeof(T), c);
+	}
+	std::vector<char> padding(column_alignment, 0);
+	stream.write((const char*)&header, sizeof(header));
+	stream.write(&padding[0], column_alignment - sizeof(header));
+	uint64_t bytes = count * sizeof(T);
+	uint64_t pad = (column_alignment - bytes % column_alignment)
+		% column_alignment;
+	for( uint32_t c=0; c<header.ncolumns; ++c ) {
+		stream.write((const char*)columns[c], bytes);
+		stream.write(&padding[0], pad);
+	}
+	if( !stream ) {
+		throw std::runtime_error("Failed to write " + filename);
+	}
+}
+
+// Maps a snapshot file and checks its header
+class Reader {
+	MappedFile    m_file;
+	const Header* m_header;
+public:
+	Reader(std::string filename, const char* magic,
+	       uint32_t ncolumns, uint32_t element_size)
+		: m_file(filename),
+		  m_header((const Header*)m_file.begin()) {
+		if( m_file.size() < column_alignment ||
+		    memcmp(m_header->magic, magic, 8) != 0 ) {
+			throw std::runtime_error("Not a snapshot file: " + filename);
+		}
+		if( m_header->version != version ) {
+			throw std::runtime_error("Unsupported snapshot version in "
+			                         + filename);
+		}
+		if( m_header->byte_order   != byte_order_mark ||
+		    m_header->element_size != element_size ||
+		    m_header->ncolumns     != ncolumns ) {
+			throw std::runtime_error("Incompatible snapshot layout in "
+			                         + filename);
+		}
+		uint64_t bytes = m_header->count * element_size;
+		for( uint32_t c=0; c<ncolumns; ++c ) {
+			if( m_header->offsets[c] % column_alignment != 0 ||
+			    m_header->offsets[c] + bytes > m_file.size() ) {
+				throw std::runtime_error("Truncated snapshot file "
+				                         + filename);
+			}
+		}
+	}
+	size_t  count() const { return m_header->count; }
+	int64_t param() const { return m_header->param; }
+	template<typename T>
+	const T* column(uint32_t c) const {
+		return (const T*)(m_file.begin() + m_header->offsets[c]);
+	}
+};
+
+} // namespace snapshot
@@ -0,0 +1,163 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::endl;
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+#include <SantaGenerator.hpp>
+
+#include "stopwatch.hpp"
+
+// Returns true (and sets value) if arg is --name=value
+bool parse_option(const std::string& arg, const std::string& name,
+                  std::string* value) {
+	std::string prefix = "--" + name + "=";
+	if( arg.compare(0, prefix.size(), prefix) != 0 ) {
+		return false;
+	}
+	*value = arg.substr(prefix.size());
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	SantaGenerator::Params params;
+	bool binary = false;
+	std::vector<std::string> args;
+	for( int a=1; a<argc; ++a ) {
+		std::string arg = argv[a];
+		std::string value;
+		if( arg == "--binary" ) {
+			binary = true;
+		}
+		else if( parse_option(arg, "count", &value) ) {
+			params.count = strtoull(value.c_str(), 0, 10);
+		}
+		else if( parse_option(arg, "seed", &value) ) {
+			params.seed = strtoull(value.c_str(), 0, 10);
+		}
+		else if( parse_option(arg, "sleigh-size", &value) ) {
+			params.sleigh_size = atoi(value.c_str());
+		}
+		else if( parse_option(arg, "min-size", &value) ) {
+			params.min_size = atoi(value.c_str());
+		}
+		else if( parse_option(arg, "max-size", &value) ) {
+			params.max_size = atoi(value.c_str());
+		}
+		else if( parse_option(arg, "size-skew", &value) ) {
+			params.size_skew = atof(value.c_str());
+		}
+		else if( parse_option(arg, "layer-fill", &value) ) {
+			params.layer_fill = atof(value.c_str());
+		}
+		else if( parse_option(arg, "z-overlap", &value) ) {
+			params.z_overlap = atof(value.c_str());
+		}
+		else if( parse_option(arg, "collisions", &value) ) {
+			params.collision_fraction = atof(value.c_str());
+		}
+		else if( parse_option(arg, "boundary", &value) ) {
+			params.boundary_fraction = atof(value.c_str());
+		}
+		else if( parse_option(arg, "dimensions", &value) ) {
+			params.dimension_fraction = atof(value.c_str());
+		}
+		else {
+			args.push_back(arg);
+		}
+	}
+	if( args.size() < 2 ) {
+		cout << "Usage: " << argv[0] << " [options]"
+		     << " presents.(csv|bin) submissionfile.(csv|bin)" << endl;
+		cout << "  --count=N        No. presents (default 1000)" << endl;
+		cout << "  --seed=N         Random seed (default 0)" << endl;
+		cout << "  --sleigh-size=N  Sleigh width and height (default 1000)"
+		     << endl;
+		cout << "  --min-size=N     Smallest present side (default 2)" << endl;
+		cout << "  --max-size=N     Largest present side (default 250)"
+		     << endl;
+		cout << "  --size-skew=F    Sides are min + (max-min)*u^F"
+		     << " (default 1)" << endl;
+		cout << "  --layer-fill=F   Fraction of each layer's cells used"
+		     << " (default 1)" << endl;
+		cout << "  --z-overlap=F    Spread of cell z offsets as a fraction"
+		     << " of the layer height (default 0)" << endl;
+		cout << "  --collisions=F   Fraction of presents made to collide"
+		     << " (default 0)" << endl;
+		cout << "  --boundary=F     Fraction moved out of the sleigh"
+		     << " (default 0)" << endl;
+		cout << "  --dimensions=F   Fraction given the wrong dimensions"
+		     << " (default 0)" << endl;
+		cout << "  --binary         Write binary snapshots instead of csv"
+		     << endl;
+		return -1;
+	}
+	std::string presents_filename = args[0];
+	std::string solution_filename = args[1];
+	
+	Stopwatch timer;
+	timer.start();
+	
+	SantaProblem  problem;
+	SantaSolution solution;
+	try {
+		SantaGenerator generator(params);
+		generator.generate(&problem, &solution);
+		cout << "Generated " << problem.size() << " presents with "
+		     << generator.collisions() << " collisions, "
+		     << generator.boundary_violations() << " boundary violations and "
+		     << generator.dimension_mismatches() << " dimension mismatches"
+		     << endl;
+	}
+	catch( std::invalid_argument& e ) {
+		cerr << "Invalid parameters: " << e.what() << endl;
+		return -1;
+	}
+	
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+	cudaThreadSynchronize();
+#endif
+	timer.stop();
+	cout << "Generation time = " << timer.getTime() << " s" << endl;
+	
+	timer.reset();
+	timer.start();
+	if( binary ) {
+		problem.save_binary(presents_filename);
+		solution.save_binary(solution_filename);
+	}
+	else {
+		problem.save(presents_filename);
+		solution.save(solution_filename);
+	}
+	timer.stop();
+	cout << "Write time = " << timer.getTime() << " s" << endl;
+	
+	return 0;
+}
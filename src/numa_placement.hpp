@@ -0,0 +1,244 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+
+/*
+  NUMA-aware placement of the per-present columns for the OMP backend
+    nodes_cpus()             - the CPUs available to the process, grouped
+                               node by node
+    pin_threads()            - binds each OpenMP thread to one CPU, with
+                               consecutive threads on the same node
+    first_touch(p, bytes)    - faults in pages from the threads that will
+                               process them
+    first_touch_allocator<T> - thrust allocator that maps large blocks and
+                               places them with first_touch (and huge pages
+                               if SANTA_HUGE_PAGES=1 is set)
+    column_vector<T>::type   - the vector type for the columns, which uses
+                               first_touch_allocator in -DSANTA_NUMA builds
+                               of the OMP backend
+  Linux pages are placed on the node of the CPU that first writes them, and
+    thrust's OMP loops hand each thread the same static share of every
+    column, so once the threads are pinned each thread's share of the
+    columns stays local to it.
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+
+#include <thrust/device_vector.h>
+#include <thrust/device_malloc_allocator.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(SANTA_NUMA) && defined(__linux__) && \
+    THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_OMP
+#define SANTA_NUMA_COLUMNS
+#endif
+
+namespace numa {
+
+// Parses a sysfs cpu list such as "0-3,8-11"
+inline std::vector<int> parse_cpu_list(std::string list) {
+	std::vector<int> cpus;
+	std::istringstream stream(list);
+	std::string range;
+	while( std::getline(stream, range, ',') ) {
+		int first, last;
+		char dash;
+		std::istringstream fields(range);
+		if( !(fields >> first) ) {
+			continue;
+		}
+		if( !(fields >> dash >> last) ) {
+			last = first;
+		}
+		for( int cpu=first; cpu<=last; ++cpu ) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// Returns the CPUs that the process may run on, node by node
+// Note: Without NUMA information, all CPUs count as one node
+inline std::vector<int> nodes_cpus() {
+	std::vector<int> cpus;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if( sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ) {
+		return cpus;
+	}
+	for( int node=0; ; ++node ) {
+		std::ostringstream path;
+		path << "/sys/devices/system/node/node" << node << "/cpulist";
+		std::ifstream file(path.str().c_str());
+		std::string list;
+		if( !std::getline(file, list) ) {
+			break;
+		}
+		std::vector<int> node_cpus = parse_cpu_list(list);
+		for( size_t c=0; c<node_cpus.size(); ++c ) {
+			if( node_cpus[c] < CPU_SETSIZE && CPU_ISSET(node_cpus[c], &allowed) ) {
+				cpus.push_back(node_cpus[c]);
+			}
+		}
+	}
+	if( cpus.empty() ) {
+		for( int cpu=0; cpu<CPU_SETSIZE; ++cpu ) {
+			if( CPU_ISSET(cpu, &allowed) ) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+#endif
+	return cpus;
+}
+
+// Binds OpenMP thread t of n to CPU t*ncpus/n of nodes_cpus(), which
+//   spreads the threads evenly over the nodes and keeps neighbouring
+//   threads (and so neighbouring static shares of each loop) together
+// Returns the no. threads pinned (0 without OpenMP)
+// Note: This should be called before the columns are allocated, and
+//         holds for later parallel regions of the same size because the
+//         OpenMP runtime reuses its threads.
+inline int pin_threads() {
+	int npinned = 0;
+#if defined(_OPENMP) && defined(__linux__)
+	std::vector<int> cpus = nodes_cpus();
+	if( cpus.empty() ) {
+		return 0;
+	}
+#pragma omp parallel reduction(+:npinned)
+	{
+		size_t t = omp_get_thread_num();
+		size_t n = omp_get_num_threads();
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[t * cpus.size() / n], &set);
+		npinned += sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+#endif
+	return npinned;
+}
+
+// Writes to each page of [data, data+bytes) from the thread whose static
+//   share of a loop over the block covers it
+inline void first_touch(void* data, size_t bytes) {
+#ifdef __linux__
+	long page_size = sysconf(_SC_PAGESIZE);
+#else
+	long page_size = 4096;
+#endif
+	char* pages = (char*)data;
+	long npages = (long)((bytes + page_size-1) / page_size);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for( long p=0; p<npages; ++p ) {
+		pages[p*page_size] = 0;
+	}
+}
+
+inline bool huge_pages_requested() {
+	static const char* env = getenv("SANTA_HUGE_PAGES");
+	return env && *env && std::string(env) != "0";
+}
+
+// Allocates blocks of at least large_block bytes with mmap and places
+//   them with first_touch; smaller ones are not worth the system calls
+template<typename T>
+class first_touch_allocator : public thrust::device_malloc_allocator<T> {
+	typedef thrust::device_malloc_allocator<T> super_t;
+public:
+	typedef typename super_t::pointer   pointer;
+	typedef typename super_t::size_type size_type;
+	enum { large_block = 1 << 20 };
+	template<typename U>
+	struct rebind { typedef first_touch_allocator<U> other; };
+	first_touch_allocator() {}
+	first_touch_allocator(const first_touch_allocator& other)
+		: super_t(other) {}
+	template<typename U>
+	first_touch_allocator(const first_touch_allocator<U>&) {}
+	pointer allocate(size_type n) {
+		size_t bytes = n * sizeof(T);
+#ifdef __linux__
+		if( bytes >= large_block ) {
+			void* data = mmap(0, bytes, PROT_READ | PROT_WRITE,
+			                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if( data == MAP_FAILED ) {
+				throw std::bad_alloc();
+			}
+#ifdef MADV_HUGEPAGE
+			// Note: Only a hint; the kernel may still use small pages
+			if( huge_pages_requested() ) {
+				madvise(data, bytes, MADV_HUGEPAGE);
+			}
+#endif
+			first_touch(data, bytes);
+			return pointer((T*)data);
+		}
+#endif
+		return super_t::allocate(n);
+	}
+	void deallocate(pointer p, size_type n) {
+#ifdef __linux__
+		if( n * sizeof(T) >= large_block ) {
+			munmap(thrust::raw_pointer_cast(p), n * sizeof(T));
+			return;
+		}
+#endif
+		super_t::deallocate(p, n);
+	}
+};
+template<typename T, typename U>
+inline bool operator==(const first_touch_allocator<T>&,
+                       const first_touch_allocator<U>&) { return true; }
+template<typename T, typename U>
+inline bool operator!=(const first_touch_allocator<T>&,
+                       const first_touch_allocator<U>&) { return false; }
+
+} // namespace numa
+
+template<typename T>
+struct column_vector {
+#ifdef SANTA_NUMA_COLUMNS
+	typedef thrust::device_vector<T, numa::first_touch_allocator<T> > type;
+#else
+	typedef thrust::device_vector<T> type;
+#endif
+};
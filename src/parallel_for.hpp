@@ -0,0 +1,122 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+#pragma once
+
+/*
+  Parallel loops for the host-side code that runs outside Thrust (csv
+  parsing and writing, the validation index):
+    host_thread_count()  - no. threads that parallel_for uses
+    parallel_for(n, f)   - calls f(i) for each i in [0,n), handing out
+                           indices dynamically
+  OpenMP is used when it is enabled, otherwise std::thread.
+*/
+
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#else
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <exception>
+#endif
+
+// Note: The std::thread version also honours OMP_NUM_THREADS so that
+//         builds can be compared with the same settings
+inline int host_thread_count() {
+#if defined(_OPENMP)
+	return omp_get_max_threads();
+#else
+	const char* env = getenv("OMP_NUM_THREADS");
+	int nthreads = env ? atoi(env) : 0;
+	if( nthreads <= 0 ) {
+		nthreads = (int)std::thread::hardware_concurrency();
+	}
+	return nthreads > 0 ? nthreads : 1;
+#endif
+}
+
+#ifndef _OPENMP
+namespace detail {
+template<typename Function>
+struct parallel_for_worker {
+	size_t                    n;
+	Function*                 func;
+	std::atomic<size_t>*      next;
+	std::exception_ptr*       error;
+	std::atomic<bool>*        failed;
+	void operator()() const {
+		try {
+			size_t i;
+			while( !*failed && (i = (*next)++) < n ) {
+				(*func)(i);
+			}
+		}
+		catch( ... ) {
+			// Note: Only the first exception is kept
+			if( !failed->exchange(true) ) {
+				*error = std::current_exception();
+			}
+		}
+	}
+};
+} // namespace detail
+#endif
+
+template<typename Function>
+void parallel_for(size_t n, Function func) {
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
+	for( long i=0; i<(long)n; ++i ) {
+		func(i);
+	}
+#else
+	size_t nthreads = std::min(size_t(host_thread_count()), n);
+	if( nthreads <= 1 ) {
+		for( size_t i=0; i<n; ++i ) {
+			func(i);
+		}
+		return;
+	}
+	std::atomic<size_t> next(0);
+	std::atomic<bool>   failed(false);
+	std::exception_ptr  error;
+	detail::parallel_for_worker<Function> worker = {n, &func, &next,
+	                                                &error, &failed};
+	// Note: The calling thread does its share of the work
+	std::vector<std::thread> threads;
+	for( size_t t=1; t<nthreads; ++t ) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+	for( size_t t=0; t<threads.size(); ++t ) {
+		threads[t].join();
+	}
+	if( error ) {
+		std::rethrow_exception(error);
+	}
+#endif
+}
@@ -0,0 +1,111 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+/*
+  Runs one of the per-backend builds of a program, so that backends can be
+    chosen (and compared) at run time from a single command:
+      run_backend [--backend=omp|tbb|serial|cuda] program [args...]
+    e.g., run_backend --backend=tbb check_solution presents.csv soln.csv
+  The backend defaults to $SANTA_BACKEND, or else omp.
+  Note: Each backend's classes are compiled against a different Thrust
+          device system, so the builds are separate binaries
+          (<program>_<backend>) next to this one.
+*/
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::endl;
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+static const char* backends[] = {"omp", "tbb", "serial", "cuda"};
+static const int   nbackends  = sizeof(backends) / sizeof(backends[0]);
+
+// Returns the directory part of path (including the trailing '/')
+std::string dir_name(std::string path) {
+	size_t slash = path.rfind('/');
+	return (slash == std::string::npos) ? "./" : path.substr(0, slash+1);
+}
+
+// Returns the directory holding this executable (including the trailing '/')
+// Note: argv[0] is only a guess (it has no directory when run from $PATH,
+//         and the caller may set it to anything), so the kernel's link to
+//         the running executable is used where there is one
+std::string exe_dir(const char* argv0) {
+	std::vector<char> path(4096);
+	ssize_t len = readlink("/proc/self/exe", &path[0], path.size());
+	if( len <= 0 || (size_t)len >= path.size() ) {
+		return dir_name(argv0);
+	}
+	return dir_name(std::string(&path[0], len));
+}
+
+int main(int argc, char* argv[])
+{
+	std::string backend = getenv("SANTA_BACKEND") ? getenv("SANTA_BACKEND")
+	                                              : "omp";
+	int a = 1;
+	if( a < argc && strncmp(argv[a], "--backend=", 10) == 0 ) {
+		backend = argv[a] + 10;
+		++a;
+	}
+	if( a >= argc ) {
+		cout << "Usage: " << argv[0] << " [--backend=(omp|tbb|serial|cuda)]"
+		     << " program [args...]" << endl;
+		cout << "  e.g., " << argv[0] << " --backend=tbb check_solution"
+		     << " presents.csv submissionfile.csv" << endl;
+		cout << "  The backend defaults to $SANTA_BACKEND, or else omp"
+		     << endl;
+		return -1;
+	}
+	std::string dir     = exe_dir(argv[0]);
+	std::string program = argv[a];
+	std::string path    = dir + program + "_" + backend;
+	if( access(path.c_str(), X_OK) != 0 ) {
+		cerr << "No " << backend << " build of " << program
+		     << " (" << path << ")" << endl;
+		cerr << "Available backends:";
+		for( int b=0; b<nbackends; ++b ) {
+			std::string other = dir + program + "_" + backends[b];
+			if( access(other.c_str(), X_OK) == 0 ) {
+				cerr << " " << backends[b];
+			}
+		}
+		cerr << endl;
+		return -1;
+	}
+	std::vector<char*> args;
+	args.push_back(const_cast<char*>(path.c_str()));
+	for( int i=a+1; i<argc; ++i ) {
+		args.push_back(argv[i]);
+	}
+	args.push_back(0);
+	execv(path.c_str(), &args[0]);
+	cerr << "Failed to run " << path << ": " << strerror(errno) << endl;
+	return -1;
+}
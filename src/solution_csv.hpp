@@ -0,0 +1,91 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+/*
+  Parsing of solution csv rows, shared by the in-memory and streaming loaders
+    max8, min8          - extrema of a present's 8 vertex coordinates
+    solution_row_parser - parses one row into ID and extrema columns
+*/
+
+#pragma once
+
+#include <algorithm>
+
+#include <SantaSolution.hpp>
+#include "file_io.hpp"
+
+template<typename T>
+inline __host__ __device__
+T max8(T z1, T z2, T z3, T z4, T z5, T z6, T z7, T z8) {
+	// Note: Hierarchical method maximises instruction-level parallelism
+	//         (at the cost of a couple more registers per thread)
+	using std::max;
+	T max_a, max_b, max_c;
+	max_a = max(z1, z2);
+	max_b = max(z3, z4);
+	max_c = max(max_a, max_b);
+	max_a = max(z5, z6);
+	max_b = max(z7, z8);
+	return max( max_c, max(max_a, max_b) );
+}
+
+template<typename T>
+inline __host__ __device__
+T min8(T z1, T z2, T z3, T z4, T z5, T z6, T z7, T z8) {
+	// Note: Hierarchical method maximises instruction-level parallelism
+	//         (at the cost of a couple more registers per thread)
+	using std::min;
+	T min_a, min_b, min_c;
+	min_a = min(z1, z2);
+	min_b = min(z3, z4);
+	min_c = min(min_a, min_b);
+	min_a = min(z5, z6);
+	min_b = min(z7, z8);
+	return min( min_c, min(min_a, min_b) );
+}
+
+// Parses one solution row straight into the ID and extrema columns
+struct solution_row_parser {
+	typedef SantaSolution::dtype dtype;
+	dtype* ids;
+	dtype* xminima; dtype* xmaxima;
+	dtype* yminima; dtype* ymaxima;
+	dtype* zminima; dtype* zmaxima;
+	inline void operator()(size_t i, const char* begin, const char* end) const {
+		csv::RowReader row(begin, end);
+		// Note: Converts 1-based to 0-based indexing
+		ids[i] = row.next<dtype>() - 1;
+		dtype x[8], y[8], z[8];
+		for( int v=0; v<8; ++v ) {
+			x[v] = row.next<dtype>();
+			y[v] = row.next<dtype>();
+			z[v] = row.next<dtype>();
+		}
+		// Convert 8 vertices to 2 extrema for each coordinate
+		xminima[i] = min8(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7]);
+		xmaxima[i] = max8(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7]);
+		yminima[i] = min8(y[0],y[1],y[2],y[3],y[4],y[5],y[6],y[7]);
+		ymaxima[i] = max8(y[0],y[1],y[2],y[3],y[4],y[5],y[6],y[7]);
+		zminima[i] = min8(z[0],z[1],z[2],z[3],z[4],z[5],z[6],z[7]);
+		zmaxima[i] = max8(z[0],z[1],z[2],z[3],z[4],z[5],z[6],z[7]);
+	}
+};
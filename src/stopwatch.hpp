@@ -4,6 +4,15 @@
 // includes, system
 #include <ctime>
 #include <sys/time.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <utility>
+#include <atomic>
+#include <mutex>
 
 // Note: This is currently Linux-specific!
 class Stopwatch
@@ -140,4 +149,394 @@ Stopwatch::getDiffTime() const
                 + (0.001 * (t_time.tv_usec - start_time.tv_usec)) );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//! Hierarchical profiler
+//!
+//! PROFILE_SCOPE("name") times the rest of the enclosing scope as a region
+//! nested inside whichever region is currently open, and the profiler keeps
+//! per-region call counts and total/min/max times. Define DISABLE_PROFILER
+//! to compile all regions out. Timing is disabled until setEnabled(true).
+//! Each thread records its regions in a tree of its own, without locking, so
+//! regions may be opened from many threads at once; a thread's regions nest
+//! under the regions that thread has open (or under the root). The trees are
+//! merged by region name when the regions are read.
+//! Note: reset must not be called while any region is open, and regions()
+//!       (and the print functions) must only be called once they have all
+//!       closed. Device work is only included if the region's code waits
+//!       for it.
+////////////////////////////////////////////////////////////////////////////////
+class Profiler
+{
+public:
+    struct Region {
+        std::string      name;
+        int              parent;
+        std::vector<int> children;
+        long             calls;
+        double           total_time; // Seconds
+        double           min_time;
+        double           max_time;
+    };
+
+    //! The process-wide profiler
+    static inline Profiler& instance();
+
+    //! Open the region called name within the calling thread's current
+    //! region, returning its index in that thread's tree
+    inline int  enter(const char* name);
+
+    //! Close the calling thread's current region (which must be index),
+    //! adding seconds to it
+    inline void leave(int index, double seconds);
+
+    //! Enable or disable timing at run time (disabled by default)
+    inline void setEnabled(bool enabled) { m_enabled.store(enabled); }
+    inline bool enabled() const          { return m_enabled.load(); }
+
+    //! Discard all regions and their times
+    inline void reset();
+
+    //! The regions of all threads merged by name, with each region's children
+    //! in order of first entry; region 0 is the root
+    //! Note: Rebuilt on each call; earlier references stay valid while no
+    //!         new regions have been entered
+    inline const std::vector<Region>& regions() const;
+
+    //! Print the regions as an indented table (times in ms)
+    inline void printTable(std::ostream& os) const;
+
+    //! Print the regions as nested JSON objects (times in s)
+    inline void printJSON(std::ostream& os) const;
+
+    //! Current time in seconds from an arbitrary origin
+    static inline double now();
+
+private:
+    struct Node {
+        Region      region;
+        const char* key;   // The name pointer the region was entered with
+        double      first; // Time of first entry
+    };
+    typedef std::vector<Node> Tree;
+    struct ThreadTree {
+        Tree tree;
+        int  current; // Innermost open region
+    };
+    //! Hands the calling thread's tree over to the profiler when it exits
+    struct ThreadHandle {
+        ThreadTree* tree;
+        ThreadHandle() : tree(0) {}
+        inline ~ThreadHandle();
+    };
+
+    std::vector<ThreadTree*>    m_threads; // Trees of running threads
+    Tree                        m_retired; // Merged trees of exited threads
+    mutable std::vector<Region> m_regions;
+    mutable std::mutex          m_mutex;
+    std::atomic<bool>           m_enabled;
+
+    Profiler() : m_enabled(false) { reset(); }
+    //! The calling thread's tree, created on first use
+    inline ThreadTree& threadTree();
+    static inline int  addNode(Tree& tree, const std::string& name,
+                               const char* key, int parent, double first);
+    static inline void clearTree(Tree& tree);
+    static inline void mergeTree(const Tree& src, int s, Tree& dst, int d);
+    static inline int  flattenTree(const Tree& tree, int index, int parent,
+                                   std::vector<Region>& regions);
+    inline void printTableRows(std::ostream& os, int index, int depth) const;
+    inline void printJSONRegion(std::ostream& os, int index, int depth) const;
+};
+
+//! Times the enclosing scope as a Profiler region
+class ScopedTimer
+{
+    int    m_index;
+    double m_start;
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+public:
+    explicit ScopedTimer(const char* name) : m_index(-1) {
+        Profiler& profiler = Profiler::instance();
+        if( profiler.enabled() ) {
+            m_index = profiler.enter(name);
+            m_start = Profiler::now();
+        }
+    }
+    ~ScopedTimer() {
+        if( m_index >= 0 ) {
+            Profiler::instance().leave(m_index, Profiler::now() - m_start);
+        }
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b)  PROFILE_CONCAT_(a, b)
+#ifdef DISABLE_PROFILER
+#define PROFILE_SCOPE(name)
+#else
+#define PROFILE_SCOPE(name) \
+    ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#endif
+
+Profiler&
+Profiler::instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::ThreadHandle::~ThreadHandle() {
+    if( !tree ) {
+        return;
+    }
+    Profiler& profiler = Profiler::instance();
+    std::lock_guard<std::mutex> lock(profiler.m_mutex);
+    mergeTree(tree->tree, 0, profiler.m_retired, 0);
+    for( size_t t=0; t<profiler.m_threads.size(); ++t ) {
+        if( profiler.m_threads[t] == tree ) {
+            profiler.m_threads.erase(profiler.m_threads.begin() + t);
+            break;
+        }
+    }
+    delete tree;
+}
+
+Profiler::ThreadTree&
+Profiler::threadTree() {
+    static thread_local ThreadHandle handle;
+    if( !handle.tree ) {
+        ThreadTree* tree = new ThreadTree;
+        clearTree(tree->tree);
+        tree->current = 0;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_threads.push_back(tree);
+        handle.tree = tree;
+    }
+    return *handle.tree;
+}
+
+int
+Profiler::addNode(Tree& tree, const std::string& name, const char* key,
+                  int parent, double first) {
+    Node node;
+    node.region.name       = name;
+    node.region.parent     = parent;
+    node.region.calls      = 0;
+    node.region.total_time = 0;
+    node.region.min_time   = 0;
+    node.region.max_time   = 0;
+    node.key               = key;
+    node.first             = first;
+    int index = (int)tree.size();
+    tree.push_back(node);
+    if( index != parent ) {
+        tree[parent].region.children.push_back(index);
+    }
+    return index;
+}
+
+void
+Profiler::clearTree(Tree& tree) {
+    tree.clear();
+    addNode(tree, "total", 0, 0, 0);
+}
+
+int
+Profiler::enter(const char* name) {
+    ThreadTree& thread = threadTree();
+    Tree& tree = thread.tree;
+    int parent = thread.current;
+    const std::vector<int>& children = tree[parent].region.children;
+    // Note: Names are string literals, so the pointer nearly always matches;
+    //         the strings are only compared for literals from other units
+    for( size_t c=0; c<children.size(); ++c ) {
+        if( tree[children[c]].key == name ) {
+            return thread.current = children[c];
+        }
+    }
+    for( size_t c=0; c<children.size(); ++c ) {
+        if( strcmp(tree[children[c]].region.name.c_str(), name) == 0 ) {
+            return thread.current = children[c];
+        }
+    }
+    return thread.current = addNode(tree, name, name, parent, now());
+}
+
+void
+Profiler::leave(int index, double seconds) {
+    ThreadTree& thread = threadTree();
+    Region& region = thread.tree[index].region;
+    if( region.calls == 0 || seconds < region.min_time ) {
+        region.min_time = seconds;
+    }
+    if( region.calls == 0 || seconds > region.max_time ) {
+        region.max_time = seconds;
+    }
+    region.total_time += seconds;
+    ++region.calls;
+    thread.current = region.parent;
+}
+
+void
+Profiler::reset() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for( size_t t=0; t<m_threads.size(); ++t ) {
+        clearTree(m_threads[t]->tree);
+        m_threads[t]->current = 0;
+    }
+    clearTree(m_retired);
+    m_regions.clear();
+}
+
+// Adds the times of src's descendants of s to the matching regions under
+//   d in dst, creating any that are missing
+void
+Profiler::mergeTree(const Tree& src, int s, Tree& dst, int d) {
+    const std::vector<int>& children = src[s].region.children;
+    for( size_t c=0; c<children.size(); ++c ) {
+        const Node& from = src[children[c]];
+        int to = -1;
+        const std::vector<int>& existing = dst[d].region.children;
+        for( size_t e=0; e<existing.size(); ++e ) {
+            if( dst[existing[e]].region.name == from.region.name ) {
+                to = existing[e];
+                break;
+            }
+        }
+        if( to < 0 ) {
+            to = addNode(dst, from.region.name, 0, d, from.first);
+        }
+        Node& node = dst[to];
+        const Region& r = from.region;
+        if( r.calls > 0 ) {
+            if( node.region.calls == 0 || r.min_time < node.region.min_time ) {
+                node.region.min_time = r.min_time;
+            }
+            if( node.region.calls == 0 || r.max_time > node.region.max_time ) {
+                node.region.max_time = r.max_time;
+            }
+        }
+        node.region.calls      += r.calls;
+        node.region.total_time += r.total_time;
+        node.first = std::min(node.first, from.first);
+        mergeTree(src, children[c], dst, to);
+    }
+}
+
+// Appends tree's region index and its descendants to regions, ordering
+//   each region's children by first entry, and returns its new index
+int
+Profiler::flattenTree(const Tree& tree, int index, int parent,
+                      std::vector<Region>& regions) {
+    int flat = (int)regions.size();
+    regions.push_back(tree[index].region);
+    regions[flat].parent = parent;
+    regions[flat].children.clear();
+    std::vector<std::pair<double, int> > children;
+    const std::vector<int>& unordered = tree[index].region.children;
+    for( size_t c=0; c<unordered.size(); ++c ) {
+        children.push_back(std::make_pair(tree[unordered[c]].first,
+                                          unordered[c]));
+    }
+    std::sort(children.begin(), children.end());
+    for( size_t c=0; c<children.size(); ++c ) {
+        int child = flattenTree(tree, children[c].second, flat, regions);
+        regions[flat].children.push_back(child);
+    }
+    return flat;
+}
+
+const std::vector<Profiler::Region>&
+Profiler::regions() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Tree merged;
+    clearTree(merged);
+    mergeTree(m_retired, 0, merged, 0);
+    for( size_t t=0; t<m_threads.size(); ++t ) {
+        mergeTree(m_threads[t]->tree, 0, merged, 0);
+    }
+    std::vector<Region> regions;
+    flattenTree(merged, 0, 0, regions);
+    // Note: Assigning (rather than swapping) reuses the existing elements
+    m_regions = regions;
+    return m_regions;
+}
+
+void
+Profiler::printTable(std::ostream& os) const {
+    std::ios::fmtflags flags     = os.flags();
+    std::streamsize    precision = os.precision();
+    os << std::left << std::setw(40) << "Region" << std::right
+       << std::setw(8)  << "Calls"
+       << std::setw(12) << "Total(ms)"
+       << std::setw(12) << "Mean(ms)"
+       << std::setw(12) << "Min(ms)"
+       << std::setw(12) << "Max(ms)" << "\n";
+    const std::vector<int>& top = regions()[0].children;
+    for( size_t c=0; c<top.size(); ++c ) {
+        printTableRows(os, top[c], 0);
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void
+Profiler::printTableRows(std::ostream& os, int index, int depth) const {
+    const Region& r = m_regions[index];
+    std::string name = std::string(2*depth, ' ') + r.name;
+    double mean = r.calls ? r.total_time / r.calls : 0;
+    os << std::left << std::setw(40) << name << std::right
+       << std::setw(8) << r.calls << std::fixed << std::setprecision(3)
+       << std::setw(12) << 1e3 * r.total_time
+       << std::setw(12) << 1e3 * mean
+       << std::setw(12) << 1e3 * r.min_time
+       << std::setw(12) << 1e3 * r.max_time << "\n";
+    for( size_t c=0; c<r.children.size(); ++c ) {
+        printTableRows(os, r.children[c], depth+1);
+    }
+}
+
+void
+Profiler::printJSON(std::ostream& os) const {
+    std::ios::fmtflags flags     = os.flags();
+    std::streamsize    precision = os.precision();
+    os << "[";
+    const std::vector<int>& top = regions()[0].children;
+    for( size_t c=0; c<top.size(); ++c ) {
+        os << (c ? ",\n" : "\n");
+        printJSONRegion(os, top[c], 1);
+    }
+    os << "\n]\n";
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void
+Profiler::printJSONRegion(std::ostream& os, int index, int depth) const {
+    const Region& r = m_regions[index];
+    std::string indent(2*depth, ' ');
+    double mean = r.calls ? r.total_time / r.calls : 0;
+    // Note: Region names are string literals without quotes or escapes
+    os << indent << "{\"name\": \"" << r.name << "\", \"calls\": " << r.calls
+       << std::scientific << std::setprecision(6)
+       << ", \"total\": " << r.total_time << ", \"mean\": " << mean
+       << ", \"min\": " << r.min_time << ", \"max\": " << r.max_time
+       << ", \"children\": [";
+    for( size_t c=0; c<r.children.size(); ++c ) {
+        os << (c ? ",\n" : "\n");
+        printJSONRegion(os, r.children[c], depth+1);
+    }
+    if( !r.children.empty() ) {
+        os << "\n" << indent;
+    }
+    os << "]}";
+}
+
+double
+Profiler::now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
 #endif // _STOPWATCH_H
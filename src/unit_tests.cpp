@@ -26,9 +26,30 @@ using std::endl;
 #include <string>
 #include <fstream>
 #include <cassert>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include <csignal>
 
 #include <SantaProblem.hpp>
 #include <SantaSolution.hpp>
+#include <SantaValidationIndex.hpp>
+#include <SantaScoreContext.hpp>
+#include <SantaBatch.hpp>
+#include <SantaGenerator.hpp>
+#include <SantaWorkspace.hpp>
+#include <SantaStreamValidator.hpp>
+#include <SantaShardedValidator.hpp>
+
+#include "stopwatch.hpp"
+#include "box_sweep.hpp"
+#include "parallel_for.hpp"
+#include "validation_server.hpp"
+#include "numa_placement.hpp"
+#include "compressed_io.hpp"
 
 void test_SantaProblem() {
 	cout << "Generating test problem data" << endl;
@@ -67,6 +88,29 @@ void test_SantaProblem() {
 	assert( *problem.widths_begin()  == 1 );
 	assert( *problem.heights_begin() == 2 );
 	assert( *problem.depths_begin()  == 3 );
+	
+	assert( !SantaProblem::is_binary(presents_filename) );
+	problem.save_binary(presents_filename);
+	assert( SantaProblem::is_binary(presents_filename) );
+	SantaProblem snapshot;
+	assert( snapshot.load_binary(presents_filename) == 5 );
+	assert( snapshot.sleigh_size() == sleigh_size+1 );
+	assert( snapshot[0] == problem[0] );
+	assert( snapshot[4] == problem[4] );
+	
+	// Dimensions that do not fit the storage type are rejected on load
+	presents_stream.open(presents_filename.c_str());
+	presents_stream << "id,width,height,depth" << endl;
+	presents_stream << "1,40000,1,1" << endl;
+	presents_stream.close();
+	bool rejected = false;
+	try {
+		SantaProblem big(sleigh_size, presents_filename);
+	}
+	catch( std::out_of_range& ) {
+		rejected = true;
+	}
+	assert( rejected == (sizeof(SantaProblem::stype) < sizeof(int)) );
 	cout << "  Tests PASSED" << endl;
 	remove(presents_filename.c_str());
 }
@@ -147,17 +191,989 @@ void test_SantaSolution() {
 	assert( dimension_mismatches == 1 );
 	assert( collisions == 1 );
 	assert( !valid );
+	assert( solution.count_collisions(SantaSolution::COLLISIONS_SWEEP) == 1 );
+	assert( solution.count_collisions(SantaSolution::COLLISIONS_GRID)  == 1 );
+	std::vector<int> ids_a, ids_b;
+	assert( solution.find_collisions(10, &ids_a, &ids_b) == 1 );
+	assert( ids_a.size() == 1 && ids_a[0] == 0 && ids_b[0] == 1 );
+	assert( solution.find_collisions(0, &ids_a, &ids_b) == 1 );
+	assert( ids_a.empty() && ids_b.empty() );
+	std::vector<int>           flagged;
+	std::vector<unsigned char> flags;
+	assert( solution.find_violations(problem, 10, &flagged, &flags) == 1 );
+	assert( flagged.size() == 1 && flagged[0] == 1 );
+	assert( flags[0] == (SantaSolution::VIOLATES_BOUNDS |
+	                     SantaSolution::VIOLATES_DIMENSIONS) );
 	
 	assert( solution.score() == 62 );
 	
+	// Repeated validations reuse the cached temporary storage
+	SantaWorkspace workspace;
+	solution.validate(problem, false, 0, 0, 0, 0, &workspace);
+	solution.count_collisions(SantaSolution::COLLISIONS_GRID, &workspace);
+	size_t allocations = workspace.allocator().stats().allocations;
+	size_t reuses      = workspace.allocator().stats().reuses;
+	for( int r=0; r<3; ++r ) {
+		solution.validate(problem, false, 0, 0, 0, 0, &workspace);
+		solution.count_collisions(SantaSolution::COLLISIONS_GRID, &workspace);
+		solution.score(&workspace);
+	}
+	assert( workspace.allocator().stats().allocations == allocations );
+	assert( workspace.allocator().stats().reuses > reuses );
+	assert( workspace.allocator().stats().bytes_in_use == 0 );
+	
+	solution.save_binary(solution_filename);
+	assert( SantaSolution::is_binary(solution_filename) );
+	SantaSolution snapshot;
+	assert( snapshot.load_binary(solution_filename) == 2 );
+	assert( snapshot[0] == solution[0] );
+	assert( snapshot[1] == solution[1] );
+	assert( snapshot.score() == 62 );
+	
+	// Reverse the score order so that the ordering term overflows 32 bits
+	int n = 100000;
+	SantaSolution reversed(n);
+	for( int i=0; i<n; ++i ) {
+		thrust::get<5>(reversed[i]) = i+1;
+	}
+	assert( reversed.score() == 2*(SantaSolution::score_type)n +
+	                            (SantaSolution::score_type)n*n/2 );
+	
 	cout << "  Tests PASSED" << endl;
 	remove(solution_filename.c_str());
 }
 
+// Brute-force check of whether presents a and b intersect
+bool presents_collide(const SantaSolution& solution, int a, int b) {
+	using thrust::get;
+	thrust::tuple<int,int,int,int,int,int> s = solution[a];
+	thrust::tuple<int,int,int,int,int,int> t = solution[b];
+	// Note: extrema define *closed* intervals
+	return !(get<1>(s) < get<0>(t) || get<1>(t) < get<0>(s) ||
+	         get<3>(s) < get<2>(t) || get<3>(t) < get<2>(s) ||
+	         get<5>(s) < get<4>(t) || get<5>(t) < get<4>(s));
+}
+
+void test_SantaValidationIndex() {
+	cout << "Testing class SantaValidationIndex" << endl;
+	// Randomly place presents in a small volume so that there are many
+	//   collisions and boundary violations
+	int n = 200;
+	SantaProblem  problem(40, n);
+	SantaSolution solution(n);
+	srand(1234);
+	for( int i=0; i<n; ++i ) {
+		int w = 1 + rand() % 8, h = 1 + rand() % 8, d = 1 + rand() % 8;
+		problem[i] = thrust::make_tuple(w, h, d);
+		int x = rand() % 40, y = rand() % 40, z = rand() % 40;
+		solution[i] = thrust::make_tuple(x, x+w-1, y, y+h-1, z, z+d-1);
+	}
+	SantaValidationIndex index(problem, solution);
+	int expected[4], actual[4];
+	for( int step=0; step<50; ++step ) {
+		int valid = solution.validate(problem, false, &expected[0],
+		                              &expected[1], &expected[2], &expected[3]);
+		assert( index.validate(&actual[0], &actual[1],
+		                       &actual[2], &actual[3]) == valid );
+		for( int k=0; k<4; ++k ) {
+			assert( actual[k] == expected[k] );
+		}
+		assert( solution.count_collisions(SantaSolution::COLLISIONS_GRID)
+		        == expected[3] );
+		assert( solution.count_collisions(SantaSolution::COLLISIONS_SWEEP_BALANCED)
+		        == expected[3] );
+		std::vector<int> ids_a, ids_b;
+		size_t max_pairs = 16;
+		assert( solution.find_collisions(max_pairs, &ids_a, &ids_b)
+		        == (size_t)expected[3] );
+		assert( ids_a.size() == std::min(max_pairs, (size_t)expected[3]) );
+		for( size_t p=0; p<ids_a.size(); ++p ) {
+			assert( ids_a[p] < ids_b[p] );
+			assert( presents_collide(solution, ids_a[p], ids_b[p]) );
+		}
+		// Move a few presents (with a repeated ID and the odd wrong size)
+		int ids[4], x0[4], x1[4], y0[4], y1[4], z0[4], z1[4];
+		for( int k=0; k<4; ++k ) {
+			ids[k] = (k == 3) ? ids[0] : rand() % n;
+			int w = 1 + rand() % 8, h = 1 + rand() % 8, d = 1 + rand() % 8;
+			x0[k] = rand() % 40; x1[k] = x0[k] + w-1;
+			y0[k] = rand() % 40; y1[k] = y0[k] + h-1;
+			z0[k] = rand() % 40; z1[k] = z0[k] + d-1;
+		}
+		for( int k=0; k<4; ++k ) {
+			solution[ids[k]] = thrust::make_tuple(x0[k], x1[k], y0[k], y1[k],
+			                                      z0[k], z1[k]);
+		}
+		index.update(4, ids, x0, x1, y0, y1, z0, z1);
+	}
+	// An update with an out-of-range ID is rejected without affecting
+	//   later ones
+	int ids[2] = {0, n};
+	int lo[2]  = {1, 1}, hi[2] = {41, 41};
+	bool threw = false;
+	try {
+		index.update(2, ids, lo, hi, lo, hi, lo, hi);
+	}
+	catch( std::out_of_range& ) {
+		threw = true;
+	}
+	assert( threw );
+	index.update(1, ids, lo, hi, lo, hi, lo, hi);
+	solution[0] = thrust::make_tuple(1, 41, 1, 41, 1, 41);
+	int valid = solution.validate(problem, false, &expected[0],
+	                              &expected[1], &expected[2], &expected[3]);
+	assert( index.validate(&actual[0], &actual[1],
+	                       &actual[2], &actual[3]) == valid );
+	for( int k=0; k<4; ++k ) {
+		assert( actual[k] == expected[k] );
+	}
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_SantaScoreContext() {
+	cout << "Testing class SantaScoreContext" << endl;
+	int n = 300;
+	SantaSolution solution(n);
+	srand(4321);
+	for( int i=0; i<n; ++i ) {
+		// Note: Few distinct zmax values so that there are many ties
+		int z = 1 + rand() % 20;
+		solution[i] = thrust::make_tuple(1, 2, 1, 2, z, z+rand() % 10);
+	}
+	SantaScoreContext context(solution);
+	assert( context.score() == solution.score() );
+	for( int step=0; step<200; ++step ) {
+		int count = 1 + rand() % 4;
+		int ids[4], zmaxima[4];
+		for( int k=0; k<count; ++k ) {
+			ids[k] = (k == 3) ? ids[0] : rand() % n;
+			zmaxima[k] = 1 + rand() % 32;
+		}
+		SantaScoreContext::score_type before = context.score();
+		SantaScoreContext::score_type delta = context.delta(count, ids, zmaxima);
+		assert( context.score() == before );
+		assert( context.update(count, ids, zmaxima) == delta );
+		for( int k=0; k<count; ++k ) {
+			thrust::get<5>(solution[ids[k]]) = zmaxima[k];
+		}
+		assert( context.score() == before + delta );
+		assert( context.score() == solution.score() );
+	}
+	// A move with an out-of-range ID is rejected without affecting later ones
+	int bad_ids[3]     = {n, 5, 6};
+	int bad_zmaxima[3] = {1, 40, 41};
+	bool threw = false;
+	try {
+		context.delta(3, bad_ids, bad_zmaxima);
+	}
+	catch( std::out_of_range& ) {
+		threw = true;
+	}
+	assert( threw );
+	SantaScoreContext::score_type before = context.score();
+	SantaScoreContext::score_type delta = context.update(2, bad_ids+1,
+	                                                     bad_zmaxima+1);
+	thrust::get<5>(solution[5]) = 40;
+	thrust::get<5>(solution[6]) = 41;
+	assert( context.score() == before + delta );
+	assert( context.score() == solution.score() );
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_SantaBatch() {
+	cout << "Testing class SantaBatch" << endl;
+	int n = 100;
+	SantaProblem problem(30, n);
+	srand(2468);
+	for( int i=0; i<n; ++i ) {
+		problem[i] = thrust::make_tuple(1 + rand() % 6, 1 + rand() % 6,
+		                                1 + rand() % 6);
+	}
+	// Random solutions of various sizes (including empty and oversized)
+	int sizes[] = {n, n, 0, n-7, n, n+5};
+	int nsolutions = 6;
+	std::vector<SantaSolution> solutions;
+	SantaBatch batch;
+	for( int k=0; k<nsolutions; ++k ) {
+		SantaSolution solution(sizes[k]);
+		for( int i=0; i<sizes[k]; ++i ) {
+			int w = 1 + rand() % 6, h = 1 + rand() % 6, d = 1 + rand() % 6;
+			int x = rand() % 30, y = rand() % 30, z = rand() % (10 + 10*k);
+			solution[i] = thrust::make_tuple(x, x+w-1, y, y+h-1, z, z+d-1);
+		}
+		solutions.push_back(solution);
+		assert( batch.push_back(solution) == (size_t)k );
+	}
+	assert( batch.size() == (size_t)nsolutions );
+	std::vector<SantaBatch::Result> results;
+	size_t nvalid = batch.evaluate(problem, &results);
+	assert( results.size() == (size_t)nsolutions );
+	size_t expected_nvalid = 0;
+	for( int k=0; k<nsolutions; ++k ) {
+		int expected[4];
+		int valid = solutions[k].validate(problem, false, &expected[0],
+		                                  &expected[1], &expected[2],
+		                                  &expected[3]);
+		expected_nvalid += valid;
+		assert( results[k].valid                == (bool)valid );
+		assert( results[k].size_difference      == expected[0] );
+		assert( results[k].boundary_violations  == expected[1] );
+		assert( results[k].dimension_mismatches == expected[2] );
+		assert( results[k].collisions           == expected[3] );
+		if( sizes[k] > 0 ) {
+			assert( results[k].score == solutions[k].score() );
+		}
+	}
+	assert( nvalid == expected_nvalid );
+	batch.clear();
+	assert( batch.size() == 0 && batch.evaluate(problem, &results) == 0 );
+	
+	// Large, overlapping solutions whose sweep tiles span several solutions
+	SantaGenerator::Params params;
+	params.count     = 20000;
+	params.min_size  = 1;
+	params.max_size  = 100;
+	params.z_overlap = 0.7;
+	solutions.clear();
+	for( int k=0; k<4; ++k ) {
+		params.seed               = 11 + k;
+		params.collision_fraction = 0.02 * k;
+		SantaProblem  generated_problem;
+		SantaSolution solution;
+		SantaGenerator(params).generate(&generated_problem, &solution);
+		solutions.push_back(solution);
+		batch.push_back(solution);
+		if( k == 1 ) {
+			solutions.push_back(SantaSolution());
+			batch.push_back(SantaSolution());
+		}
+	}
+	batch.evaluate(problem, &results);
+	for( size_t k=0; k<solutions.size(); ++k ) {
+		assert( results[k].collisions == solutions[k].count_collisions() );
+		if( solutions[k].size() > 0 ) {
+			assert( results[k].score == solutions[k].score() );
+		}
+	}
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_SantaGenerator() {
+	cout << "Testing class SantaGenerator" << endl;
+	SantaGenerator::Params params;
+	params.count     = 20000;
+	params.min_size  = 1;
+	params.max_size  = 100;
+	params.z_overlap = 0.7;
+	params.seed      = 99;
+	SantaProblem  problem;
+	SantaSolution solution;
+	SantaGenerator(params).generate(&problem, &solution);
+	assert( problem.size() == params.count && solution.size() == params.count );
+	assert( solution.validate(problem) );
+	
+	params.layer_fill         = 0.3;
+	params.collision_fraction = 0.01;
+	params.boundary_fraction  = 0.02;
+	params.dimension_fraction = 0.03;
+	SantaGenerator generator(params);
+	assert( generator.collisions()           == 200 );
+	assert( generator.boundary_violations()  == 400 );
+	assert( generator.dimension_mismatches() == 600 );
+	generator.generate(&problem, &solution);
+	int size_difference, boundary_violations,
+		dimension_mismatches, collisions;
+	solution.validate(problem, false, &size_difference, &boundary_violations,
+	                  &dimension_mismatches, &collisions);
+	assert( size_difference      == 0 );
+	assert( boundary_violations  == 400 );
+	assert( dimension_mismatches == 600 );
+	assert( collisions           == 200 );
+	assert( solution.count_collisions(SantaSolution::COLLISIONS_SWEEP) == 200 );
+	// Generation depends only on the params
+	SantaSolution again;
+	generator.generate(0, &again);
+	assert( again[12345] == solution[12345] );
+	cout << "  Tests PASSED" << endl;
+}
+
+// Validates and scores a shared solution, alternating between an explicit
+//   workspace and the global pool
+struct concurrent_query {
+	const SantaProblem*  problem;
+	const SantaSolution* solution;
+	std::vector<int>*                       collisions;
+	std::vector<SantaSolution::score_type>* scores;
+	void operator()(size_t i) const {
+		SantaWorkspace  own;
+		SantaWorkspace* workspace = i % 2 ? &own : 0;
+		int c;
+		solution->validate(*problem, false, 0, 0, 0, &c, workspace);
+		(*collisions)[i] = c;
+		(*scores)[i]     = solution->score(workspace);
+	}
+};
+void test_SantaWorkspace() {
+	cout << "Testing class SantaWorkspace" << endl;
+	SantaWorkspacePool pool;
+	SantaWorkspace* a = pool.acquire();
+	SantaWorkspace* b = pool.acquire();
+	assert( a != b && pool.idle() == 0 );
+	pool.release(a);
+	pool.release(b);
+	assert( pool.idle() == 2 );
+	// Note: The most recently released workspace is reused first
+	{
+		SantaWorkspacePool::Lease lease(0, pool);
+		assert( &*lease == b && pool.idle() == 1 );
+	}
+	assert( pool.idle() == 2 );
+	{
+		SantaWorkspace own;
+		SantaWorkspacePool::Lease lease(&own, pool);
+		assert( &*lease == &own && pool.idle() == 2 );
+	}
+	pool.clear();
+	assert( pool.idle() == 0 );
+	
+	// Concurrent queries of the same solution agree with serial ones
+	SantaGenerator::Params params;
+	params.count              = 20000;
+	params.max_size           = 100;
+	params.collision_fraction = 0.01;
+	params.seed               = 3;
+	SantaProblem  problem;
+	SantaSolution solution;
+	SantaGenerator generator(params);
+	generator.generate(&problem, &solution);
+	SantaSolution::score_type score = solution.score();
+	const size_t nqueries = 8;
+	std::vector<int>                       collisions(nqueries);
+	std::vector<SantaSolution::score_type> scores(nqueries);
+	concurrent_query query = {&problem, &solution, &collisions, &scores};
+	parallel_for(nqueries, query);
+	for( size_t i=0; i<nqueries; ++i ) {
+		assert( collisions[i] == generator.collisions() );
+		assert( scores[i]     == score );
+	}
+	// Note: make test limits OpenMP to one thread, so the queries are also
+	//         run from std::threads, with the profiler timing them
+	Profiler& profiler = Profiler::instance();
+	profiler.setEnabled(true);
+	profiler.reset();
+	query(0);
+	size_t nregions = profiler.regions().size();
+	profiler.reset();
+	std::vector<std::thread> threads;
+	for( size_t i=0; i<nqueries; ++i ) {
+		collisions[i] = -1;
+		threads.push_back(std::thread(query, i));
+	}
+	for( size_t i=0; i<nqueries; ++i ) {
+		threads[i].join();
+		assert( collisions[i] == generator.collisions() );
+		assert( scores[i]     == score );
+	}
+	assert( profiler.regions().size() == nregions );
+#ifndef DISABLE_PROFILER
+	const Profiler::Region& validate =
+		profiler.regions()[profiler.regions()[0].children[0]];
+	assert( validate.name == "SantaSolution::validate" );
+	assert( validate.calls == (long)nqueries );
+#endif
+	profiler.reset();
+	profiler.setEnabled(false);
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_CachingAllocator() {
+	cout << "Testing class CachingAllocator" << endl;
+	CachingAllocator allocator;
+	char* a = allocator.allocate(1000);
+	char* b = allocator.allocate(700);
+	char* c = allocator.allocate(1100);
+	allocator.deallocate(a, 1000);
+	allocator.deallocate(b, 700);
+	allocator.deallocate(c, 1100);
+	assert( allocator.stats().allocations == 3 );
+	assert( allocator.stats().bytes_in_use == 0 );
+	// The smallest cached block that fits is reused, even from the next
+	//   size class, unless it would waste more than half of itself
+	assert( allocator.allocate(600) == b );
+	assert( allocator.allocate(600) == a );
+	assert( allocator.allocate(600) == c );
+	assert( allocator.stats().reuses == 3 );
+	char* d = allocator.allocate(400);
+	assert( allocator.stats().allocations == 4 );
+	assert( allocator.stats().bytes_in_use == 1000+700+1100+400 );
+	allocator.deallocate(a, 600);
+	allocator.deallocate(d, 400);
+	allocator.deallocate(c, 600);
+	bool threw = false;
+	try {
+		allocator.deallocate(a, 600);
+	}
+	catch( std::invalid_argument& ) {
+		threw = true;
+	}
+	assert( threw );
+	allocator.release();
+	assert( allocator.stats().bytes_reserved == 700 );
+	// Blocks taken after a release reuse the freed records
+	char* e = allocator.allocate(2000);
+	allocator.deallocate(b, 600);
+	allocator.deallocate(e, 2000);
+	allocator.release();
+	assert( allocator.stats().bytes_reserved == 0 );
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_SantaStreamValidator() {
+	cout << "Testing class SantaStreamValidator" << endl;
+	// Small boxes crowded into a small sleigh, so that every check fails
+	//   somewhere, with shuffled, duplicated and out-of-range IDs
+	int n = 3000;
+	int sleigh_size = 100;
+	SantaProblem problem(sleigh_size, n);
+	std::vector<int> ids(n);
+	for( int i=0; i<n; ++i ) {
+		problem[i] = thrust::make_tuple(rand()%5+1, rand()%5+1, rand()%5+1);
+		ids[i] = i + 1;
+	}
+	std::random_shuffle(ids.begin(), ids.end());
+	ids[10] = ids[20];
+	ids[30] = 0;
+	ids[40] = n + 7;
+	ids[50] = -3;
+	std::string filename = tmpnam(0);
+	std::ofstream stream(filename.c_str());
+	stream << "id,x1,y1,z1,x2,y2,z2,x3,y3,z3,x4,y4,z4,"
+	       <<    "x5,y5,z5,x6,y6,z6,x7,y7,z7,x8,y8,z8" << endl;
+	// Note: One row fewer than the problem
+	for( int i=0; i<n-1; ++i ) {
+		int lo[3], hi[3];
+		for( int d=0; d<3; ++d ) {
+			lo[d] = rand() % (sleigh_size+2);
+			hi[d] = lo[d] + rand()%5;
+		}
+		stream << ids[i];
+		for( int v=0; v<8; ++v ) {
+			stream << "," << ((v & 4) ? hi[0] : lo[0])
+			       << "," << ((v & 2) ? hi[1] : lo[1])
+			       << "," << ((v & 1) ? hi[2] : lo[2]);
+		}
+		stream << endl;
+	}
+	stream.close();
+	
+	SantaSolution solution(filename);
+	int expected[4];
+	int valid = solution.validate(problem, false, &expected[0], &expected[1],
+	                              &expected[2], &expected[3]);
+	assert( expected[0] == -1 );
+	assert( expected[1] > 0 && expected[2] > 0 && expected[3] > 0 );
+	size_t run_sizes[3] = {7, 97, 1 << 20};
+	for( int r=0; r<3; ++r ) {
+		SantaStreamValidator validator(problem, "", run_sizes[r]);
+		int counts[4];
+		assert( validator.validate(filename, &counts[0], &counts[1],
+		                           &counts[2], &counts[3]) == valid );
+		assert( validator.run_count() == (n-1 + run_sizes[r]-1) / run_sizes[r] );
+		for( int c=0; c<4; ++c ) {
+			assert( counts[c] == expected[c] );
+		}
+	}
+	remove(filename.c_str());
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_SantaShardedValidator() {
+	cout << "Testing class SantaShardedValidator" << endl;
+	// Tall presents in a small sleigh, so that many pairs straddle the
+	//   slab boundaries
+	int n = 2000;
+	int sleigh_size = 60;
+	SantaProblem problem(sleigh_size, n + 1);
+	std::vector<int> extrema[6];
+	for( int c=0; c<6; ++c ) {
+		extrema[c].resize(n);
+	}
+	for( int i=0; i<n; ++i ) {
+		int w = rand()%4+1, h = rand()%4+1, d = rand()%40+1;
+		problem[i] = (i % 10) ? thrust::make_tuple(w, h, d)
+		                      : thrust::make_tuple(w, h, d+1);
+		extrema[0][i] = rand() % (sleigh_size+1);
+		extrema[2][i] = rand() % (sleigh_size+1);
+		extrema[4][i] = rand() % 400 + 1;
+		extrema[1][i] = extrema[0][i] + w-1;
+		extrema[3][i] = extrema[2][i] + h-1;
+		extrema[5][i] = extrema[4][i] + d-1;
+	}
+	SantaSolution solution;
+	solution.assign(n, &extrema[0][0], &extrema[1][0], &extrema[2][0],
+	                &extrema[3][0], &extrema[4][0], &extrema[5][0]);
+	int expected[4];
+	int valid = solution.validate(problem, false, &expected[0], &expected[1],
+	                              &expected[2], &expected[3]);
+	assert( expected[0] == -1 );
+	assert( expected[1] > 0 && expected[2] > 0 && expected[3] > 0 );
+	int nworkers[3] = {1, 3, 8};
+	for( int w=0; w<3; ++w ) {
+		SantaShardedValidator sharded(nworkers[w]);
+		int counts[4];
+		assert( sharded.validate(problem, solution, &counts[0], &counts[1],
+		                         &counts[2], &counts[3]) == valid );
+		for( int c=0; c<4; ++c ) {
+			assert( counts[c] == expected[c] );
+		}
+	}
+	// Concurrent calls use separate shared memory segments
+	SantaShardedValidator sharded(2);
+	std::vector<int> results(4, -1);
+	std::vector<std::thread> threads;
+	for( int t=0; t<4; ++t ) {
+		threads.push_back(std::thread([&, t]() {
+			int collisions;
+			sharded.validate(problem, solution, 0, 0, 0, &collisions);
+			results[t] = collisions;
+		}));
+	}
+	for( int t=0; t<4; ++t ) {
+		threads[t].join();
+		assert( results[t] == expected[3] );
+	}
+	// Workers that cannot be waited for are reported as failures
+	signal(SIGCHLD, SIG_IGN);
+	bool threw = false;
+	try {
+		sharded.validate(problem, solution);
+	}
+	catch( std::runtime_error& ) {
+		threw = true;
+	}
+	signal(SIGCHLD, SIG_DFL);
+	assert( threw );
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_validation_server() {
+	cout << "Testing validation server" << endl;
+	SantaProblem problem(1000, 2);
+	problem[0] = thrust::make_tuple(1, 2, 3);
+	problem[1] = thrust::make_tuple(4, 5, 6);
+	FILE* requests  = tmpfile();
+	FILE* responses = tmpfile();
+	// Two presents stacked in z, then a patch that makes them collide
+	int columns[12] = {1, 1,  1, 4,  1, 1,  2, 5,  1, 4,  3, 9};
+	fprintf(requests, "binary 2\n");
+	fwrite(columns, sizeof(int), 12, requests);
+	fprintf(requests, "patch 1\n2,1,1,3,4,1,3,1,5,3,4,5,3,1,1,8,4,1,8,1,5,8,4,5,8\n");
+	fprintf(requests, "bogus\ncheck\n");
+	// An oversized binary request is rejected without losing sync
+	size_t max_count = 1 << 20;
+	fprintf(requests, "binary %lu\n", (unsigned long)(max_count + 1));
+	std::vector<int> zeros(6 * (max_count + 1), 0);
+	fwrite(&zeros[0], sizeof(int), zeros.size(), requests);
+	fprintf(requests, "patch 1\n2,1,1,4,4,1,4,1,5,4,4,5,4,1,1,9,4,1,9,1,5,9,4,5,9\n");
+	fprintf(requests, "check\nshutdown\ncheck\n");
+	rewind(requests);
+	server::Connection conn(requests, responses);
+	assert( !server::serve(conn, problem, SantaSolution::COLLISIONS_AUTO) );
+	rewind(responses);
+	std::vector<std::string> lines;
+	char buf[1024];
+	while( fgets(buf, sizeof(buf), responses) ) {
+		lines.push_back(buf);
+	}
+	assert( lines.size() == 8 );
+	assert( lines[0] == "ready presents=2\n" );
+	assert( lines[1].find("ok valid=1 size_difference=0 boundary_violations=0"
+	                      " dimension_mismatches=0 collisions=0 score=20 ")
+	        == 0 );
+	assert( lines[2].find("ok valid=0 size_difference=0 boundary_violations=0"
+	                      " dimension_mismatches=0 collisions=1 ") == 0 );
+	assert( lines[3].find("error") == 0 );
+	assert( lines[4].find("ok valid=0") == 0 );
+	assert( lines[5].find("error Binary count") == 0 );
+	assert( lines[6].find("ok valid=1") == 0 );
+	// Patches are checked incrementally, with the same result as a full check
+	for( int l=2; l<8; ++l ) {
+		lines[l] = lines[l].substr(0, lines[l].find(" time="));
+	}
+	assert( lines[2] == lines[4] && lines[6] == lines[7] );
+	fclose(requests);
+	fclose(responses);
+	
+	// A file that is not a socket is never replaced
+	std::string path = tmpnam(0);
+	std::ofstream(path.c_str()) << "data" << endl;
+	bool threw = false;
+	try {
+		server::serve_socket(path, problem, SantaSolution::COLLISIONS_AUTO);
+	}
+	catch( std::runtime_error& ) {
+		threw = true;
+	}
+	assert( threw && std::ifstream(path.c_str()) );
+	remove(path.c_str());
+	// The socket is removed when the server stops
+	std::thread server_thread(server::serve_socket, path, std::ref(problem),
+	                          SantaSolution::COLLISIONS_AUTO);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	int client = -1;
+	for( int attempt=0; attempt<1000 && client < 0; ++attempt ) {
+		client = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if( ::connect(client, (sockaddr*)&address, sizeof(address)) != 0 ) {
+			::close(client);
+			client = -1;
+			usleep(1000);
+		}
+	}
+	assert( client >= 0 );
+	assert( ::write(client, "shutdown\n", 9) == 9 );
+	server_thread.join();
+	::close(client);
+	assert( !std::ifstream(path.c_str()) );
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_find_first_violation() {
+	cout << "Testing fail-fast validation" << endl;
+	SantaGenerator::Params params;
+	params.count     = 20000;
+	params.min_size  = 1;
+	params.max_size  = 100;
+	params.z_overlap = 0.7;
+	params.seed      = 7;
+	SantaProblem  problem;
+	SantaSolution solution;
+	SantaGenerator(params).generate(&problem, &solution);
+	SantaSolution::CollisionMethod methods[] = {
+		SantaSolution::COLLISIONS_AUTO,
+		SantaSolution::COLLISIONS_SWEEP,
+		SantaSolution::COLLISIONS_GRID};
+	SantaSolution::Violation violation;
+	for( int m=0; m<3; ++m ) {
+		solution.set_collision_method(methods[m]);
+		assert( solution.find_first_violation(problem, &violation) );
+		assert( violation.check == SantaSolution::CHECK_NONE );
+	}
+	
+	// The reported pair must be one of the colliding pairs
+	params.collision_fraction = 0.01;
+	SantaGenerator(params).generate(&problem, &solution);
+	std::vector<int> ids_a, ids_b;
+	size_t npairs = solution.find_collisions(size_t(-1), &ids_a, &ids_b);
+	for( int m=0; m<3; ++m ) {
+		solution.set_collision_method(methods[m]);
+		// A capped search reports the same total and the first pairs
+		std::vector<int> first_a, first_b;
+		assert( solution.find_collisions(3, &first_a, &first_b) == npairs );
+		assert( first_a.size() == std::min((size_t)3, npairs) );
+		assert( std::equal(first_a.begin(), first_a.end(), ids_a.begin()) &&
+		        std::equal(first_b.begin(), first_b.end(), ids_b.begin()) );
+		assert( !solution.find_first_violation(problem, &violation) );
+		assert( violation.check == SantaSolution::CHECK_COLLISIONS );
+		bool listed = false;
+		for( size_t p=0; p<npairs; ++p ) {
+			listed |= (ids_a[p] == violation.present &&
+			           ids_b[p] == violation.other);
+		}
+		assert( listed );
+	}
+	int size_difference = 1, boundary_violations = 1,
+		dimension_mismatches = 1, collisions = 0;
+	assert( !solution.validate(problem, true, &size_difference,
+	                           &boundary_violations, &dimension_mismatches,
+	                           &collisions) );
+	assert( size_difference == 0 && boundary_violations == 0 &&
+	        dimension_mismatches == 0 && collisions == 1 );
+	
+	// Bounds and dimensions are checked before collisions
+	params.boundary_fraction = 0.01;
+	SantaGenerator(params).generate(&problem, &solution);
+	std::vector<int>           flagged;
+	std::vector<unsigned char> flags;
+	solution.find_violations(problem, size_t(-1), &flagged, &flags);
+	assert( !solution.find_first_violation(problem, &violation) );
+	assert( violation.check == SantaSolution::CHECK_BOUNDS ||
+	        violation.check == SantaSolution::CHECK_DIMENSIONS );
+	assert( std::find(flagged.begin(), flagged.end(), violation.present)
+	        != flagged.end() );
+	
+	solution.resize(solution.size() - 5);
+	assert( !solution.find_first_violation(problem, &violation) );
+	assert( violation.check == SantaSolution::CHECK_SIZE );
+	assert( violation.present == int(solution.size()) );
+	assert( !solution.validate(problem, true, &size_difference) );
+	assert( size_difference == -5 );
+	
+	// A bounds violation is reported ahead of an earlier dimension mismatch,
+	//   whether or not they fall in the same block
+	int n = 10000;
+	SantaProblem unit_problem(100, n);
+	solution.resize(n);
+	for( int i=0; i<n; ++i ) {
+		unit_problem[i] = thrust::make_tuple(1, 1, 1);
+		solution[i]     = thrust::make_tuple(1, 1, 1, 1, i+1, i+1);
+	}
+	solution[3] = thrust::make_tuple(1, 2, 1, 1, 4, 4);
+	int bounds_presents[2] = {7, 9000};
+	for( int b=0; b<2; ++b ) {
+		int i = bounds_presents[b];
+		solution[i] = thrust::make_tuple(101, 101, 1, 1, i+1, i+1);
+		assert( !solution.find_first_violation(unit_problem, &violation) );
+		assert( violation.check == SantaSolution::CHECK_BOUNDS );
+		assert( violation.present == i );
+		boundary_violations = 0;
+		assert( !solution.validate(unit_problem, true, 0,
+		                           &boundary_violations) );
+		assert( boundary_violations == 1 );
+		solution[i] = thrust::make_tuple(1, 1, 1, 1, i+1, i+1);
+	}
+	assert( !solution.find_first_violation(unit_problem, &violation) );
+	assert( violation.check == SantaSolution::CHECK_DIMENSIONS );
+	assert( violation.present == 3 );
+	cout << "  Tests PASSED" << endl;
+}
+
+template<typename T>
+void test_box_sweep_type() {
+	// Random boxes in a small area so that roughly half of them overlap
+	const size_t n = 1000;
+	std::vector<T> columns[4];
+	srand(1234);
+	for( size_t i=0; i<n; ++i ) {
+		T x = rand() % 100, y = rand() % 100;
+		columns[0].push_back(x); columns[1].push_back(x + rand() % 50);
+		columns[2].push_back(y); columns[3].push_back(y + rand() % 50);
+	}
+	packed_boxes<T> boxes = {&columns[0][0], &columns[1][0],
+	                         &columns[2][0], &columns[3][0]};
+	box_sweep::SimdLevel best = box_sweep::simd_level<T>();
+	for( size_t i=0; i<n; i+=7 ) {
+		// Note: Covers rows shorter than a vector and with ragged tails
+		size_t end = std::min(n, i + 1 + i % 100);
+		int expected = box_sweep::count_overlaps_scalar(boxes, i, i+1, end);
+		for( int level=box_sweep::SIMD_SCALAR; level<=best; ++level ) {
+			assert( box_sweep::count_overlaps(boxes, i, i+1, end,
+			                                  box_sweep::SimdLevel(level))
+			        == expected );
+		}
+	}
+}
+void test_box_sweep() {
+	cout << "Testing box_sweep" << endl;
+	test_box_sweep_type<int>();
+	test_box_sweep_type<int16_t>();
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_numa_placement() {
+	cout << "Testing NUMA placement" << endl;
+	std::vector<int> cpus = numa::parse_cpu_list("0-3,8,10-11");
+	assert( cpus.size() == 7 );
+	assert( cpus[3] == 3 && cpus[4] == 8 && cpus[6] == 11 );
+	std::vector<int> node_cpus = numa::nodes_cpus();
+	assert( !node_cpus.empty() );
+	int npinned = numa::pin_threads();
+	assert( npinned == 0 || npinned == host_thread_count() );
+	// Blocks either side of the mmap threshold
+	size_t sizes[2] = {100, numa::first_touch_allocator<int>::large_block};
+	for( int s=0; s<2; ++s ) {
+		thrust::device_vector<int, numa::first_touch_allocator<int> >
+			column(sizes[s], 7);
+		assert( column[0] == 7 && column[sizes[s]-1] == 7 );
+		column.resize(2*sizes[s], 3);
+		assert( column[sizes[s]-1] == 7 && column[2*sizes[s]-1] == 3 );
+	}
+	cout << "  Tests PASSED" << endl;
+}
+
+void test_Profiler() {
+	cout << "Testing class Profiler" << endl;
+	Profiler& profiler = Profiler::instance();
+	assert( !profiler.enabled() );
+	profiler.setEnabled(true);
+	profiler.reset();
+	for( int i=0; i<3; ++i ) {
+		ScopedTimer outer("outer");
+		for( int j=0; j<2; ++j ) {
+			ScopedTimer inner("inner");
+		}
+	}
+	const std::vector<Profiler::Region>& regions = profiler.regions();
+	assert( regions.size() == 3 );
+	assert( regions[0].children.size() == 1 );
+	const Profiler::Region& outer = regions[regions[0].children[0]];
+	assert( outer.name == "outer" && outer.calls == 3 );
+	assert( outer.children.size() == 1 );
+	const Profiler::Region& inner = regions[outer.children[0]];
+	assert( inner.name == "inner" && inner.calls == 6 );
+	assert( inner.min_time <= inner.max_time );
+	assert( inner.total_time <= outer.total_time );
+	
+	// Regions opened while disabled are not recorded
+	profiler.setEnabled(false);
+	{
+		ScopedTimer ignored("ignored");
+	}
+	profiler.setEnabled(true);
+	assert( profiler.regions().size() == 3 );
+	
+	// Each thread's regions nest under that thread's open regions
+	profiler.reset();
+	{
+		ScopedTimer outer("outer");
+		std::vector<std::thread> threads;
+		for( int t=0; t<8; ++t ) {
+			threads.push_back(std::thread([]() {
+				for( int i=0; i<100; ++i ) {
+					ScopedTimer worker("worker");
+					ScopedTimer inner("inner");
+				}
+			}));
+		}
+		for( int t=0; t<8; ++t ) {
+			threads[t].join();
+		}
+	}
+	assert( profiler.regions().size() == 4 );
+	const Profiler::Region& worker =
+		profiler.regions()[profiler.regions()[0].children[1]];
+	assert( worker.name == "worker" && worker.calls == 800 );
+	assert( worker.min_time <= worker.max_time );
+	assert( worker.max_time <= worker.total_time );
+	assert( profiler.regions()[worker.children[0]].calls == 800 );
+	// Each thread's tree is merged into the next report and then reset
+	std::thread([]() { ScopedTimer worker("worker"); }).join();
+	assert( profiler.regions()[profiler.regions()[0].children[1]].calls
+	        == 801 );
+	profiler.reset();
+	assert( profiler.regions().size() == 1 );
+#ifndef DISABLE_PROFILER
+	SantaProblem  problem;
+	SantaSolution solution;
+	problem.resize(10);
+	solution.resize(10);
+	profiler.reset();
+	solution.validate(problem);
+	solution.validate(problem);
+	const Profiler::Region& validate =
+		profiler.regions()[profiler.regions()[0].children[0]];
+	assert( validate.name == "SantaSolution::validate" );
+	assert( validate.calls == 2 );
+#endif
+	profiler.reset();
+	profiler.setEnabled(false);
+	cout << "  Tests PASSED" << endl;
+}
+
+#ifdef SANTA_HAVE_ZLIB
+// Writes a gzip-compressed copy of a file
+void gzip_file(std::string src_filename, std::string dst_filename) {
+	std::ifstream src(src_filename.c_str(), std::ios::binary);
+	gzFile dst = gzopen(dst_filename.c_str(), "wb1");
+	assert( dst );
+	std::vector<char> buf(1 << 16);
+	while( src.read(&buf[0], buf.size()) || src.gcount() ) {
+		gzwrite(dst, &buf[0], (unsigned)src.gcount());
+	}
+	gzclose(dst);
+}
+#endif
+
+void test_compressed_io() {
+#ifdef SANTA_HAVE_ZLIB
+	cout << "Testing compressed input" << endl;
+	// Note: Large enough to span several decoded blocks
+	size_t n = 400000;
+	SantaProblem problem(1000, n);
+	std::vector<int> xminima(n), xmaxima(n), yminima(n), ymaxima(n);
+	std::vector<int> zminima(n), zmaxima(n);
+	for( size_t i=0; i<n; ++i ) {
+		problem[i] = thrust::make_tuple(int(i%50+1), int(i%7+1), int(i%13+1));
+		xminima[i] = i%900 + 1; xmaxima[i] = xminima[i] + i%50;
+		yminima[i] = i%800 + 1; ymaxima[i] = yminima[i] + i%7;
+		zminima[i] = 13*i + 1;  zmaxima[i] = zminima[i] + i%13;
+	}
+	SantaSolution solution;
+	solution.assign(n, &xminima[0], &xmaxima[0], &yminima[0], &ymaxima[0],
+	                &zminima[0], &zmaxima[0]);
+	std::string filename    = tmpnam(0);
+	std::string gz_filename = filename + ".gz";
+	
+	problem.save(filename);
+	assert( !compressed::is_compressed(filename) );
+	gzip_file(filename, gz_filename);
+	assert( compressed::detect(gz_filename) == compressed::FORMAT_GZIP );
+	SantaProblem gz_problem(1000, gz_filename);
+	assert( gz_problem.size() == n );
+	for( size_t i=0; i<n; i+=997 ) {
+		assert( gz_problem[i] == problem[i] );
+	}
+	assert( gz_problem[n-1] == problem[n-1] );
+	assert( gz_problem.load(gz_filename, 1234) == 1234 );
+	
+	solution.save(filename);
+	gzip_file(filename, gz_filename);
+	SantaSolution gz_solution(gz_filename);
+	assert( gz_solution.size() == n );
+	for( size_t i=0; i<n; i+=997 ) {
+		assert( gz_solution[i] == solution[i] );
+	}
+	assert( gz_solution[n-1] == solution[n-1] );
+	assert( gz_solution.validate(problem) == solution.validate(problem) );
+	
+	// Truncated streams are reported rather than silently cut short
+	{
+		std::ifstream src(gz_filename.c_str(), std::ios::binary);
+		std::vector<char> data((std::istreambuf_iterator<char>(src)),
+		                       std::istreambuf_iterator<char>());
+		std::ofstream dst(filename.c_str(), std::ios::binary);
+		dst.write(&data[0], data.size() / 2);
+	}
+	bool rejected = false;
+	try {
+		gz_solution.load(filename);
+	}
+	catch( std::runtime_error& ) {
+		rejected = true;
+	}
+	assert( rejected );
+	remove(filename.c_str());
+	remove(gz_filename.c_str());
+	cout << "  Tests PASSED" << endl;
+#endif
+}
+
 int main(int argc, char* argv[])
 {
+	// Note: Sharded validation re-runs this program as its workers
+	int worker_status = SantaShardedValidator::worker_main(argc, argv);
+	if( worker_status >= 0 ) {
+		return worker_status;
+	}
+	
 	test_SantaProblem();
 	test_SantaSolution();
+	test_SantaValidationIndex();
+	test_SantaScoreContext();
+	test_SantaBatch();
+	test_SantaGenerator();
+	test_SantaWorkspace();
+	test_CachingAllocator();
+	test_SantaStreamValidator();
+	test_SantaShardedValidator();
+	test_validation_server();
+	test_compressed_io();
+	test_find_first_violation();
+	test_box_sweep();
+	test_numa_placement();
+	test_Profiler();
 	
 	cout << "----------------" << endl;
 	cout << "All tests PASSED" << endl;
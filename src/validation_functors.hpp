@@ -0,0 +1,588 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+#pragma once
+
+// Per-present and per-pair checks and score-order keys shared by
+//   SantaSolution and SantaBatch
+
+#include <algorithm>
+#include <climits>
+
+#include <stdint.h>
+
+#include <thrust/functional.h>
+#include <thrust/tuple.h>
+#include <thrust/transform.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/scan.h>
+#include <thrust/reduce.h>
+#include <thrust/gather.h>
+#include <thrust/binary_search.h>
+#include <thrust/iterator/counting_iterator.h>
+
+#include <SantaSolution.hpp>
+#include "caching_allocator.hpp"
+#include "box_sweep.hpp"
+
+typedef SantaSolution::dtype dtype;
+typedef SantaSolution::stype stype;
+
+using std::min;
+using std::max;
+
+// Branchless compare-and-swap
+template<typename T>
+__host__ __device__
+inline void cas(T& a, T& b) {
+	T a_ = a;
+	a = min(a_, b);
+	b = max(a_, b);
+}
+// Branchless sorting network
+template<typename T>
+__host__ __device__
+inline void sort3(T& a, T& b, T& c) {
+	cas(a, b);
+	cas(b, c);
+	cas(a, b);
+}
+
+struct dim_mismatch_functor
+	: public thrust::binary_function<void,void,bool> {
+	template<typename Tuple1, typename Tuple2>
+	inline __host__ __device__
+	bool operator()(Tuple1 soln_extrema, Tuple2 prob_dims) const {
+		Tuple1& s = soln_extrema;
+		Tuple2& p = prob_dims;
+		// Note: extrema define *closed* intervals
+		dtype s1 = thrust::get<1>(s) - (thrust::get<0>(s)-1);
+		dtype s2 = thrust::get<3>(s) - (thrust::get<2>(s)-1);
+		dtype s3 = thrust::get<5>(s) - (thrust::get<4>(s)-1);
+		dtype p1 = thrust::get<0>(p);
+		dtype p2 = thrust::get<1>(p);
+		dtype p3 = thrust::get<2>(p);
+		
+		// Compare after ignoring relative order (to allow arb. permutations)
+		sort3(s1, s2, s3);
+		sort3(p1, p2, p3);
+		return s1 != p1 || s2 != p2 || s3 != p3;
+	}
+};
+
+// Per-category violation counters accumulated by the fused bounds and
+//   dimensions pass
+struct validation_counts {
+	int xmin, xmax;
+	int ymin, ymax;
+	int zmin;
+	int dims;
+};
+struct validation_counts_plus
+	: public thrust::binary_function<validation_counts,
+	                                 validation_counts,
+	                                 validation_counts> {
+	inline __host__ __device__
+	validation_counts operator()(const validation_counts& a,
+	                             const validation_counts& b) const {
+		validation_counts c;
+		c.xmin = a.xmin + b.xmin; c.xmax = a.xmax + b.xmax;
+		c.ymin = a.ymin + b.ymin; c.ymax = a.ymax + b.ymax;
+		c.zmin = a.zmin + b.zmin;
+		c.dims = a.dims + b.dims;
+		return c;
+	}
+};
+// Checks the sleigh bounds of one present
+struct bounds_functor
+	: public thrust::unary_function<void,validation_counts> {
+	dtype sleigh_size;
+	bounds_functor(dtype sleigh_size_) : sleigh_size(sleigh_size_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	validation_counts operator()(Tuple soln_extrema) const {
+		Tuple& s = soln_extrema;
+		validation_counts c;
+		c.xmin = thrust::get<0>(s) <= 0;
+		c.xmax = thrust::get<1>(s) >  sleigh_size;
+		c.ymin = thrust::get<2>(s) <= 0;
+		c.ymax = thrust::get<3>(s) >  sleigh_size;
+		c.zmin = thrust::get<4>(s) <= 0;
+		// Note: No upper bound on z
+		c.dims = 0;
+		return c;
+	}
+};
+// Checks the sleigh bounds and dimensions of one present, reading each of
+//   its extrema and dimensions only once
+struct bounds_dims_functor
+	: public thrust::unary_function<void,validation_counts> {
+	bounds_functor bounds;
+	bounds_dims_functor(dtype sleigh_size_) : bounds(sleigh_size_) {}
+	template<typename Tuple>
+	inline __host__ __device__
+	validation_counts operator()(Tuple soln_and_prob) const {
+		validation_counts c = bounds(thrust::get<0>(soln_and_prob));
+		c.dims = dim_mismatch_functor()(thrust::get<0>(soln_and_prob),
+		                                thrust::get<1>(soln_and_prob));
+		return c;
+	}
+};
+
+// Determines whether boxes i and j, already gathered into sweep order,
+//   collide (in the x-y plane)
+struct packed_collision_functor
+	: public thrust::binary_function<dtype,dtype,dtype> {
+	packed_boxes<stype> boxes;
+	packed_collision_functor(packed_boxes<stype> boxes_) : boxes(boxes_) {}
+	inline __host__ __device__
+	dtype operator()(dtype i, dtype j) const {
+		return !(boxes.xmaxima[i] < boxes.xminima[j] ||
+		         boxes.xmaxima[j] < boxes.xminima[i] ||
+		         boxes.ymaxima[i] < boxes.yminima[j] ||
+		         boxes.ymaxima[j] < boxes.yminima[i]);
+	}
+};
+
+// Sums pair_func(i, j) over j in [begin, end)
+template<class BinaryFunction>
+inline __host__ __device__
+long long reduce_row_segment(const BinaryFunction& pair_func,
+                             dtype i, dtype begin, dtype end) {
+	long long result = 0;
+	for( dtype j=begin; j<end; ++j ) {
+		result += pair_func(i, j);
+	}
+	return result;
+}
+// Note: Host backends test packed boxes several at a time (see
+//         box_sweep.hpp)
+inline __host__ __device__
+long long reduce_row_segment(const packed_collision_functor& pair_func,
+                             dtype i, dtype begin, dtype end) {
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+	return box_sweep::count_overlaps_scalar(pair_func.boxes, i, begin, end);
+#else
+	return box_sweep::count_overlaps(pair_func.boxes, i, begin, end);
+#endif
+}
+// Returns the sum of pair_func(i, j) over row i of the sweep, i.e., over
+//   i < j < end
+template<class BinaryFunction>
+struct row_reduce_functor
+	: public thrust::binary_function<dtype,dtype,long long> {
+	BinaryFunction pair_func;
+	row_reduce_functor(BinaryFunction pair_func_) : pair_func(pair_func_) {}
+	inline __host__ __device__
+	long long operator()(dtype i, dtype end) const {
+		return reduce_row_segment(pair_func, i, i+1, end);
+	}
+};
+template<class BinaryFunction>
+row_reduce_functor<BinaryFunction>
+make_row_reduce_functor(BinaryFunction pair_func) {
+	return row_reduce_functor<BinaryFunction>(pair_func);
+}
+
+// Sums transform_func(i, j) over the pairs [p, end) of the flattened list
+//   of pairs (i, j) with i < j < range_ends[i], where row_offsets is the
+//   exclusive scan of the rows' lengths.
+// Note: Rows are located by binary search over row_offsets, so the cost
+//         depends only on the no. pairs, not on how they fall into rows.
+template<class BinaryFunction>
+inline __host__ __device__
+long long reduce_pair_range(const long long*      row_offsets,
+                            const dtype*          range_ends,
+                            dtype                 nrows,
+                            long long             p,
+                            long long             end,
+                            const BinaryFunction& transform_func) {
+	// Find the last row starting at or before pair p
+	dtype lo = 0;
+	dtype hi = nrows;
+	while( lo < hi ) {
+		dtype mid = lo + (hi - lo) / 2;
+		if( row_offsets[mid] <= p ) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	dtype i = lo - 1;
+	dtype j = i + 1 + dtype(p - row_offsets[i]);
+	long long result = 0;
+	while( p < end ) {
+		dtype row_end = range_ends[i];
+		if( j >= row_end ) {
+			++i;
+			j = i + 1;
+			continue;
+		}
+		// Reduce the part of row i that lies within the range at once
+		dtype segment_end = dtype(min((long long)row_end, j + (end - p)));
+		result += reduce_row_segment(transform_func, i, j, segment_end);
+		p += segment_end - j;
+		j  = segment_end;
+	}
+	return result;
+}
+// Sums transform_func(i, j) over a fixed-size tile of the flattened list
+//   of pairs (i, j) with i < j < range_ends[i]
+template<class BinaryFunction>
+struct tile_reduce_functor
+	: public thrust::unary_function<long long,long long> {
+	const long long* row_offsets;
+	const dtype*     range_ends;
+	dtype            nrows;
+	long long        npairs;
+	long long        tile_size;
+	BinaryFunction   transform_func;
+	tile_reduce_functor(const long long* row_offsets_,
+	                    const dtype*     range_ends_,
+	                    dtype            nrows_,
+	                    long long        npairs_,
+	                    long long        tile_size_,
+	                    BinaryFunction   transform_func_)
+		: row_offsets(row_offsets_), range_ends(range_ends_),
+		  nrows(nrows_), npairs(npairs_), tile_size(tile_size_),
+		  transform_func(transform_func_) {}
+	inline __host__ __device__
+	long long operator()(long long tile) const {
+		long long p = tile * tile_size;
+		return reduce_pair_range(row_offsets, range_ends, nrows,
+		                         p, min(p + tile_size, npairs),
+		                         transform_func);
+	}
+};
+// As tile_reduce_functor, but for pair lists split into segments that each
+//   start a new tile, given each tile's segment, the segments' first pairs
+//   (plus the end) and the segments' first tiles
+template<class BinaryFunction>
+struct segment_tile_reduce_functor
+	: public thrust::unary_function<long long,long long> {
+	const long long* row_offsets;
+	const dtype*     range_ends;
+	dtype            nrows;
+	const dtype*     tile_segments;
+	const long long* pair_begins;
+	const long long* tile_begins;
+	long long        tile_size;
+	BinaryFunction   transform_func;
+	segment_tile_reduce_functor(const long long* row_offsets_,
+	                            const dtype*     range_ends_,
+	                            dtype            nrows_,
+	                            const dtype*     tile_segments_,
+	                            const long long* pair_begins_,
+	                            const long long* tile_begins_,
+	                            long long        tile_size_,
+	                            BinaryFunction   transform_func_)
+		: row_offsets(row_offsets_), range_ends(range_ends_), nrows(nrows_),
+		  tile_segments(tile_segments_), pair_begins(pair_begins_),
+		  tile_begins(tile_begins_), tile_size(tile_size_),
+		  transform_func(transform_func_) {}
+	inline __host__ __device__
+	long long operator()(long long tile) const {
+		dtype     s = tile_segments[tile];
+		long long p = pair_begins[s] + (tile - tile_begins[s]) * tile_size;
+		return reduce_pair_range(row_offsets, range_ends, nrows,
+		                         p, min(p + tile_size, pair_begins[s+1]),
+		                         transform_func);
+	}
+};
+// Returns the no. pairs in row i, i.e., (i, i+1)...(i, range_ends[i]-1)
+struct span_length_functor
+	: public thrust::binary_function<dtype,dtype,long long> {
+	inline __host__ __device__
+	long long operator()(dtype begin, dtype end) const {
+		return max(end - (begin+1), 0);
+	}
+};
+// Returns the no. tiles covering the pairs [begin, end)
+struct tile_count_functor
+	: public thrust::binary_function<long long,long long,long long> {
+	long long tile_size;
+	tile_count_functor(long long tile_size_) : tile_size(tile_size_) {}
+	inline __host__ __device__
+	long long operator()(long long begin, long long end) const {
+		return (end - begin + tile_size-1) / tile_size;
+	}
+};
+
+// No. pairs that one worker of a balanced reduction tests
+// Note: Host backends use larger tiles, whose row segments are long
+//         enough to be tested several boxes at a time
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CUDA
+const long long pair_tile_size = 256;
+#else
+const long long pair_tile_size = 4096;
+#endif
+
+// Writes the exclusive scan of the lengths of the rows i < j < range_ends[i]
+//   to row_offsets[0..nrows], so that row_offsets[nrows] is the total
+inline void scan_row_lengths(CachingAllocator&      allocator,
+                             const dtype*           range_ends,
+                             dtype                  nrows,
+                             TempBuffer<long long>& row_offsets) {
+	using thrust::make_counting_iterator;
+	thrust::transform(THRUST_PAR(allocator),
+	                  make_counting_iterator<dtype>(0),
+	                  make_counting_iterator<dtype>(nrows),
+	                  thrust::device_pointer_cast(range_ends),
+	                  row_offsets.begin(),
+	                  span_length_functor());
+	row_offsets[nrows] = 0;
+	thrust::exclusive_scan(THRUST_PAR(allocator),
+	                       row_offsets.begin(), row_offsets.end(),
+	                       row_offsets.begin());
+}
+
+// Sums pair_func(i, j) over all i < j < range_ends[i], spreading the pairs
+//   evenly over the workers instead of giving each worker whole rows.
+template<class BinaryFunction>
+long long reduce_pairs_balanced(CachingAllocator& allocator,
+                                const dtype*      range_ends,
+                                dtype             nrows,
+                                BinaryFunction    pair_func) {
+	using thrust::make_counting_iterator;
+	if( nrows == 0 ) {
+		return 0;
+	}
+	TempBuffer<long long> row_offsets(allocator, nrows + 1);
+	scan_row_lengths(allocator, range_ends, nrows, row_offsets);
+	long long npairs = row_offsets[nrows];
+	long long ntiles = (npairs + pair_tile_size-1) / pair_tile_size;
+	tile_reduce_functor<BinaryFunction>
+		tile_func(row_offsets.data(), range_ends,
+		          nrows, npairs, pair_tile_size, pair_func);
+	return thrust::transform_reduce(THRUST_PAR(allocator),
+	                                make_counting_iterator<long long>(0),
+	                                make_counting_iterator<long long>(ntiles),
+	                                tile_func,
+	                                (long long)0,
+	                                thrust::plus<long long>());
+}
+
+// As reduce_pairs_balanced, but sums the pairs of each segment of rows
+//   separately, where segment s is rows [row_begins[s], row_begins[s+1])
+//   and no pair crosses segments
+// Writes the segments that have any pairs and their sums to segments and
+//   sums (each of nsegments elements) and returns the no. written
+template<class BinaryFunction>
+dtype reduce_pairs_balanced_by_segment(CachingAllocator& allocator,
+                                       const dtype*      range_ends,
+                                       dtype             nrows,
+                                       const dtype*      row_begins,
+                                       dtype             nsegments,
+                                       BinaryFunction    pair_func,
+                                       dtype*            segments,
+                                       long long*        sums) {
+	using thrust::make_counting_iterator;
+	if( nrows == 0 || nsegments == 0 ) {
+		return 0;
+	}
+	TempBuffer<long long> row_offsets(allocator, nrows + 1);
+	scan_row_lengths(allocator, range_ends, nrows, row_offsets);
+	// Note: Each segment starts a new tile, so no tile spans two of them
+	TempBuffer<long long> pair_begins(allocator, nsegments + 1);
+	TempBuffer<long long> tile_begins(allocator, nsegments + 1);
+	// Note: Raw pointers keep every range below of one iterator type
+	long long* pairs = pair_begins.data();
+	long long* tiles = tile_begins.data();
+	thrust::gather(THRUST_PAR(allocator),
+	               row_begins, row_begins + nsegments + 1,
+	               row_offsets.data(),
+	               pairs);
+	thrust::transform(THRUST_PAR(allocator),
+	                  pairs, pairs + nsegments, pairs + 1,
+	                  tiles,
+	                  tile_count_functor(pair_tile_size));
+	tile_begins[nsegments] = 0;
+	thrust::exclusive_scan(THRUST_PAR(allocator),
+	                       tiles, tiles + nsegments + 1, tiles);
+	long long ntiles = tile_begins[nsegments];
+	if( ntiles == 0 ) {
+		return 0;
+	}
+	TempBuffer<dtype>     tile_segments(allocator, ntiles);
+	TempBuffer<long long> tile_sums(allocator, ntiles);
+	// The segment of each tile is the first whose tiles end after it
+	thrust::upper_bound(THRUST_PAR(allocator),
+	                    tiles + 1, tiles + nsegments + 1,
+	                    make_counting_iterator<long long>(0),
+	                    make_counting_iterator<long long>(ntiles),
+	                    tile_segments.begin());
+	segment_tile_reduce_functor<BinaryFunction>
+		tile_func(row_offsets.data(), range_ends, nrows,
+		          tile_segments.data(), pair_begins.data(),
+		          tile_begins.data(), pair_tile_size, pair_func);
+	thrust::transform(THRUST_PAR(allocator),
+	                  make_counting_iterator<long long>(0),
+	                  make_counting_iterator<long long>(ntiles),
+	                  tile_sums.begin(),
+	                  tile_func);
+	return thrust::reduce_by_key(THRUST_PAR(allocator),
+	                             tile_segments.data(),
+	                             tile_segments.data() + ntiles,
+	                             tile_sums.data(),
+	                             segments, sums).first
+		- segments;
+}
+
+// Lowers *address to value if it is smaller, atomically
+inline __host__ __device__
+void atomic_min(int* address, int value) {
+#ifdef __CUDA_ARCH__
+	atomicMin(address, value);
+#else
+	int old = *(volatile int*)address;
+	while( value < old ) {
+		int prev = __sync_val_compare_and_swap(address, old, value);
+		if( prev == old ) {
+			break;
+		}
+		old = prev;
+	}
+#endif
+}
+// Shared state through which the workers of a fail-fast pass stop as soon
+//   as any one of them finds a violation
+// Note: *first holds the lowest index reported before the workers
+//         stopped, or INT_MAX while nothing has been reported.
+struct stop_flag {
+	int* first;
+	inline __host__ __device__
+	bool stopped() const { return *(volatile int*)first != INT_MAX; }
+	inline __host__ __device__
+	void report(int index) const { atomic_min(first, index); }
+};
+// Reports the first present in a block of block_size that violates the
+//   sleigh bounds, or else the first that mismatches its dimensions
+// Note: Bounds violations are reported as index i and dimension mismatches
+//         as size + i, so that the lowest key is always a bounds violation
+//         when there is one. Only a bounds violation stops the workers.
+// Note: The stop flag is polled once per block, and the block is only
+//         searched for the present once it is known to contain one, so
+//         that the loop over the block stays as cheap as the counting pass.
+template<class CountFunction, class Iterator>
+struct first_violation_functor {
+	CountFunction count_func;
+	Iterator      presents;
+	dtype         size;
+	dtype         block_size;
+	stop_flag     stop;
+	inline __host__ __device__
+	int bounds_violations(const validation_counts& c) const {
+		return c.xmin | c.xmax | c.ymin | c.ymax | c.zmin;
+	}
+	inline __host__ __device__
+	void operator()(dtype block) const {
+		if( *(volatile int*)stop.first < size ) {
+			return;
+		}
+		dtype    begin = block * block_size;
+		dtype    end   = min(size, begin + block_size);
+		Iterator first = presents + begin;
+		Iterator last  = presents + end;
+		int any_bounds = 0;
+		int any_dims   = 0;
+		for( Iterator it=first; it!=last; ++it ) {
+			validation_counts c = count_func(*it);
+			any_bounds |= bounds_violations(c);
+			any_dims   |= c.dims;
+		}
+		if( any_bounds ) {
+			dtype i = begin;
+			for( Iterator it=first; !bounds_violations(count_func(*it)); ++it ) {
+				++i;
+			}
+			stop.report(i);
+		}
+		else if( any_dims ) {
+			dtype i = begin;
+			for( Iterator it=first; !count_func(*it).dims; ++it ) {
+				++i;
+			}
+			stop.report(size + i);
+		}
+	}
+};
+// Reports row i of a sweep if pair_func(i, j) is nonzero for any
+//   i < j < end, polling the stop flag between segments of the row
+// Note: Applied to (i, end) tuples
+template<class BinaryFunction>
+struct first_pair_functor {
+	BinaryFunction pair_func;
+	stop_flag      stop;
+	template<typename Tuple>
+	inline __host__ __device__
+	void operator()(Tuple row) const {
+		const dtype segment_size = 1024;
+		dtype i   = thrust::get<0>(row);
+		dtype end = thrust::get<1>(row);
+		for( dtype j=i+1; j<end; j+=segment_size ) {
+			if( stop.stopped() ) {
+				return;
+			}
+			dtype segment_end = min(end, j + segment_size);
+			if( reduce_row_segment(pair_func, i, j, segment_end) ) {
+				stop.report(i);
+				return;
+			}
+		}
+	}
+};
+// Returns whether pair_func(i, j) is nonzero, for a fixed i
+template<class BinaryFunction>
+struct row_pair_predicate
+	: public thrust::unary_function<dtype,bool> {
+	BinaryFunction pair_func;
+	dtype          i;
+	row_pair_predicate(BinaryFunction pair_func_, dtype i_)
+		: pair_func(pair_func_), i(i_) {}
+	inline __host__ __device__
+	bool operator()(dtype j) const { return pair_func(i, j) != 0; }
+};
+
+// Packs (zmax, id) into a key whose unsigned order is the score order,
+//   i.e., zmax descending then ID ascending
+struct score_key_functor
+	: public thrust::binary_function<dtype, dtype, uint64_t> {
+	inline __host__ __device__
+	uint64_t operator()(dtype zmax, dtype id) const {
+		// Note: Flipping the sign bit maps signed to unsigned order
+		uint32_t z = ~((uint32_t)zmax ^ 0x80000000u);
+		return ((uint64_t)z << 32) | (uint32_t)id;
+	}
+};
+inline __host__ __device__
+dtype score_key_zmax(uint64_t key) {
+	return (dtype)(~(uint32_t)(key >> 32) ^ 0x80000000u);
+}
+// Returns abs(id - i), where id is unpacked from a score key
+struct key_abs_diff_functor
+	: public thrust::binary_function<uint64_t, long long, long long> {
+	inline __host__ __device__
+	long long operator()(uint64_t key, long long i) const {
+		long long id = (uint32_t)key;
+		return id > i ? id - i : i - id;
+	}
+};
@@ -0,0 +1,412 @@
+/*
+* Copyright 2013 Ben Barsdell
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+By Ben Barsdell (2013)
+benbarsdell@gmail.com
+*/
+
+
+/*
+  Resident validation server used by check_solution --serve
+    Connection     - line-based request stream over a pair of stdio files
+    Session        - one client's current solution and request handling
+    serve          - serves one client until it quits
+    serve_socket   - serves clients of a Unix domain socket, one at a time
+
+  Protocol: each request is one line, optionally followed by a payload, and
+    gets one response line. The server greets each client with
+      ready presents=<no. presents in the problem>
+    Requests:
+      load <path>       Check the solution file at path (csv or binary)
+      binary <count>    Check the solution whose extrema follow as 6 raw
+                          columns of count native 32-bit ints in ID order
+                          (xmin, xmax, ymin, ymax, zmin, zmax); count may
+                          be at most max(2 x presents, 2^20)
+      patch <nrows>     Apply nrows csv rows (id,x1,y1,z1,...,x8,y8,z8)
+                          to the current solution and check it, re-checking
+                          only the patched presents
+      check             Check the current solution again
+      quit              Close the connection
+      shutdown          Close the connection and stop the server
+    Responses:
+      ok valid=<0|1> size_difference=<n> boundary_violations=<n>
+         dimension_mismatches=<n> collisions=<n> score=<n> time=<s>
+      error <message>
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <climits>
+#include <new>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <SantaProblem.hpp>
+#include <SantaSolution.hpp>
+#include <SantaWorkspace.hpp>
+#include <SantaValidationIndex.hpp>
+#include <SantaScoreContext.hpp>
+
+#include "stopwatch.hpp"
+#include "file_io.hpp"
+#include "solution_csv.hpp"
+
+namespace server {
+
+class Connection {
+	FILE* m_in;
+	FILE* m_out;
+	Connection(const Connection&);
+	Connection& operator=(const Connection&);
+public:
+	Connection(FILE* in, FILE* out) : m_in(in), m_out(out) {}
+	// Reads one line without its newline; returns false at end of stream
+	bool read_line(std::string* line) {
+		line->clear();
+		int c;
+		while( (c = fgetc(m_in)) != EOF && c != '\n' ) {
+			*line += (char)c;
+		}
+		if( !line->empty() && (*line)[line->size()-1] == '\r' ) {
+			line->resize(line->size()-1);
+		}
+		return c != EOF || !line->empty();
+	}
+	bool read_bytes(void* data, size_t bytes) {
+		return fread(data, 1, bytes, m_in) == bytes;
+	}
+	void write_line(const std::string& line) {
+		fputs(line.c_str(), m_out);
+		fputc('\n', m_out);
+		fflush(m_out);
+	}
+};
+
+class Session {
+	typedef SantaSolution::dtype dtype;
+	const SantaProblem&   m_problem;
+	SantaSolution         m_solution;
+	SantaWorkspace        m_workspace;
+	// Incremental state for patches, built by the first patch of a solution
+	SantaValidationIndex* m_index;
+	SantaScoreContext*    m_context;
+	Session(const Session&);
+	Session& operator=(const Session&);
+	void discard_incremental() {
+		delete m_index;
+		delete m_context;
+		m_index   = 0;
+		m_context = 0;
+	}
+	// Validates and scores the current solution
+	std::string check() {
+		Stopwatch timer;
+		timer.start();
+		int size_difference, boundary_violations,
+			dimension_mismatches, collisions;
+		bool valid = m_solution.validate(m_problem, false,
+		                                 &size_difference,
+		                                 &boundary_violations,
+		                                 &dimension_mismatches,
+		                                 &collisions,
+		                                 &m_workspace);
+		SantaSolution::score_type score = m_solution.score(&m_workspace);
+		timer.stop();
+		return response(valid, size_difference, boundary_violations,
+		                dimension_mismatches, collisions, score,
+		                timer.getTime());
+	}
+	static std::string response(bool valid, int size_difference,
+	                            int boundary_violations,
+	                            int dimension_mismatches, int collisions,
+	                            SantaSolution::score_type score, double time) {
+		std::ostringstream response;
+		response << "ok valid=" << valid
+		         << " size_difference=" << size_difference
+		         << " boundary_violations=" << boundary_violations
+		         << " dimension_mismatches=" << dimension_mismatches
+		         << " collisions=" << collisions
+		         << " score=" << score
+		         << " time=" << time;
+		return response.str();
+	}
+	std::string load(const std::string& path) {
+		discard_incremental();
+		if( SantaSolution::is_binary(path) ) {
+			m_solution.load_binary(path);
+		}
+		else {
+			m_solution.load(path);
+		}
+		return check();
+	}
+	// Reads and discards the payload of a rejected binary request
+	static void skip_binary(Connection& conn, size_t count) {
+		const size_t block_rows = 4096;
+		std::vector<dtype> block(6 * block_rows);
+		for( size_t r=0; r<count; r+=block_rows ) {
+			size_t rows = std::min(block_rows, count - r);
+			if( !conn.read_bytes(&block[0], 6 * rows * sizeof(dtype)) ) {
+				throw std::runtime_error("Truncated binary payload");
+			}
+		}
+	}
+	std::string binary(Connection& conn, size_t count) {
+		// Note: The count comes from the client, so it is bounded before
+		//         anything is allocated, and a rejected payload is still
+		//         consumed to keep the stream in sync
+		size_t max_count = std::min(size_t(INT_MAX / 6),
+		                            std::max(2 * m_problem.size(),
+		                                     size_t(1) << 20));
+		std::vector<dtype> columns;
+		bool fits = count <= max_count;
+		if( fits ) {
+			try {
+				columns.resize(6 * count);
+			}
+			catch( std::bad_alloc& ) {
+				fits = false;
+			}
+		}
+		if( !fits ) {
+			skip_binary(conn, count);
+			std::ostringstream error;
+			error << "Binary count " << count << " exceeds " << max_count;
+			throw std::runtime_error(error.str());
+		}
+		if( count > 0 && !conn.read_bytes(&columns[0],
+		                                  columns.size() * sizeof(dtype)) ) {
+			throw std::runtime_error("Truncated binary payload");
+		}
+		discard_incremental();
+		const dtype* c = count > 0 ? &columns[0] : 0;
+		m_solution.assign(count, c, c + count, c + 2*count, c + 3*count,
+		                  c + 4*count, c + 5*count);
+		return check();
+	}
+	std::string patch(Connection& conn, size_t nrows) {
+		// Note: All rows are read before any are applied, so that a
+		//         malformed request leaves the stream in sync
+		std::string rows, line;
+		for( size_t r=0; r<nrows; ++r ) {
+			if( !conn.read_line(&line) ) {
+				throw std::runtime_error("Truncated patch");
+			}
+			rows += line;
+			rows += '\n';
+		}
+		Stopwatch timer;
+		timer.start();
+		csv::CsvChunks chunks(rows.data(), rows.data() + rows.size(), false);
+		size_t n = chunks.rows();
+		std::vector<dtype> ids(n);
+		std::vector<dtype> xminima(n), xmaxima(n);
+		std::vector<dtype> yminima(n), ymaxima(n);
+		std::vector<dtype> zminima(n), zmaxima(n);
+		if( n > 0 ) {
+			solution_row_parser parser = {&ids[0],
+			                              &xminima[0], &xmaxima[0],
+			                              &yminima[0], &ymaxima[0],
+			                              &zminima[0], &zmaxima[0]};
+			chunks.for_each_row(n, parser);
+			// Note: The solution checks the IDs and values before the
+			//         incremental state is touched
+			m_solution.update(n, &ids[0],
+			                  &xminima[0], &xmaxima[0],
+			                  &yminima[0], &ymaxima[0],
+			                  &zminima[0], &zmaxima[0]);
+		}
+		if( !m_index ) {
+			m_index   = new SantaValidationIndex(m_problem, m_solution);
+			m_context = new SantaScoreContext(m_solution);
+		}
+		else if( n > 0 ) {
+			m_index->update(n, &ids[0],
+			                &xminima[0], &xmaxima[0],
+			                &yminima[0], &ymaxima[0],
+			                &zminima[0], &zmaxima[0]);
+			m_context->update(n, &ids[0], &zmaxima[0]);
+		}
+		int size_difference, boundary_violations,
+			dimension_mismatches, collisions;
+		bool valid = m_index->validate(&size_difference,
+		                               &boundary_violations,
+		                               &dimension_mismatches,
+		                               &collisions);
+		SantaSolution::score_type score = m_context->score();
+		timer.stop();
+		return response(valid, size_difference, boundary_violations,
+		                dimension_mismatches, collisions, score,
+		                timer.getTime());
+	}
+public:
+	enum Status { CONTINUE, QUIT, SHUTDOWN };
+	Session(const SantaProblem&            problem,
+	        SantaSolution::CollisionMethod collision_method)
+		: m_problem(problem), m_index(0), m_context(0) {
+		m_solution.set_collision_method(collision_method);
+	}
+	~Session() { discard_incremental(); }
+	// Handles one request, writing its response to conn
+	Status handle(const std::string& request, Connection& conn) {
+		std::istringstream words(request);
+		std::string command, argument;
+		words >> command;
+		std::getline(words >> std::ws, argument);
+		if( command.empty() ) {
+			return CONTINUE;
+		}
+		if( command == "quit" ) {
+			return QUIT;
+		}
+		if( command == "shutdown" ) {
+			return SHUTDOWN;
+		}
+		std::string response;
+		try {
+			if( command == "load" && !argument.empty() ) {
+				response = load(argument);
+			}
+			else if( command == "binary" && !argument.empty() ) {
+				response = binary(conn, strtoul(argument.c_str(), 0, 10));
+			}
+			else if( command == "patch" && !argument.empty() ) {
+				response = patch(conn, strtoul(argument.c_str(), 0, 10));
+			}
+			else if( command == "check" ) {
+				response = check();
+			}
+			else {
+				response = "error unknown request: " + request;
+			}
+		}
+		catch( std::exception& e ) {
+			response = std::string("error ") + e.what();
+		}
+		conn.write_line(response);
+		return CONTINUE;
+	}
+};
+
+// Serves requests from one client until it quits or disconnects
+// Returns false if the client asked the server to shut down
+inline bool serve(Connection&                   conn,
+                  const SantaProblem&            problem,
+                  SantaSolution::CollisionMethod collision_method) {
+	Session session(problem, collision_method);
+	std::ostringstream greeting;
+	greeting << "ready presents=" << problem.size();
+	conn.write_line(greeting.str());
+	std::string request;
+	while( conn.read_line(&request) ) {
+		Session::Status status = session.handle(request, conn);
+		if( status != Session::CONTINUE ) {
+			return status != Session::SHUTDOWN;
+		}
+	}
+	return true;
+}
+
+// Closes a listening socket and removes its path, however serving ends
+class ListenerGuard {
+	int         m_fd;
+	std::string m_path;
+	ListenerGuard(const ListenerGuard&);
+	ListenerGuard& operator=(const ListenerGuard&);
+public:
+	ListenerGuard(int fd, const std::string& path) : m_fd(fd), m_path(path) {}
+	~ListenerGuard() {
+		::close(m_fd);
+		::unlink(m_path.c_str());
+	}
+};
+
+// Listens on a Unix domain socket at path, serving one client at a time
+//   until one of them sends shutdown
+// Note: A stale socket left at path is replaced, but any other file there
+//         is an error (so that a mistyped path cannot delete data)
+inline void serve_socket(const std::string&             path,
+                         const SantaProblem&            problem,
+                         SantaSolution::CollisionMethod collision_method) {
+	sockaddr_un address;
+	if( path.size() >= sizeof(address.sun_path) ) {
+		throw std::runtime_error("Socket path too long: " + path);
+	}
+	struct stat existing;
+	if( ::lstat(path.c_str(), &existing) == 0 ) {
+		if( !S_ISSOCK(existing.st_mode) ) {
+			throw std::runtime_error(path + ": path exists and is not a socket");
+		}
+		::unlink(path.c_str());
+	}
+	int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if( listener < 0 ) {
+		throw std::runtime_error("Failed to create socket");
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	if( ::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ) {
+		::close(listener);
+		throw std::runtime_error("Failed to listen on " + path);
+	}
+	ListenerGuard guard(listener, path);
+	if( ::listen(listener, 16) != 0 ) {
+		throw std::runtime_error("Failed to listen on " + path);
+	}
+	// Note: A client that disconnects mid-response must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	bool running = true;
+	while( running ) {
+		int client = ::accept(listener, 0, 0);
+		if( client < 0 ) {
+			continue;
+		}
+		FILE* in = fdopen(client, "r");
+		if( !in ) {
+			::close(client);
+			continue;
+		}
+		FILE* out = fdopen(::dup(client), "w");
+		if( out ) {
+			Connection conn(in, out);
+			try {
+				running = serve(conn, problem, collision_method);
+			}
+			catch( ... ) {
+				fclose(out);
+				fclose(in);
+				throw;
+			}
+			fclose(out);
+		}
+		fclose(in);
+	}
+}
+
+} // namespace server